@@ -9,6 +9,7 @@
 
 #include "core/libcamera_encoder.hpp"
 #include "encoder/null_encoder.hpp"
+#include "encoder/rawz_encoder.hpp"
 #include "output/output.hpp"
 
 using namespace std::placeholders;
@@ -19,8 +20,16 @@ public:
 	LibcameraRaw() : LibcameraEncoder() {}
 
 protected:
-	// Force the use of "null" encoder.
-	void createEncoder() { encoder_ = std::unique_ptr<Encoder>(new NullEncoder(GetOptions())); }
+	// Write the frames as they are with the "null" encoder, unless they're to be compressed.
+	void createEncoder()
+	{
+		StreamInfo info;
+		RawStream(&info);
+		if (GetOptions()->codec == "rawz")
+			encoder_ = std::unique_ptr<Encoder>(new RawzEncoder(GetOptions(), info));
+		else
+			encoder_ = std::unique_ptr<Encoder>(new NullEncoder(GetOptions()));
+	}
 };
 
 // The main even loop for the application.
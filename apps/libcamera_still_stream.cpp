@@ -5,16 +5,20 @@
  * libcamera_vid.cpp - libcamera video record app.
  */
 
+#include <atomic>
 #include <chrono>
-#include <poll.h>
+#include <cinttypes>
 #include <signal.h>
-#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <pigpio.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "core/event_loop.hpp"
 #include "core/frame_info.hpp"
 #include "core/libcamera_encoder.hpp"
+#include "core/trigger_log.hpp"
+#include "core/trigger_ring.hpp"
 #include "output/output.hpp"
 
 using namespace std::placeholders;
@@ -33,66 +37,61 @@ void gpioMutexHandler(int gpio, int level, uint32_t tick)
    pthread_mutex_unlock(&lock);
 }
 
-static int gpio_received;
+// GPIO triggers are handed to the event loop through this. Without a trigger ring, the
+// interrupt only needs to say that a trigger happened, and when.
+static EventNotifier gpio_notifier;
+static std::atomic<int64_t> gpio_edge;
+static std::unique_ptr<TriggerRing> trigger_ring;
 void gpioHandler(int gpio, int level, uint32_t tick)
 {
    printf("Interrupt level %d at %u\n", level, tick);
-   gpio_received = gpio;
+   // The tick says when the edge actually happened, so take off however long ago that was.
+   uint32_t age_us = gpioTick() - tick;
+   int64_t edge = TriggerRing::Now() - age_us * 1000LL;
+   if (trigger_ring)
+      trigger_ring->AddEdge(edge);
+   else
+   {
+      gpio_edge = edge;
+      gpio_notifier.Notify();
+   }
 }
 
-// Some keypress/signal handling.
-
-static int signal_received;
-static void default_signal_handler(int signal_number)
-{
-	signal_received = signal_number;
-	std::cerr << "Received signal " << signal_number << std::endl;
-}
+// Some keypress/signal handling. These all arrive through the event loop.
 
 // config reload signal
-static void reload_config_handler(int signal_number)
+static void reload_config()
 {
-	std::cerr << "Received SIGHUP " << signal_number << std::endl;
+	std::cerr << "Reloading configuration" << std::endl;
+	// As in libcamera-vid, leave alone the options that other threads are using.
+	VideoOptions new_options;
+	if (!new_options.Parse(argc_, argv_))
+		return;
 	VideoOptions *options = app.GetOptions();
-	if (options->Parse(argc_, argv_))
-	{
-		if (options->verbose)
-			options->Print();
+	options->CopyRuntimeSettings(new_options);
+	if (options->verbose)
+		options->Print();
 
-		libcamera::ControlList controls = app.GetControls();
-		app.SetControls(controls);
-	}
+	libcamera::ControlList controls = app.GetControls();
+	app.SetControls(controls);
+	app.ReloadPostProcessing(options->post_process_file);
 }
 
-static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
+// Pass the first character of each line typed to handle_key. Returns false once stdin closes.
+static bool read_keys(std::function<void(int)> const &handle_key)
 {
-	int key = 0;
-	if (options->keypress)
-	{
-		poll(p, 1, 0);
-		if (p[0].revents & POLLIN)
-		{
-			char *user_string = nullptr;
-			size_t len;
-			[[maybe_unused]] size_t r = getline(&user_string, &len, stdin);
-			key = user_string[0];
-		}
-	}
-	if (options->signal)
+	static bool line_start = true;
+	char buf[256];
+	ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+	if (n <= 0)
+		return n < 0 && errno == EAGAIN;
+	for (ssize_t i = 0; i < n; i++)
 	{
-		if (signal_received == SIGUSR1)
-			key = '\n';
-		else if (signal_received == SIGUSR2)
-			key = 'x';
-		signal_received = 0;
+		if (line_start)
+			handle_key(buf[i]);
+		line_start = buf[i] == '\n';
 	}
-
-	if (gpio_received)
-	{
-		key = '\n';
-		gpio_received = 0;
-	}
-	return key;
+	return true;
 }
 
 static int get_colourspace_flags(std::string const &codec)
@@ -103,20 +102,103 @@ static int get_colourspace_flags(std::string const &codec)
 		return LibcameraEncoder::FLAG_VIDEO_NONE;
 }
 
+// The --monitor stream gets options of its own, so that its encoder and output can differ
+// from those of the triggered captures.
+static std::unique_ptr<VideoOptions> make_monitor_options()
+{
+	auto options = std::make_unique<VideoOptions>();
+	options->Parse(argc_, argv_);
+	options->codec = options->monitor_codec;
+	options->output = options->monitor;
+	options->bitrate = options->monitor_bitrate;
+	options->width = options->lores_width;
+	options->height = options->lores_height;
+	options->encode_policy = "drop-newest:2";
+	options->save_pts.clear();
+	return options;
+}
+
 // The main even loop for the application.
 
 static void event_loop(LibcameraEncoder &app)
 {
 	VideoOptions const *options = app.GetOptions();
+
+	// This must come before anything starts any threads (pigpio included). pigpio installs
+	// its own signal handlers during init, but blocked signals never reach them.
+	EventLoop loop;
+	bool enabled = false;
+	int64_t enabled_edge = 0;
+	bool stop = false;
+	auto trigger = [&](int64_t edge) {
+		if (trigger_ring)
+			trigger_ring->AddEdge(edge);
+		else
+			enabled = true, enabled_edge = edge;
+	};
+	auto handle_key = [&](int key) {
+		if (key == '\n')
+			trigger(TriggerRing::Now());
+		else if (key == 'x' || key == 'X')
+			stop = true, loop.Quit();
+	};
+	loop.AddSignals({ SIGUSR1, SIGUSR2, SIGHUP }, [&](int signal_number) {
+		std::cerr << "Received signal " << signal_number << std::endl;
+		if (signal_number == SIGHUP)
+			reload_config();
+		else if (options->signal)
+			handle_key(signal_number == SIGUSR1 ? '\n' : 'x');
+	});
+
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+	std::unique_ptr<TriggerLog> trigger_log;
+	if (!options->trigger_log.empty())
+		trigger_log = std::make_unique<TriggerLog>(options->trigger_log, options->camera);
+	app.SetEncodeOutputReadyCallback([&](void *mem, size_t size, int64_t timestamp_us, bool keyframe) {
+		if (trigger_log)
+			trigger_log->Encoded(timestamp_us);
+		output->OutputReady(mem, size, timestamp_us, keyframe);
+		if (trigger_log)
+			trigger_log->Written(timestamp_us);
+	});
+	auto log_trigger = [&](int64_t edge, CompletedRequestPtr &completed_request) {
+		libcamera::ControlList const &metadata = completed_request->metadata;
+		int64_t sensor_timestamp =
+			metadata.contains(controls::SensorTimestamp) ? metadata.get(controls::SensorTimestamp) : 0;
+		int32_t exposure_time = metadata.contains(controls::ExposureTime) ? metadata.get(controls::ExposureTime) : 0;
+		trigger_log->Triggered(edge, sensor_timestamp, exposure_time);
+	};
 
 	app.OpenCamera();
 	app.ConfigureVideo(get_colourspace_flags(options->codec));
+	// The ring holds on to its frames, so the camera and the encoder need a buffer each besides.
+	if (options->trigger_history && options->trigger_history + 2 > app.BufferCount())
+		throw std::runtime_error("--trigger-history " + std::to_string(options->trigger_history) + " needs at least " +
+								 std::to_string(options->trigger_history + 2) + " buffers, but only " +
+								 std::to_string(app.BufferCount()) + " were allocated, so raise --buffer-count");
 	app.StartEncoder();
 
+	// Monitoring video from the lores stream runs all the time, whatever the triggers do.
+	std::unique_ptr<VideoOptions> monitor_options;
+	std::unique_ptr<Output> monitor_output;
+	if (!options->monitor.empty())
+	{
+		monitor_options = make_monitor_options();
+		monitor_output = std::unique_ptr<Output>(Output::Create(monitor_options.get()));
+		app.StartLoresEncoder(monitor_options.get(),
+							  std::bind(&Output::OutputReady, monitor_output.get(), _1, _2, _3, _4));
+	}
+
+	// A scheduled start replaces the GPIO handshake, and its fixed sleeps, for starting the
+	// cameras in the rig together.
+	int64_t start_us = app.ScheduledStart();
+
 	// Intended for GPIO firing of a capture
-	if(options->gpio == 0 || options->gpio == 3) {
+	if (start_us) {
+		if (options->verbose)
+			fprintf(stderr, "Starting at rig time %" PRId64 "us\n", start_us);
+	}
+	else if(options->gpio == 0 || options->gpio == 3) {
 		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
 		pthread_mutex_init(&lock, &attr);
 		gpioInitialise();
@@ -147,76 +229,121 @@ static void event_loop(LibcameraEncoder &app)
 		gpioTerminate();
 	}
 
-	if (options->gpio == 3) {
+	if (!start_us && options->gpio == 3) {
 		if (options->verbose)
 			fprintf(stderr, "Sleeping a bit\n");
-		sleep(0.030);
+		usleep(30000);
 	}
 
-	app.StartCamera();
-	auto start_time = std::chrono::high_resolution_clock::now();
-
-	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
+	app.StartCameraAt(start_us);
 
-	bool enabled = false;
+	std::unique_ptr<SimulatedTrigger> simulated_trigger;
+	if (options->trigger_history)
+	{
+		trigger_ring = std::make_unique<TriggerRing>(options->trigger_history);
+		if (options->trigger_simulate)
+			simulated_trigger = std::make_unique<SimulatedTrigger>(
+				options->trigger_simulate, [](int64_t timestamp) { trigger_ring->AddEdge(timestamp); });
+	}
 
 	gpioInitialise();
 
-	// Monitoring for keypresses and signals.
-	// do this after gpioInitialise because for some genious reason
-	// this library overrides signals during init
-	signal(SIGUSR1, default_signal_handler);
-	signal(SIGUSR2, default_signal_handler);
-	signal(SIGHUP, reload_config_handler);
-
 	gpioSetMode(GPIO_TRIGGER_INDEX, PI_INPUT);
 	gpioSetPullUpDown(GPIO_TRIGGER_INDEX, PI_PUD_UP);
 	gpioSetISRFunc(GPIO_TRIGGER_INDEX, RISING_EDGE, 0, gpioHandler);
 
-	for (unsigned int count = 0; ; count++)
+	loop.Add(gpio_notifier.Fd(), [&]() {
+		if (gpio_notifier.Consume())
+			trigger(gpio_edge);
+	});
+
+	if (options->keypress)
 	{
-		LibcameraEncoder::Msg msg = app.Wait();
-		if (msg.type == LibcameraEncoder::MsgType::Quit)
-			return;
-		else if (msg.type != LibcameraEncoder::MsgType::RequestComplete)
-			throw std::runtime_error("unrecognised message!");
-		int key = get_key_or_signal(options, p);
-		if (key == '\n') {
-			enabled = true;
-		}
+		loop.Add(STDIN_FILENO, [&]() {
+			if (!read_keys(handle_key))
+				loop.Remove(STDIN_FILENO);
+		});
+	}
 
-		if (options->verbose)
-			std::cerr << "Viewfinder frame " << count << std::endl;
-		auto now = std::chrono::high_resolution_clock::now();
-		bool timeout = !options->frames && options->timeout &&
-					   (now - start_time > std::chrono::milliseconds(options->timeout));
-		bool frameout = options->frames && count >= options->frames;
-		if (timeout || frameout || key == 'x' || key == 'X')
+	if (!options->frames && options->timeout)
+	{
+		loop.SetTimeout(std::chrono::milliseconds(options->timeout), [&]() {
+			std::cerr << "Halting: reached timeout of " << options->timeout << " milliseconds.\n";
+			stop = true;
+			loop.Quit();
+		});
+	}
+
+	unsigned int count = 0;
+	loop.Add(app.MessageFd(), [&]() {
+		while (auto msg = app.TryWait())
 		{
-			if (timeout)
-				std::cerr << "Halting: reached timeout of " << options->timeout << " milliseconds.\n";
-			app.StopCamera(); // stop complains if encoder very slow to close
-			app.StopEncoder();
-			return;
-		}
+			if (msg->type == LibcameraEncoder::MsgType::Quit)
+				return loop.Quit();
+			else if (msg->type != LibcameraEncoder::MsgType::RequestComplete)
+				throw std::runtime_error("unrecognised message!");
 
-		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-
-		FrameInfo frame_info(completed_request->metadata);
-		frame_info.fps = completed_request->framerate;
-		frame_info.sequence = completed_request->sequence;
-		std::string format = "FrameInfo frame=%frame fps=%fps exposure=%exp analog_gain=%ag "
-		                     "digital_gain=%dg red_gain=%rg blue_gain=%bg focus=%focus "
-		                     "aelock=%aelock colour_temp=%temp frame_duration=%fd lux=%lux";
-		std::cerr << frame_info.ToString(format) << std::endl;
-		if (enabled) {
-			app.EncodeBuffer(completed_request, app.VideoStream());
-			app.ShowPreview(completed_request, app.VideoStream());
-			enabled = false;
 			if (options->verbose)
 				std::cerr << "Viewfinder frame " << count << std::endl;
+			if (options->frames && count >= options->frames)
+			{
+				stop = true;
+				return loop.Quit();
+			}
+			count++;
+
+			CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg->payload);
+			app.TrackPhase(completed_request);
+			if (monitor_output)
+				app.EncodeLoresBuffer(completed_request);
+
+			FrameInfo frame_info(completed_request->metadata);
+			frame_info.fps = completed_request->framerate;
+			frame_info.sequence = completed_request->sequence;
+			std::string format = "FrameInfo frame=%frame fps=%fps exposure=%exp analog_gain=%ag "
+								 "digital_gain=%dg red_gain=%rg blue_gain=%bg focus=%focus "
+								 "aelock=%aelock colour_temp=%temp frame_duration=%fd lux=%lux";
+			std::cerr << frame_info.ToString(format) << std::endl;
+			if (trigger_ring)
+			{
+				for (auto &match : trigger_ring->AddFrame(completed_request))
+				{
+					if (trigger_log)
+						log_trigger(match.edge, match.completed_request);
+					app.EncodeBuffer(match.completed_request, app.VideoStream());
+					app.ShowPreview(match.completed_request, app.VideoStream());
+					std::cerr << "Trigger at " << match.edge << " selected frame "
+							  << match.completed_request->sequence << " (" << match.offset / 1000
+							  << "us into the exposure)" << std::endl;
+				}
+			}
+			else if (enabled)
+			{
+				if (trigger_log)
+					log_trigger(enabled_edge, completed_request);
+				app.EncodeBuffer(completed_request, app.VideoStream());
+				app.ShowPreview(completed_request, app.VideoStream());
+				enabled = false;
+			}
 		}
+	});
+
+	loop.Run();
+
+	simulated_trigger.reset();
+	if (trigger_ring)
+	{
+		if (trigger_ring->Missed())
+			std::cerr << "Missed " << trigger_ring->Missed() << " triggers, try a longer --trigger-history"
+					  << std::endl;
+		trigger_ring->Clear();
 	}
+	if (stop)
+		app.StopCamera(); // stop complains if encoder very slow to close
+	// The monitor output is about to go, so its encoder must go first.
+	app.StopLoresEncoder();
+	if (stop)
+		app.StopEncoder();
 	gpioTerminate();
 }
 
@@ -6,48 +6,65 @@
  */
 
 #include <chrono>
-#include <poll.h>
+#include <sstream>
 #include <signal.h>
-#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include "core/bitrate_controller.hpp"
+#include "core/equirect_stitcher.hpp"
+#include "core/event_loop.hpp"
+#include "core/frame_grouper.hpp"
 #include "core/libcamera_encoder.hpp"
+#include "encoder/encoder.hpp"
 #include "output/output.hpp"
 
 using namespace std::placeholders;
 
-// Some keypress/signal handling.
+// Some keypress/signal handling. These all arrive through the event loop.
 
-static int signal_received;
-static void default_signal_handler(int signal_number)
+// SIGHUP re-reads the options (including any config file) and the post-processing file,
+// which takes effect without restarting the camera. The encoder and output threads are still
+// reading the app's options, so we parse into new ones and copy over only what can change.
+static void reload_config(LibcameraEncoder &app, int argc, char *argv[])
 {
-	signal_received = signal_number;
-	std::cerr << "Received signal " << signal_number << std::endl;
+	std::cerr << "Reloading configuration" << std::endl;
+	VideoOptions new_options;
+	if (!new_options.Parse(argc, argv))
+		return;
+	VideoOptions *options = app.GetOptions();
+	uint32_t bitrate = options->bitrate;
+	float framerate = options->framerate;
+	options->CopyRuntimeSettings(new_options);
+	if (options->verbose)
+		options->Print();
+
+	libcamera::ControlList controls = app.GetControls();
+	app.SetControls(controls);
+	app.ReloadPostProcessing(options->post_process_file);
+
+	// The encoder can take a new bitrate or frame rate as it goes.
+	if (options->bitrate != bitrate && !app.SetBitrate(options->bitrate))
+		std::cerr << "WARNING: the encoder can't change its bitrate" << std::endl;
+	if (options->framerate != framerate && options->framerate > 0)
+		app.SetFramerate(options->framerate);
 }
 
-static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
+// Pass the first character of each line typed to handle_key. Returns false once stdin closes.
+static bool read_keys(std::function<void(int)> const &handle_key)
 {
-	int key = 0;
-	if (options->keypress)
+	static bool line_start = true;
+	char buf[256];
+	ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+	if (n <= 0)
+		return n < 0 && errno == EAGAIN;
+	for (ssize_t i = 0; i < n; i++)
 	{
-		poll(p, 1, 0);
-		if (p[0].revents & POLLIN)
-		{
-			char *user_string = nullptr;
-			size_t len;
-			[[maybe_unused]] size_t r = getline(&user_string, &len, stdin);
-			key = user_string[0];
-		}
+		if (line_start)
+			handle_key(buf[i]);
+		line_start = buf[i] == '\n';
 	}
-	if (options->signal)
-	{
-		if (signal_received == SIGUSR1)
-			key = '\n';
-		else if (signal_received == SIGUSR2)
-			key = 'x';
-		signal_received = 0;
-	}
-	return key;
+	return true;
 }
 
 static int get_colourspace_flags(std::string const &codec)
@@ -58,54 +75,289 @@ static int get_colourspace_flags(std::string const &codec)
 		return LibcameraEncoder::FLAG_VIDEO_NONE;
 }
 
-// The main even loop for the application.
+// With --cameras we record from each camera with its own app, encoder and output, all
+// in this process. The first camera uses the app that parsed the command line.
 
-static void event_loop(LibcameraEncoder &app)
+struct Recorder
+{
+	std::unique_ptr<Output> output;
+	std::unique_ptr<LibcameraEncoder> owned_app;
+	LibcameraEncoder *app;
+	unsigned int count = 0;
+	std::unique_ptr<BitrateController> bitrate_controller;
+};
+
+static std::vector<Recorder> make_recorders(LibcameraEncoder &app, int argc, char *argv[])
 {
 	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+	std::vector<Recorder> recorders(1);
+	recorders[0].app = &app;
+	if (options->cameras.empty())
+		return recorders;
+
+	std::vector<unsigned int> indexes;
+	std::stringstream ss(options->cameras);
+	for (std::string index; std::getline(ss, index, ',');)
+		indexes.push_back(std::stoul(index));
+	if (indexes.size() > 1 && !options->output.empty() && options->output.find('#') == std::string::npos)
+		throw std::runtime_error("with several cameras, put a # in the output name for the camera index");
+	// Each publisher binds its own socket, and would otherwise unlink the last one's.
+	if (indexes.size() > 1 && !options->exposure_publish.empty() &&
+		options->exposure_publish.find('#') == std::string::npos)
+		throw std::runtime_error("with several cameras, put a # in the --exposure-publish path for the camera index");
+
+	recorders.resize(indexes.size());
+	for (unsigned int i = 0; i < indexes.size(); i++)
+	{
+		if (i)
+		{
+			recorders[i].owned_app = std::make_unique<LibcameraEncoder>();
+			recorders[i].app = recorders[i].owned_app.get();
+			recorders[i].app->GetOptions()->Parse(argc, argv);
+			recorders[i].app->GetOptions()->nopreview = true; // only the first camera gets a preview
+		}
+		VideoOptions *camera_options = recorders[i].app->GetOptions();
+		camera_options->camera = indexes[i];
+		for (std::string *name : { &camera_options->output, &camera_options->metadata_out,
+								   &camera_options->exposure_publish })
+		{
+			size_t pos = name->find('#');
+			if (pos != std::string::npos)
+				name->replace(pos, 1, std::to_string(indexes[i]));
+		}
+	}
+	return recorders;
+}
 
-	app.OpenCamera();
-	app.ConfigureVideo(get_colourspace_flags(options->codec));
-	app.StartEncoder();
-	app.StartCamera();
-	auto start_time = std::chrono::high_resolution_clock::now();
+// With --stitch, each group of frames is stitched into a panorama, which gets an encoder and
+// output of its own. The panorama buffers go round in a ring, and if the encoder still has
+// all of them, we skip that group.
 
-	// Monitoring for keypresses and signals.
-	signal(SIGUSR1, default_signal_handler);
-	signal(SIGUSR2, default_signal_handler);
-	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
+class Panorama
+{
+public:
+	static constexpr unsigned int NUM_BUFFERS = 3;
+
+	Panorama(int argc, char *argv[], unsigned int num_cameras)
+	{
+		options_.Parse(argc, argv);
+		options_.codec = options_.stitch_codec;
+		options_.output = options_.stitch_output;
+		options_.save_pts.clear(); // that belongs to the first camera
+		stitcher_ = std::make_unique<EquirectStitcher>(options_.stitch, options_.stitch_threads);
+		if (stitcher_->NumCameras() != num_cameras)
+			throw std::runtime_error("stitching LUT is for " + std::to_string(stitcher_->NumCameras()) +
+									 " cameras, not " + std::to_string(num_cameras));
+		for (auto &buffer : buffers_)
+			buffer.resize(stitcher_->OutputSize());
+
+		output_ = std::unique_ptr<Output>(Output::Create(&options_));
+		encoder_ = std::unique_ptr<Encoder>(Encoder::Create(&options_, stitcher_->OutputInfo()));
+		encoder_->SetInputDoneCallback([this](void *) { busy_--; });
+		encoder_->SetOutputReadyCallback(std::bind(&Output::OutputReady, output_.get(), _1, _2, _3, _4));
+	}
+	~Panorama()
+	{
+		encoder_.reset();
+		if (dropped_)
+			std::cerr << "Skipped " << dropped_ << " panoramas while the encoder was busy" << std::endl;
+	}
 
-	for (unsigned int count = 0; ; count++)
+	void Stitch(FrameGrouper::Group &group, std::vector<LibcameraEncoder *> const &apps)
 	{
-		LibcameraEncoder::Msg msg = app.Wait();
-		if (msg.type == LibcameraEncoder::MsgType::Quit)
+		if (busy_ == NUM_BUFFERS)
+		{
+			dropped_++;
 			return;
-		else if (msg.type != LibcameraEncoder::MsgType::RequestComplete)
-			throw std::runtime_error("unrecognised message!");
-		int key = get_key_or_signal(options, p);
+		}
+
+		std::vector<uint8_t const *> inputs;
+		std::vector<StreamInfo> infos;
+		for (unsigned int i = 0; i < group.size(); i++)
+		{
+			libcamera::Stream *stream = apps[i]->VideoStream();
+			inputs.push_back(apps[i]->Mmap(group[i]->buffers[stream])[0].data());
+			infos.push_back(apps[i]->GetStreamInfo(stream));
+		}
+		std::vector<uint8_t> &buffer = buffers_[next_buffer_];
+		next_buffer_ = (next_buffer_ + 1) % NUM_BUFFERS;
+		stitcher_->Stitch(inputs, infos, buffer.data());
+
+		// All the frames in a group were taken together, so we use the first one's time.
+		libcamera::ControlList const &metadata = group[0]->metadata;
+		int64_t timestamp_us = metadata.contains(controls::SensorTimestamp)
+								   ? metadata.get(controls::SensorTimestamp) / 1000
+								   : 0;
+		busy_++;
+		encoder_->EncodeBuffer(-1, buffer.size(), buffer.data(), stitcher_->OutputInfo(), metadata, timestamp_us);
+	}
+
+private:
+	VideoOptions options_;
+	std::unique_ptr<EquirectStitcher> stitcher_;
+	std::vector<uint8_t> buffers_[NUM_BUFFERS];
+	unsigned int next_buffer_ = 0;
+	std::atomic<unsigned int> busy_ = 0;
+	uint64_t dropped_ = 0;
+	std::unique_ptr<Output> output_;
+	std::unique_ptr<Encoder> encoder_;
+};
+
+// The main even loop for the application.
+
+static void event_loop(LibcameraEncoder &app, int argc, char *argv[])
+{
+	VideoOptions const *options = app.GetOptions();
+
+	// This must come before anything starts any threads.
+	EventLoop loop;
+	std::vector<Recorder> recorders;
+	auto handle_key = [&](int key) {
 		if (key == '\n')
-			output->Signal();
-
-		if (options->verbose)
-			std::cerr << "Viewfinder frame " << count << std::endl;
-		auto now = std::chrono::high_resolution_clock::now();
-		bool timeout = !options->frames && options->timeout &&
-					   (now - start_time > std::chrono::milliseconds(options->timeout));
-		bool frameout = options->frames && count >= options->frames;
-		if (timeout || frameout || key == 'x' || key == 'X')
 		{
-			if (timeout)
-				std::cerr << "Halting: reached timeout of " << options->timeout << " milliseconds.\n";
-			app.StopCamera(); // stop complains if encoder very slow to close
-			app.StopEncoder();
-			return;
+			for (auto &recorder : recorders)
+				recorder.output->Signal();
+		}
+		else if (key == 'k' || key == 'K')
+		{
+			for (auto &recorder : recorders)
+				recorder.app->RequestKeyframe();
 		}
+		else if (key == 'x' || key == 'X')
+			loop.Quit();
+	};
+	loop.AddSignals({ SIGUSR1, SIGUSR2, SIGHUP }, [&](int signal_number) {
+		std::cerr << "Received signal " << signal_number << std::endl;
+		if (signal_number == SIGHUP)
+		{
+			for (auto &recorder : recorders)
+				reload_config(*recorder.app, argc, argv);
+		}
+		else if (options->signal)
+			handle_key(signal_number == SIGUSR1 ? '\n' : 'x');
+	});
+
+	recorders = make_recorders(app, argc, argv);
+	for (auto &recorder : recorders)
+	{
+		VideoOptions const *camera_options = recorder.app->GetOptions();
+		recorder.output = std::unique_ptr<Output>(Output::Create(camera_options));
+		recorder.app->SetEncodeOutputReadyCallback(
+			std::bind(&Output::OutputReady, recorder.output.get(), _1, _2, _3, _4));
+		LibcameraEncoder *camera_app = recorder.app;
+		recorder.output->SetKeyframeRequestCallback([camera_app]() { camera_app->RequestKeyframe(); });
+		if (camera_options->adaptive_bitrate)
+		{
+			recorder.bitrate_controller =
+				std::make_unique<BitrateController>(camera_options->adaptive_bitrate, camera_options->bitrate);
+			BitrateController *controller = recorder.bitrate_controller.get();
+			bool verbose = camera_options->verbose;
+			recorder.output->SetLinkStatsCallback([=](int64_t send_time_us, size_t frame_bytes, size_t queued_bytes) {
+				int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+									 std::chrono::steady_clock::now().time_since_epoch())
+									 .count();
+				if (auto bitrate = controller->Update(now_us, send_time_us, frame_bytes, queued_bytes))
+				{
+					if (verbose)
+						std::cerr << "Bitrate now " << *bitrate << std::endl;
+					camera_app->SetBitrate(*bitrate);
+				}
+			});
+		}
+		recorder.app->OpenCamera();
+		recorder.app->ConfigureVideo(get_colourspace_flags(camera_options->codec));
+		recorder.app->StartEncoder();
+	}
+	// Start the cameras together, so that their first frames are as close as possible, and at
+	// the rig's scheduled start time if it has one.
+	int64_t start_us = app.ScheduledStart();
+	for (auto &recorder : recorders)
+		recorder.app->StartCameraAt(start_us);
 
-		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		app.EncodeBuffer(completed_request, app.VideoStream());
-		app.ShowPreview(completed_request, app.VideoStream());
+	if (options->keypress)
+	{
+		loop.Add(STDIN_FILENO, [&]() {
+			if (!read_keys(handle_key))
+				loop.Remove(STDIN_FILENO);
+		});
+	}
+
+	if (!options->frames && options->timeout)
+	{
+		loop.SetTimeout(std::chrono::milliseconds(options->timeout), [&]() {
+			std::cerr << "Halting: reached timeout of " << options->timeout << " milliseconds.\n";
+			loop.Quit();
+		});
+	}
+
+	auto encode = [](Recorder &recorder, CompletedRequestPtr &completed_request) {
+		recorder.app->EncodeBuffer(completed_request, recorder.app->VideoStream());
+		recorder.app->ShowPreview(completed_request, recorder.app->VideoStream());
+	};
+	std::unique_ptr<FrameGrouper> grouper;
+	if (recorders.size() > 1 && options->group_tolerance)
+		grouper = std::make_unique<FrameGrouper>(recorders.size(), options->group_tolerance);
+	std::unique_ptr<Panorama> panorama;
+	std::vector<LibcameraEncoder *> apps;
+	for (auto &recorder : recorders)
+		apps.push_back(recorder.app);
+	if (grouper && !options->stitch.empty())
+		panorama = std::make_unique<Panorama>(argc, argv, recorders.size());
+
+	for (unsigned int i = 0; i < recorders.size(); i++)
+	{
+		loop.Add(recorders[i].app->MessageFd(), [&, i]() {
+			Recorder &recorder = recorders[i];
+			while (auto msg = recorder.app->TryWait())
+			{
+				if (msg->type == LibcameraEncoder::MsgType::Quit)
+					return loop.Quit();
+				else if (msg->type != LibcameraEncoder::MsgType::RequestComplete)
+					throw std::runtime_error("unrecognised message!");
+
+				if (options->verbose)
+					std::cerr << "Viewfinder frame " << recorder.count << " camera "
+							  << recorder.app->GetOptions()->camera << std::endl;
+				if (options->frames && recorder.count >= options->frames)
+					return loop.Quit();
+				recorder.count++;
+
+				CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg->payload);
+				recorder.app->TrackPhase(completed_request);
+				if (!grouper)
+				{
+					encode(recorder, completed_request);
+					continue;
+				}
+				for (auto &group : grouper->Add(i, completed_request))
+				{
+					for (unsigned int j = 0; j < group.size(); j++)
+						encode(recorders[j], group[j]);
+					if (panorama)
+						panorama->Stitch(group, apps);
+				}
+			}
+		});
+	}
+
+	loop.Run();
+
+	if (grouper)
+	{
+		if (grouper->Discarded())
+			std::cerr << "Discarded " << grouper->Discarded() << " frames with no partner from every camera"
+					  << std::endl;
+		grouper->Clear();
+	}
+	panorama.reset();
+	for (auto &recorder : recorders)
+		recorder.app->StopCamera(); // stop complains if encoder very slow to close
+	for (auto &recorder : recorders)
+	{
+		recorder.app->StopEncoder();
+		if (recorder.bitrate_controller && recorder.bitrate_controller->Decreases())
+			std::cerr << "Bitrate was cut " << recorder.bitrate_controller->Decreases() << " times, ending at "
+					  << recorder.bitrate_controller->Bitrate() << std::endl;
 	}
 }
 
@@ -120,7 +372,7 @@ int main(int argc, char *argv[])
 			if (options->verbose)
 				options->Print();
 
-			event_loop(app);
+			event_loop(app, argc, argv);
 		}
 	}
 	catch (std::exception const &e)
@@ -0,0 +1,240 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * bench.cpp - benchmark harness for libcamera-apps.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+
+#include <boost/program_options.hpp>
+
+#include "bench/bench.hpp"
+#include "core/version.hpp"
+
+// Count every allocation made through operator new, so that we can report how much
+// each frame allocates. This catches all the libraries we link against, too.
+
+static std::atomic<uint64_t> allocated_bytes;
+static std::atomic<uint64_t> allocation_count;
+
+void *operator new(size_t size)
+{
+	allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+uint64_t AllocatedBytes()
+{
+	return allocated_bytes.load(std::memory_order_relaxed);
+}
+
+uint64_t AllocationCount()
+{
+	return allocation_count.load(std::memory_order_relaxed);
+}
+
+static std::map<std::string, BenchFunc> &benchmarks()
+{
+	static std::map<std::string, BenchFunc> benchmarks;
+	return benchmarks;
+}
+
+RegisterBenchmark::RegisterBenchmark(char const *name, BenchFunc func)
+{
+	benchmarks()[std::string(name)] = func;
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+	if (values.empty())
+		return 0;
+	size_t n = std::min(values.size() - 1, (size_t)(p * values.size()));
+	std::nth_element(values.begin(), values.begin() + n, values.end());
+	return values[n];
+}
+
+void BenchRunner::Run(std::string const &name, std::function<void()> fn)
+{
+	using namespace std::chrono;
+
+	// One untimed call, so that caches are warm and one-off allocations are done.
+	fn();
+
+	std::vector<double> latencies;
+	latencies.reserve(100000);
+	uint64_t bytes = AllocatedBytes(), allocs = AllocationCount();
+	steady_clock::time_point start = steady_clock::now(), now = start;
+	while (latencies.size() < config_.min_frames || duration<double>(now - start).count() < config_.min_time)
+	{
+		steady_clock::time_point t = now;
+		fn();
+		now = steady_clock::now();
+		latencies.push_back(duration<double, std::micro>(now - t).count());
+	}
+	bytes = AllocatedBytes() - bytes;
+	allocs = AllocationCount() - allocs;
+
+	Report(name, latencies, duration<double>(now - start).count(), bytes, allocs);
+}
+
+void BenchRunner::Report(std::string const &name, std::vector<double> &latencies_us, double elapsed_s,
+						 uint64_t bytes, uint64_t allocs)
+{
+	BenchResult result;
+	result.name = name;
+	result.frames = latencies_us.size();
+	if (result.frames)
+	{
+		result.fps = elapsed_s > 0 ? result.frames / elapsed_s : 0;
+		result.latency_p50_us = percentile(latencies_us, 0.5);
+		result.latency_p99_us = percentile(latencies_us, 0.99);
+		result.bytes_per_frame = (double)bytes / result.frames;
+		result.allocs_per_frame = (double)allocs / result.frames;
+	}
+
+	std::cerr << name << ": " << result.frames << " frames, " << result.fps << " fps, p50 " << result.latency_p50_us
+			  << "us, p99 " << result.latency_p99_us << "us, " << result.bytes_per_frame << " bytes/frame"
+			  << std::endl;
+	results_.push_back(result);
+}
+
+StreamInfo Yuv420Info(unsigned int width, unsigned int height)
+{
+	StreamInfo info;
+	info.width = width;
+	info.height = height;
+	info.stride = (width + 63) & ~63;
+	return info;
+}
+
+std::vector<uint8_t> MakeTestImage(size_t size, unsigned int width)
+{
+	// Gentle gradients with a little noise compress (and filter) roughly like real images.
+	std::vector<uint8_t> image(size);
+	std::minstd_rand rng(1);
+	for (size_t i = 0; i < size; i++)
+	{
+		unsigned int x = i % width, y = i / width;
+		image[i] = ((x + y) / 8 + (x * y) / 4096 + (rng() & 7)) & 0xff;
+	}
+	return image;
+}
+
+static void write_json(std::ostream &os, std::vector<BenchResult> const &results)
+{
+	os << "{\n";
+	os << "\t\"version\": \"" << LibcameraAppsVersion() << "\",\n";
+	os << "\t\"benchmarks\": [";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		BenchResult const &r = results[i];
+		os << (i ? ",\n" : "\n") << "\t\t{ \"name\": \"" << r.name << "\", \"frames\": " << r.frames
+		   << ", \"fps\": " << r.fps << ", \"latency_p50_us\": " << r.latency_p50_us
+		   << ", \"latency_p99_us\": " << r.latency_p99_us << ", \"bytes_allocated_per_frame\": " << r.bytes_per_frame
+		   << ", \"allocations_per_frame\": " << r.allocs_per_frame << " }";
+	}
+	os << "\n\t]\n}\n";
+}
+
+int main(int argc, char *argv[])
+{
+	using namespace boost::program_options;
+
+	try
+	{
+		BenchConfig config;
+		std::string filter, output;
+		bool help, list;
+		options_description options("Valid options are", 120, 80);
+		// clang-format off
+		options.add_options()
+			("help,h", value<bool>(&help)->default_value(false)->implicit_value(true),
+			 "Print this help message")
+			("list", value<bool>(&list)->default_value(false)->implicit_value(true),
+			 "List the available benchmarks")
+			("filter", value<std::string>(&filter),
+			 "Only run benchmarks whose names contain this string")
+			("time", value<double>(&config.min_time)->default_value(2.0),
+			 "Minimum time (in seconds) to spend in each benchmark")
+			("frames", value<unsigned int>(&config.min_frames)->default_value(10),
+			 "Minimum number of frames for each benchmark")
+			("output,o", value<std::string>(&output),
+			 "Write the JSON results to this file, rather than stdout")
+			;
+		// clang-format on
+		variables_map vm;
+		store(parse_command_line(argc, argv, options), vm);
+		notify(vm);
+
+		if (help)
+		{
+			std::cerr << options;
+			return 0;
+		}
+
+		BenchRunner runner(config);
+		for (auto const &bench : benchmarks())
+		{
+			if (list)
+				std::cout << bench.first << std::endl;
+			else if (bench.first.find(filter) != std::string::npos)
+				bench.second(runner);
+		}
+		if (list)
+			return 0;
+
+		if (output.empty())
+			write_json(std::cout, runner.Results());
+		else
+		{
+			std::ofstream ofs(output);
+			if (!ofs)
+				throw std::runtime_error("failed to open " + output);
+			write_json(ofs, runner.Results());
+		}
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * bench.hpp - benchmark harness for libcamera-apps.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "core/stream_info.hpp"
+
+// Every "iteration" of a benchmark stands for one frame, so that kernels and whole
+// pipelines are reported in the same units.
+
+struct BenchResult
+{
+	std::string name;
+	unsigned int frames = 0;
+	double fps = 0;
+	double latency_p50_us = 0;
+	double latency_p99_us = 0;
+	double bytes_per_frame = 0; // allocated through operator new
+	double allocs_per_frame = 0;
+};
+
+struct BenchConfig
+{
+	double min_time; // seconds to spend in each benchmark
+	unsigned int min_frames;
+};
+
+class BenchRunner
+{
+public:
+	BenchRunner(BenchConfig const &config) : config_(config) {}
+	BenchConfig const &Config() const { return config_; }
+	// Time fn, one call per frame.
+	void Run(std::string const &name, std::function<void()> fn);
+	// For benchmarks that measure their own per-frame latencies.
+	void Report(std::string const &name, std::vector<double> &latencies_us, double elapsed_s, uint64_t bytes,
+				uint64_t allocs);
+	std::vector<BenchResult> const &Results() const { return results_; }
+
+private:
+	BenchConfig config_;
+	std::vector<BenchResult> results_;
+};
+
+// Counters for everything allocated through operator new, by any thread.
+uint64_t AllocatedBytes();
+uint64_t AllocationCount();
+
+// A YUV420 or raw image with some plausible looking structure and noise in it.
+StreamInfo Yuv420Info(unsigned int width, unsigned int height);
+std::vector<uint8_t> MakeTestImage(size_t size, unsigned int width);
+
+typedef void (*BenchFunc)(BenchRunner &runner);
+struct RegisterBenchmark
+{
+	RegisterBenchmark(char const *name, BenchFunc func);
+};
@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * kernels.cpp - microbenchmarks for the per-frame hot spots.
+ */
+
+#include <cstdlib>
+
+#include <libcamera/control_ids.h>
+
+#include "bench/bench.hpp"
+#include "core/frame_info.hpp"
+#include "core/libcamera_app.hpp"
+#include "core/options.hpp"
+#include "image/image.hpp"
+#include "output/circular_output.hpp"
+#include "post_processing_stages/hdr_image.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+static void bench_yuv420_to_rgb(BenchRunner &runner)
+{
+	StreamInfo src_info = Yuv420Info(1920, 1080);
+	std::vector<uint8_t> src = MakeTestImage(src_info.stride * src_info.height * 3 / 2, src_info.stride);
+
+	// This is how the TFLite stages use it, picking a small RGB image out of the lores stream.
+	StreamInfo lores_info = Yuv420Info(640, 480);
+	StreamInfo dst_info;
+	dst_info.width = dst_info.stride = 300;
+	dst_info.height = 300;
+	dst_info.stride *= 3;
+	runner.Run("Yuv420ToRgb_640x480_to_300x300",
+			   [&]() { std::vector<uint8_t> rgb = PostProcessingStage::Yuv420ToRgb(src.data(), lores_info, dst_info); });
+
+	dst_info.width = 1920, dst_info.height = 1080, dst_info.stride = 1920 * 3;
+	runner.Run("Yuv420ToRgb_1920x1080",
+			   [&]() { std::vector<uint8_t> rgb = PostProcessingStage::Yuv420ToRgb(src.data(), src_info, dst_info); });
+}
+
+static void bench_unpack(BenchRunner &runner)
+{
+	StreamInfo info;
+	info.width = 4056, info.height = 3040;
+	std::vector<uint16_t> dest(info.width * info.height);
+
+	info.stride = ((info.width * 10 / 8) + 31) & ~31;
+	std::vector<uint8_t> src10 = MakeTestImage(info.stride * info.height, info.stride);
+	runner.Run("unpack_10bit_4056x3040", [&]() { unpack_10bit(src10.data(), info, dest.data()); });
+
+	info.stride = ((info.width * 12 / 8) + 31) & ~31;
+	std::vector<uint8_t> src12 = MakeTestImage(info.stride * info.height, info.stride);
+	runner.Run("unpack_12bit_4056x3040", [&]() { unpack_12bit(src12.data(), info, dest.data()); });
+}
+
+static void bench_hdr_lp_filter(BenchRunner &runner)
+{
+	// The filter runs on the Y channel of the accumulated image, scaled to 12 bits.
+	int width = 1920, height = 1080;
+	HdrImage image(width, height, width * height);
+	std::vector<uint8_t> src = MakeTestImage(width * height, width);
+	for (int i = 0; i < width * height; i++)
+		image.P(i) = src[i] * 16;
+	image.dynamic_range = 4096;
+
+	// These are the settings from assets/hdr.json.
+	LpFilterConfig config;
+	config.strength = 0.2;
+	config.threshold = Pwl({ { 0, 10.0 }, { 2048, 205.0 }, { 4095, 205.0 } });
+
+	runner.Run("HdrImage_LpFilter_1920x1080", [&]() { HdrImage lp = image.LpFilter(config); });
+}
+
+static void bench_jpeg(BenchRunner &runner)
+{
+	StreamInfo info = Yuv420Info(1920, 1080);
+	std::vector<uint8_t> src = MakeTestImage(info.stride * info.height * 3 / 2, info.stride);
+
+	runner.Run("YUV420_to_JPEG_fast_1920x1080_q93", [&]() {
+		uint8_t *jpeg_buffer = nullptr;
+		size_t jpeg_len;
+		jpeg_encode_yuv420(src.data(), info, 93, 0, jpeg_buffer, jpeg_len);
+		free(jpeg_buffer);
+	});
+}
+
+static void bench_circular_buffer(BenchRunner &runner)
+{
+	// Roughly one frame of 1080p30 H.264 at the default bitrate, into the default 4MB buffer.
+	CircularBuffer cb(4 * 1024 * 1024);
+	std::vector<uint8_t> frame = MakeTestImage(40000, 1000);
+	runner.Run("CircularBuffer_Write_40KB", [&]() { cb.Write(frame.data(), frame.size()); });
+}
+
+static void bench_frame_info(BenchRunner &runner)
+{
+	libcamera::ControlList metadata(controls::controls);
+	metadata.set(controls::ExposureTime, 10000);
+	metadata.set(controls::AnalogueGain, 2.0f);
+	metadata.set(controls::DigitalGain, 1.0f);
+	metadata.set(controls::ColourGains, { 1.5f, 1.8f });
+	metadata.set(controls::FocusFoM, 1000);
+	metadata.set(controls::Lux, 400.0f);
+
+	FrameInfo frame_info(metadata);
+	frame_info.sequence = 1234;
+	frame_info.fps = 30;
+	std::string info_text = "#%frame (%fps fps) exp %exp ag %ag dg %dg"; // the default
+
+	runner.Run("FrameInfo_ToString", [&]() { std::string s = frame_info.ToString(info_text); });
+}
+
+// The motion detector runs on a real LibcameraApp, with the frames coming from the
+// synthetic frame source, as it needs the app to tell it about the lores stream.
+
+static void bench_motion_detect(BenchRunner &runner)
+{
+	auto it = GetPostProcessingStages().find("motion_detect");
+	if (it == GetPostProcessingStages().end())
+		return;
+
+	LibcameraApp app;
+	char const *argv[] = { "libcamera-bench", "--frame-source", "synthetic", "--framerate", "0", "--nopreview",
+						   "--viewfinder-width", "640", "--viewfinder-height", "480",
+						   "--lores-width", "128", "--lores-height", "96" };
+	app.GetOptions()->Parse(sizeof(argv) / sizeof(argv[0]), const_cast<char **>(argv));
+	app.OpenCamera();
+	app.ConfigureViewfinder();
+
+	std::unique_ptr<PostProcessingStage> stage(it->second(&app));
+	boost::property_tree::ptree params;
+	params.put("roi_x", 0.1), params.put("roi_y", 0.1);
+	params.put("roi_width", 0.8), params.put("roi_height", 0.8);
+	params.put("frame_period", 0); // so that every frame is processed
+	stage->Read(params);
+	stage->Configure();
+
+	app.StartCamera();
+	CompletedRequestPtr frames[2];
+	for (auto &frame : frames)
+	{
+		LibcameraApp::Msg msg = app.Wait();
+		if (msg.type != LibcameraApp::MsgType::RequestComplete)
+			throw std::runtime_error("no frame for motion detect benchmark");
+		frame = std::get<CompletedRequestPtr>(msg.payload);
+	}
+
+	unsigned int i = 0;
+	runner.Run("MotionDetectStage_Process_128x96", [&]() { stage->Process(frames[i++ & 1]); });
+
+	frames[0].reset(), frames[1].reset();
+	app.StopCamera();
+	stage->Teardown();
+}
+
+static RegisterBenchmark reg_yuv420_to_rgb("Yuv420ToRgb", &bench_yuv420_to_rgb);
+static RegisterBenchmark reg_unpack("unpack", &bench_unpack);
+static RegisterBenchmark reg_hdr_lp_filter("HdrImage_LpFilter", &bench_hdr_lp_filter);
+static RegisterBenchmark reg_jpeg("YUV420_to_JPEG_fast", &bench_jpeg);
+static RegisterBenchmark reg_circular_buffer("CircularBuffer", &bench_circular_buffer);
+static RegisterBenchmark reg_frame_info("FrameInfo", &bench_frame_info);
+static RegisterBenchmark reg_motion_detect("MotionDetectStage", &bench_motion_detect);
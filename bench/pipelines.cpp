@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * pipelines.cpp - whole pipeline benchmarks, from frame source to output.
+ */
+
+#include <unistd.h>
+
+#include <chrono>
+#include <mutex>
+
+#include "bench/bench.hpp"
+#include "core/libcamera_encoder.hpp"
+#include "output/output.hpp"
+
+using namespace std::placeholders;
+
+// Run frames from the synthetic frame source, as fast as it will go, through the encoder
+// and output exactly as libcamera-vid would. The latency of each frame is measured from
+// its (fake) sensor timestamp until the output has finished with it.
+
+static void run_pipeline(BenchRunner &runner, std::string const &name, std::vector<std::string> args)
+{
+	using namespace std::chrono;
+
+	LibcameraEncoder app;
+	VideoOptions *options = app.GetOptions();
+	args.insert(args.begin(), { "libcamera-bench", "--framerate", "0", "--nopreview", "-o", "/dev/null" });
+	std::vector<char *> argv;
+	for (auto &arg : args)
+		argv.push_back(&arg[0]);
+	options->Parse(argv.size(), argv.data());
+
+	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
+	std::vector<double> latencies;
+	latencies.reserve(100000);
+	std::mutex latencies_mutex;
+	app.SetEncodeOutputReadyCallback([&](void *mem, size_t size, int64_t timestamp_us, bool keyframe) {
+		output->OutputReady(mem, size, timestamp_us, keyframe);
+		int64_t now_us = duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+		std::lock_guard<std::mutex> lock(latencies_mutex);
+		if (latencies.size() < latencies.capacity())
+			latencies.push_back(now_us - timestamp_us);
+	});
+
+	app.OpenCamera();
+	bool jpeg_colourspace = options->codec == "mjpeg" || options->codec == "yuv420";
+	app.ConfigureVideo(jpeg_colourspace ? LibcameraEncoder::FLAG_VIDEO_JPEG_COLOURSPACE
+										: LibcameraEncoder::FLAG_VIDEO_NONE);
+	app.StartEncoder();
+	app.StartCamera();
+
+	uint64_t bytes = AllocatedBytes(), allocs = AllocationCount();
+	steady_clock::time_point start = steady_clock::now();
+	for (unsigned int count = 0;; count++)
+	{
+		LibcameraEncoder::Msg msg = app.Wait();
+		if (msg.type != LibcameraEncoder::MsgType::RequestComplete)
+			break;
+		if (count >= runner.Config().min_frames &&
+			duration<double>(steady_clock::now() - start).count() >= runner.Config().min_time)
+			break;
+
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		app.EncodeBuffer(completed_request, app.VideoStream());
+	}
+	app.StopCamera();
+	app.StopEncoder(); // waits for the encoder to drain
+	double elapsed = duration<double>(steady_clock::now() - start).count();
+	bytes = AllocatedBytes() - bytes;
+	allocs = AllocationCount() - allocs;
+
+	runner.Report(name, latencies, elapsed, bytes, allocs);
+}
+
+static void bench_pipelines(BenchRunner &runner)
+{
+	std::vector<std::string> size = { "--width", "1920", "--height", "1080" };
+	auto with = [&size](std::vector<std::string> args) {
+		args.insert(args.end(), size.begin(), size.end());
+		return args;
+	};
+
+	run_pipeline(runner, "pipeline_yuv420_1920x1080", with({ "--frame-source", "synthetic", "--codec", "yuv420" }));
+	run_pipeline(runner, "pipeline_mjpeg_1920x1080", with({ "--frame-source", "synthetic", "--codec", "mjpeg" }));
+	run_pipeline(runner, "pipeline_mjpeg_1920x1080_noise",
+				 with({ "--frame-source", "synthetic:noise", "--codec", "mjpeg" }));
+	// The hardware encoder only exists on a Pi.
+	if (access("/dev/video11", R_OK | W_OK) == 0)
+		run_pipeline(runner, "pipeline_h264_1920x1080", with({ "--frame-source", "synthetic", "--codec", "h264" }));
+}
+
+static RegisterBenchmark reg_pipelines("pipeline", &bench_pipelines);
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * bitrate_controller.hpp - adapt the encoder's bitrate to what the link can carry.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+
+// Network outputs report, for each frame, how long it took to hand to the socket and how
+// many bytes the socket still had queued afterwards. When either of those says the link is
+// falling behind we cut the bitrate by a quarter, and once it has kept up for a while we
+// raise it again in small steps, up to where it started. Changes are spaced out so that
+// each has time to show its effect.
+
+class BitrateController
+{
+public:
+	BitrateController(uint32_t min_bitrate, uint32_t max_bitrate)
+		: min_(min_bitrate), max_(max_bitrate), bitrate_(max_bitrate)
+	{
+	}
+
+	uint32_t Bitrate() const { return bitrate_; }
+	uint64_t Decreases() const { return decreases_; }
+
+	// Given the time now, and the figures for the frame just sent, return the new bitrate
+	// if it should change.
+	std::optional<uint32_t> Update(int64_t now_us, int64_t send_time_us, size_t frame_bytes, size_t queued_bytes)
+	{
+		if (last_frame_us_)
+			frame_interval_us_ = (frame_interval_us_ * 15 + (now_us - last_frame_us_)) / 16;
+		last_frame_us_ = now_us;
+		average_bytes_ = (average_bytes_ * 15 + frame_bytes) / 16;
+
+		// A send that takes most of a frame's time, or a backlog of a couple of frames,
+		// means we're making more than the link can take.
+		bool congested = (frame_interval_us_ && send_time_us > frame_interval_us_ / 2) ||
+						 queued_bytes > 2 * average_bytes_ + MIN_BACKLOG;
+		if (congested)
+			last_congested_us_ = now_us;
+
+		uint32_t bitrate = bitrate_;
+		if (congested && now_us - last_change_us_ > DECREASE_HOLDOFF_US)
+			bitrate = std::max<uint32_t>(min_, bitrate_ / 4 * 3);
+		else if (!congested && now_us - last_congested_us_ > INCREASE_HOLDOFF_US &&
+				 now_us - last_change_us_ > INCREASE_HOLDOFF_US)
+			bitrate = std::min<uint32_t>(max_, bitrate_ + max_ / 20);
+		if (bitrate == bitrate_)
+			return {};
+
+		decreases_ += bitrate < bitrate_;
+		bitrate_ = bitrate;
+		last_change_us_ = now_us;
+		return bitrate;
+	}
+
+private:
+	static constexpr int64_t DECREASE_HOLDOFF_US = 500000;
+	static constexpr int64_t INCREASE_HOLDOFF_US = 2000000;
+	static constexpr size_t MIN_BACKLOG = 16 << 10;
+
+	uint32_t min_;
+	uint32_t max_;
+	uint32_t bitrate_;
+	int64_t last_frame_us_ = 0;
+	int64_t frame_interval_us_ = 0;
+	size_t average_bytes_ = 0;
+	int64_t last_congested_us_ = 0;
+	int64_t last_change_us_ = 0;
+	uint64_t decreases_ = 0;
+};
@@ -0,0 +1,229 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * clock_sync.cpp - align the capture clocks of the nodes in a camera rig.
+ */
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "core/clock_sync.hpp"
+
+namespace
+{
+
+constexpr uint32_t SYNC_MAGIC = 0x636c6b31; // "clk1"
+
+// The follower fills in t1 when it sends, and the server t2 on receipt and t3 on reply,
+// along with the rig's scheduled start time (or 0 if there isn't one).
+struct SyncPacket
+{
+	uint32_t magic;
+	uint32_t sequence;
+	int64_t t1;
+	int64_t t2;
+	int64_t t3;
+	int64_t start;
+};
+
+} // namespace
+
+ClockSync &ClockSync::Get()
+{
+	static ClockSync clock_sync;
+	return clock_sync;
+}
+
+ClockSync::~ClockSync()
+{
+	Stop();
+}
+
+int64_t ClockSync::Now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * INT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+void ClockSync::Serve(uint16_t port)
+{
+	if (thread_.joinable())
+		return; // every camera in the process shares the one clock
+
+	fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("ClockSync: failed to create socket");
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(fd_);
+		fd_ = -1;
+		throw std::runtime_error("ClockSync: failed to bind to port " + std::to_string(port));
+	}
+	abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	stopped_ = false;
+
+	// The server's clock is the rig's clock.
+	offset_us_ = 0;
+	synced_ = true;
+	thread_ = std::thread(&ClockSync::serverThread, this);
+}
+
+void ClockSync::Follow(std::string const &address, unsigned int interval_ms, bool verbose)
+{
+	if (thread_.joinable())
+		return;
+
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+		throw std::runtime_error("ClockSync: clock server should be given as host:port");
+	std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+
+	addrinfo hints = {}, *result;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result))
+		throw std::runtime_error("ClockSync: can't resolve " + address);
+	fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	int ret = fd_ < 0 ? -1 : connect(fd_, result->ai_addr, result->ai_addrlen);
+	freeaddrinfo(result);
+	if (ret < 0)
+	{
+		if (fd_ >= 0)
+			close(fd_);
+		fd_ = -1;
+		throw std::runtime_error("ClockSync: failed to connect to " + address);
+	}
+	abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	stopped_ = false;
+
+	thread_ = std::thread(&ClockSync::followerThread, this, interval_ms, verbose);
+}
+
+void ClockSync::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(start_mutex_);
+		stopped_ = true;
+	}
+	start_cond_var_.notify_all();
+	if (thread_.joinable())
+	{
+		uint64_t one = 1;
+		[[maybe_unused]] ssize_t ret = write(abort_fd_, &one, sizeof(one));
+		thread_.join();
+	}
+	if (fd_ >= 0)
+		close(fd_);
+	if (abort_fd_ >= 0)
+		close(abort_fd_);
+	fd_ = abort_fd_ = -1;
+	synced_ = false;
+}
+
+void ClockSync::SetStart(int64_t global_us)
+{
+	{
+		std::lock_guard<std::mutex> lock(start_mutex_);
+		start_us_ = global_us;
+	}
+	start_cond_var_.notify_all();
+}
+
+int64_t ClockSync::WaitStart(unsigned int timeout_ms)
+{
+	std::unique_lock<std::mutex> lock(start_mutex_);
+	start_cond_var_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return start_us_ || stopped_; });
+	return start_us_;
+}
+
+void ClockSync::serverThread()
+{
+	pollfd fds[2] = { { fd_, POLLIN, 0 }, { abort_fd_, POLLIN, 0 } };
+	while (poll(fds, 2, -1) >= 0 && !(fds[1].revents & POLLIN))
+	{
+		if (!(fds[0].revents & POLLIN))
+			continue;
+		SyncPacket packet;
+		sockaddr_storage from;
+		socklen_t from_len = sizeof(from);
+		ssize_t size = recvfrom(fd_, &packet, sizeof(packet), 0, (sockaddr *)&from, &from_len);
+		int64_t t2 = Now();
+		if (size != sizeof(packet) || packet.magic != SYNC_MAGIC)
+			continue;
+		packet.t2 = t2;
+		{
+			std::lock_guard<std::mutex> lock(start_mutex_);
+			packet.start = start_us_;
+		}
+		packet.t3 = Now();
+		sendto(fd_, &packet, sizeof(packet), 0, (sockaddr *)&from, from_len);
+	}
+}
+
+void ClockSync::followerThread(unsigned int interval_ms, bool verbose)
+{
+	// Each sample is the offset and the round trip delay it was measured over.
+	std::vector<std::pair<int64_t, int64_t>> samples;
+	uint32_t sequence = 0;
+	pollfd fds[2] = { { fd_, POLLIN, 0 }, { abort_fd_, POLLIN, 0 } };
+
+	while (true)
+	{
+		SyncPacket request = { SYNC_MAGIC, ++sequence, Now(), 0, 0, 0 };
+		send(fd_, &request, sizeof(request), 0);
+
+		// Wait for the reply until the next request is due. Late replies to earlier
+		// requests are simply ignored.
+		int64_t next_request = request.t1 + interval_ms * INT64_C(1000);
+		for (int64_t now = Now(); now < next_request; now = Now())
+		{
+			int timeout_ms = (next_request - now + 999) / 1000;
+			if (poll(fds, 2, timeout_ms) < 0)
+				continue;
+			if (fds[1].revents & POLLIN)
+				return;
+			if (!(fds[0].revents & POLLIN))
+				continue;
+
+			SyncPacket reply;
+			ssize_t size = recv(fd_, &reply, sizeof(reply), 0);
+			int64_t t4 = Now();
+			if (size != sizeof(reply) || reply.magic != SYNC_MAGIC || reply.sequence != sequence)
+				continue;
+
+			int64_t offset = ((reply.t2 - reply.t1) + (reply.t3 - t4)) / 2;
+			int64_t delay = (t4 - reply.t1) - (reply.t3 - reply.t2);
+			if (samples.size() == NUM_SAMPLES)
+				samples.erase(samples.begin());
+			samples.emplace_back(offset, delay);
+			auto best = std::min_element(samples.begin(), samples.end(),
+										 [](auto const &a, auto const &b) { return a.second < b.second; });
+			offset_us_.store(best->first, std::memory_order_relaxed);
+			synced_.store(true, std::memory_order_release);
+			if (reply.start)
+				SetStart(reply.start);
+			if (verbose)
+				std::cerr << "Clock offset " << best->first << "us (sample " << offset << "us, round trip "
+						  << delay << "us)" << std::endl;
+		}
+	}
+}
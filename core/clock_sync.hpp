@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * clock_sync.hpp - align the capture clocks of the nodes in a camera rig.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// One node in the rig serves its clock over UDP and the others follow it. A follower sends
+// a request every interval and estimates its offset from the times on the round trip, as
+// NTP does. Of the last few samples, the one with the shortest round trip is trusted most,
+// as it was the least delayed by the network.
+//
+// All times are CLOCK_MONOTONIC microseconds, the clock that sensor timestamps use, so that
+// adding the offset to a sensor timestamp gives the time on the server, which is the
+// rig-global time.
+
+class ClockSync
+{
+public:
+	static ClockSync &Get();
+
+	~ClockSync();
+
+	// Answer requests from followers on this UDP port.
+	void Serve(uint16_t port);
+	// Follow the server at host:port, asking it for the time every interval_ms.
+	void Follow(std::string const &address, unsigned int interval_ms, bool verbose);
+	void Stop();
+
+	// Whether timestamps can be converted yet, which a follower can't do until it first
+	// hears from the server.
+	bool Synced() const { return synced_.load(std::memory_order_acquire); }
+	int64_t OffsetUs() const { return offset_us_.load(std::memory_order_relaxed); }
+	int64_t ToGlobal(int64_t local_us) const { return local_us + OffsetUs(); }
+	int64_t ToLocal(int64_t global_us) const { return global_us - OffsetUs(); }
+
+	// The server can schedule the rig's start for a rig-global time, which followers learn
+	// from its replies. WaitStart() returns it, once known, or 0 if it isn't known within the
+	// timeout (or we were stopped first).
+	void SetStart(int64_t global_us);
+	int64_t WaitStart(unsigned int timeout_ms);
+
+	static int64_t Now();
+
+private:
+	static constexpr unsigned int NUM_SAMPLES = 8;
+	ClockSync() = default;
+	void serverThread();
+	void followerThread(unsigned int interval_ms, bool verbose);
+
+	int fd_ = -1;
+	int abort_fd_ = -1;
+	std::thread thread_;
+	std::atomic<bool> synced_ = false;
+	std::atomic<int64_t> offset_us_ = 0;
+	std::mutex start_mutex_;
+	std::condition_variable start_cond_var_;
+	int64_t start_us_ = 0;
+	bool stopped_ = false;
+};
@@ -25,7 +25,13 @@ struct CompletedRequest
 	{
 		r->reuse();
 	}
+	// Frames that come from a FrameSource rather than the camera have no Request.
+	CompletedRequest(unsigned int seq, BufferMap const &b, ControlList const &m)
+		: sequence(seq), buffers(b), metadata(m), request(nullptr)
+	{
+	}
 	unsigned int sequence;
+	unsigned int camera = 0; // the camera's index, for applications that run several
 	BufferMap buffers;
 	ControlList metadata;
 	Request *request;
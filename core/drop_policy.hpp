@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * drop_policy.hpp - what a slow consumer does with frames it can't keep up with.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// A policy is given as "<mode>[:<depth>]", where the depth is how many frames may be
+// queued for the consumer (0 meaning no limit):
+//   block       - hold up whoever is supplying frames until there is room,
+//   drop-oldest - discard the frame that has been waiting longest to make room,
+//   drop-newest - discard the new frame when there is no room,
+//   every:N     - keep only every Nth frame.
+// The consumer holds its own lock around all these calls.
+
+class DropPolicy
+{
+public:
+	enum class Mode
+	{
+		Block,
+		DropOldest,
+		DropNewest,
+		EveryNth
+	};
+
+	DropPolicy(std::string const &spec = "block") : spec_(spec)
+	{
+		std::string mode = spec.substr(0, spec.find(':'));
+		unsigned int value = 0;
+		if (mode.size() < spec.size())
+			value = std::stoul(spec.substr(mode.size() + 1));
+
+		if (mode == "block")
+			mode_ = Mode::Block, depth_ = value;
+		else if (mode == "drop-oldest")
+			mode_ = Mode::DropOldest, depth_ = value ? value : 2;
+		else if (mode == "drop-newest")
+			mode_ = Mode::DropNewest, depth_ = value ? value : 2;
+		else if (mode == "every" && value)
+			mode_ = Mode::EveryNth, every_ = value;
+		else
+			throw std::runtime_error("invalid drop policy " + spec);
+	}
+
+	Mode GetMode() const { return mode_; }
+	unsigned int Depth() const { return depth_; }
+	std::string const &Spec() const { return spec_; }
+	uint64_t Dropped() const { return dropped_; }
+
+	// Whether a new frame should be queued at all, given how many are queued already.
+	bool Accept(unsigned int queued)
+	{
+		bool accept = true;
+		if (mode_ == Mode::EveryNth)
+			accept = count_++ % every_ == 0;
+		else if (mode_ == Mode::DropNewest && depth_ && queued >= depth_)
+			accept = false;
+		dropped_ += !accept;
+		return accept;
+	}
+	// Whether the supplier must wait before queueing another frame.
+	bool MustWait(unsigned int queued) const { return mode_ == Mode::Block && depth_ && queued >= depth_; }
+	// Whether the oldest frame should be discarded, now that this many are queued.
+	bool DropOldest(unsigned int queued)
+	{
+		bool drop = mode_ == Mode::DropOldest && depth_ && queued > depth_;
+		dropped_ += drop;
+		return drop;
+	}
+
+private:
+	std::string spec_;
+	Mode mode_ = Mode::Block;
+	unsigned int depth_ = 0;
+	unsigned int every_ = 1;
+	uint64_t count_ = 0;
+	uint64_t dropped_ = 0;
+};
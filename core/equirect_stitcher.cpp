@@ -0,0 +1,245 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * equirect_stitcher.cpp - project frames from several cameras into one panorama.
+ */
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+
+#include <libcamera/formats.h>
+
+#include "core/equirect_stitcher.hpp"
+
+EquirectStitcher::EquirectStitcher(std::string const &lut_file, unsigned int num_threads)
+{
+	std::unique_ptr<FILE, int (*)(FILE *)> fp(fopen(lut_file.c_str(), "rb"), fclose);
+	if (!fp)
+		throw std::runtime_error("EquirectStitcher: failed to open " + lut_file);
+
+	LutHeader header;
+	if (fread(&header, sizeof(header), 1, fp.get()) != 1 || header.magic != LUT_MAGIC)
+		throw std::runtime_error("EquirectStitcher: " + lut_file + " is not a stitching LUT");
+	if (header.version != LUT_VERSION)
+		throw std::runtime_error("EquirectStitcher: " + lut_file + " has unsupported version " +
+								 std::to_string(header.version));
+	if (!header.width || !header.height || (header.width & 1) || (header.height & 1))
+		throw std::runtime_error("EquirectStitcher: panorama size must be even");
+	if (!header.num_cameras || header.num_cameras >= NO_CAMERA)
+		throw std::runtime_error("EquirectStitcher: bad number of cameras in " + lut_file);
+
+	for (unsigned int i = 0; i < header.num_cameras; i++)
+	{
+		uint32_t size[2];
+		if (fread(size, sizeof(size), 1, fp.get()) != 1)
+			throw std::runtime_error("EquirectStitcher: " + lut_file + " is truncated");
+		camera_sizes_.emplace_back(size[0], size[1]);
+	}
+
+	lut_.resize(header.width * header.height * 2);
+	if (fread(lut_.data(), sizeof(LutEntry), lut_.size(), fp.get()) != lut_.size())
+		throw std::runtime_error("EquirectStitcher: " + lut_file + " is truncated");
+	for (LutEntry const &entry : lut_)
+	{
+		if (entry.camera != NO_CAMERA && entry.camera >= header.num_cameras)
+			throw std::runtime_error("EquirectStitcher: " + lut_file + " refers to a missing camera");
+	}
+
+	output_info_.width = header.width;
+	output_info_.height = header.height;
+	output_info_.stride = header.width;
+	output_info_.pixel_format = libcamera::formats::YUV420;
+	num_tiles_ = (header.height + TILE_ROWS - 1) / TILE_ROWS;
+	next_tile_ = num_tiles_;
+
+	// The thread calling Stitch() does its share too.
+	for (unsigned int i = 1; i < num_threads; i++)
+		threads_.emplace_back(&EquirectStitcher::workerThread, this);
+}
+
+EquirectStitcher::~EquirectStitcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	work_cond_var_.notify_all();
+	for (auto &thread : threads_)
+		thread.join();
+}
+
+void EquirectStitcher::Stitch(std::vector<uint8_t const *> const &inputs, std::vector<StreamInfo> const &infos,
+							  uint8_t *output)
+{
+	if (inputs.size() != NumCameras() || infos.size() != NumCameras())
+		throw std::runtime_error("EquirectStitcher: expected " + std::to_string(NumCameras()) + " frames");
+
+	for (auto &planes : planes_)
+		planes.clear();
+	for (unsigned int i = 0; i < NumCameras(); i++)
+	{
+		StreamInfo const &info = infos[i];
+		if (info.width != camera_sizes_[i].first || info.height != camera_sizes_[i].second)
+			throw std::runtime_error("EquirectStitcher: camera " + std::to_string(i) + " frames are " +
+									 std::to_string(info.width) + "x" + std::to_string(info.height) +
+									 " but the LUT was made for " + std::to_string(camera_sizes_[i].first) + "x" +
+									 std::to_string(camera_sizes_[i].second));
+		uint8_t const *u = inputs[i] + info.stride * info.height;
+		uint8_t const *v = u + (info.stride / 2) * (info.height / 2);
+		planes_[0].push_back({ inputs[i], info.stride, info.width, info.height });
+		planes_[1].push_back({ u, info.stride / 2, info.width / 2, info.height / 2 });
+		planes_[2].push_back({ v, info.stride / 2, info.width / 2, info.height / 2 });
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		output_ = output;
+		tiles_done_ = 0;
+		next_tile_ = 0;
+		generation_++;
+	}
+	work_cond_var_.notify_all();
+
+	doTiles();
+	std::unique_lock<std::mutex> lock(mutex_);
+	done_cond_var_.wait(lock, [this] { return tiles_done_ == num_tiles_; });
+}
+
+void EquirectStitcher::workerThread()
+{
+	unsigned int generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			work_cond_var_.wait(lock, [&] { return abort_ || generation_ != generation; });
+			if (abort_)
+				return;
+			generation = generation_;
+		}
+		doTiles();
+	}
+}
+
+void EquirectStitcher::doTiles()
+{
+	unsigned int done = 0;
+	for (unsigned int tile; (tile = next_tile_.fetch_add(1)) < num_tiles_; done++)
+		stitchTile(tile);
+	if (!done)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	tiles_done_ += done;
+	if (tiles_done_ == num_tiles_)
+		done_cond_var_.notify_all();
+}
+
+void EquirectStitcher::stitchTile(unsigned int tile)
+{
+	unsigned int width = output_info_.width, height = output_info_.height, stride = output_info_.stride;
+	unsigned int row_begin = tile * TILE_ROWS, row_end = std::min(row_begin + TILE_ROWS, height);
+
+	for (unsigned int y = row_begin; y < row_end; y++)
+		sampleRow(output_ + y * stride, &lut_[2 * y * width], width, 1, planes_[0].data(), 0, 0);
+
+	// Chroma pixels use the LUT entries of the top left luma pixel they cover. TILE_ROWS is even,
+	// so each tile has whole rows of them.
+	uint8_t *u = output_ + stride * height, *v = u + (stride / 2) * (height / 2);
+	for (unsigned int y = row_begin / 2; y < row_end / 2; y++)
+	{
+		LutEntry const *lut = &lut_[2 * (2 * y) * width];
+		sampleRow(u + y * (stride / 2), lut, width / 2, 2, planes_[1].data(), 1, 128);
+		sampleRow(v + y * (stride / 2), lut, width / 2, 2, planes_[2].data(), 1, 128);
+	}
+}
+
+namespace
+{
+
+// Coordinates are shifted down for the chroma planes, and must leave room for the pixels to
+// the right and below.
+inline uint8_t const *sample_address(uint8_t const *data, unsigned int stride, unsigned int width,
+									 unsigned int height, unsigned int x, unsigned int y)
+{
+	return data + std::min(y >> 4, height - 2) * stride + std::min(x >> 4, width - 2);
+}
+
+} // namespace
+
+void EquirectStitcher::sampleRow(uint8_t *dst, LutEntry const *lut, unsigned int width, unsigned int step,
+								 Plane const *planes, unsigned int shift, uint8_t unmapped) const
+{
+	unsigned int i = 0;
+
+#if defined(__ARM_NEON)
+	// The samples have to be gathered one at a time, but the filtering and blending of eight
+	// pixels at once is all done in vector registers.
+	for (; i + 8 <= width; i += 8)
+	{
+		uint8_t p[2][4][8] = {}, fx[2][8] = {}, fy[2][8] = {}, w[2][8] = {};
+		for (unsigned int j = 0; j < 8; j++)
+		{
+			for (unsigned int k = 0; k < 2; k++)
+			{
+				LutEntry const &e = lut[2 * (i + j) * step + k];
+				if (e.camera == NO_CAMERA)
+					continue;
+				Plane const &plane = planes[e.camera];
+				unsigned int x = e.x >> shift, y = e.y >> shift;
+				uint8_t const *s = sample_address(plane.data, plane.stride, plane.width, plane.height, x, y);
+				p[k][0][j] = s[0], p[k][1][j] = s[1];
+				p[k][2][j] = s[plane.stride], p[k][3][j] = s[plane.stride + 1];
+				fx[k][j] = x & 15, fy[k][j] = y & 15, w[k][j] = e.weight;
+			}
+		}
+
+		uint16x8_t sum = vdupq_n_u16(WEIGHT_ONE / 2);
+		for (unsigned int k = 0; k < 2; k++)
+		{
+			uint8x8_t fxv = vld1_u8(fx[k]), fyv = vld1_u8(fy[k]);
+			uint8x8_t ifxv = vsub_u8(vdup_n_u8(16), fxv);
+			uint16x8_t top = vmlal_u8(vmull_u8(vld1_u8(p[k][0]), ifxv), vld1_u8(p[k][1]), fxv);
+			uint16x8_t bottom = vmlal_u8(vmull_u8(vld1_u8(p[k][2]), ifxv), vld1_u8(p[k][3]), fxv);
+			// At most 255 * 16 * 16, so this still fits in 16 bits.
+			uint16x8_t value = vmlaq_u16(vmulq_u16(top, vmovl_u8(vsub_u8(vdup_n_u8(16), fyv))), bottom, vmovl_u8(fyv));
+			sum = vmlal_u8(sum, vrshrn_n_u16(value, 8), vld1_u8(w[k]));
+		}
+		vst1_u8(dst + i, vshrn_n_u16(sum, 7));
+
+		for (unsigned int j = 0; j < 8; j++)
+		{
+			if (lut[2 * (i + j) * step].camera == NO_CAMERA)
+				dst[i + j] = unmapped;
+		}
+	}
+#endif
+
+	for (; i < width; i++)
+	{
+		LutEntry const *e = &lut[2 * i * step];
+		if (e[0].camera == NO_CAMERA)
+		{
+			dst[i] = unmapped;
+			continue;
+		}
+		unsigned int sum = WEIGHT_ONE / 2;
+		for (unsigned int k = 0; k < 2 && e[k].camera != NO_CAMERA; k++)
+		{
+			Plane const &plane = planes[e[k].camera];
+			unsigned int x = e[k].x >> shift, y = e[k].y >> shift, fx = x & 15, fy = y & 15;
+			uint8_t const *s = sample_address(plane.data, plane.stride, plane.width, plane.height, x, y);
+			unsigned int top = s[0] * (16 - fx) + s[1] * fx;
+			unsigned int bottom = s[plane.stride] * (16 - fx) + s[plane.stride + 1] * fx;
+			sum += ((top * (16 - fy) + bottom * fy + 128) >> 8) * e[k].weight;
+		}
+		dst[i] = sum / WEIGHT_ONE;
+	}
+}
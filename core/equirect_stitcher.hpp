@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * equirect_stitcher.hpp - project frames from several cameras into one panorama.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/stream_info.hpp"
+
+// The stitcher fills an equirectangular YUV420 panorama from one YUV420 frame per camera,
+// using a remap LUT made beforehand from the rig's calibration (by utils/make_stitch_lut.py).
+// For every panorama pixel the LUT gives up to two cameras, where to sample each of them, and
+// how much of each to take, so the blend is feathered where the cameras overlap. All the
+// geometry is in the LUT, so stitching is just bilinear sampling, which we share out among
+// a few threads in bands of rows.
+//
+// The LUT file is a header, followed by the width and height of each camera's frames, and
+// then two LutEntry items for each panorama pixel in raster order, all little endian.
+
+class EquirectStitcher
+{
+public:
+	static constexpr uint32_t LUT_MAGIC = 0x746c7165; // "eqlt"
+	static constexpr uint32_t LUT_VERSION = 1;
+	static constexpr uint8_t NO_CAMERA = 0xff;
+	static constexpr unsigned int WEIGHT_ONE = 128;
+
+	struct LutHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t num_cameras;
+	};
+	// Coordinates are in the camera's luma plane, in 12.4 fixed point. The two entries for a
+	// pixel have weights that add up to WEIGHT_ONE, and an unused one has no camera.
+	struct __attribute__((packed)) LutEntry
+	{
+		uint16_t x;
+		uint16_t y;
+		uint8_t camera;
+		uint8_t weight;
+	};
+
+	EquirectStitcher(std::string const &lut_file, unsigned int num_threads);
+	~EquirectStitcher();
+
+	unsigned int NumCameras() const { return camera_sizes_.size(); }
+	// The panorama is a contiguous YUV420 image described by this.
+	StreamInfo const &OutputInfo() const { return output_info_; }
+	size_t OutputSize() const { return output_info_.stride * output_info_.height * 3 / 2; }
+
+	// Given one frame per camera, in LUT order, write the panorama to output.
+	void Stitch(std::vector<uint8_t const *> const &inputs, std::vector<StreamInfo> const &infos,
+				uint8_t *output);
+
+private:
+	static constexpr unsigned int TILE_ROWS = 16;
+	struct Plane
+	{
+		uint8_t const *data;
+		unsigned int stride;
+		unsigned int width;
+		unsigned int height;
+	};
+	void workerThread();
+	void doTiles();
+	void stitchTile(unsigned int tile);
+	void sampleRow(uint8_t *dst, LutEntry const *lut, unsigned int width, unsigned int step, Plane const *planes,
+				   unsigned int shift, uint8_t unmapped) const;
+
+	StreamInfo output_info_;
+	std::vector<std::pair<unsigned int, unsigned int>> camera_sizes_;
+	std::vector<LutEntry> lut_;
+
+	// The current job, which the workers pick tiles from.
+	std::vector<Plane> planes_[3];
+	uint8_t *output_ = nullptr;
+	unsigned int num_tiles_;
+	std::atomic<unsigned int> next_tile_;
+	unsigned int tiles_done_ = 0;
+	unsigned int generation_ = 0;
+
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable work_cond_var_;
+	std::condition_variable done_cond_var_;
+	bool abort_ = false;
+};
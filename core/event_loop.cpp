@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * event_loop.cpp - epoll based event loop for the applications.
+ */
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+
+#include "core/event_loop.hpp"
+
+EventLoop::EventLoop()
+{
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0)
+		throw std::runtime_error("EventLoop: failed to create epoll instance");
+}
+
+EventLoop::~EventLoop()
+{
+	if (signal_fd_ >= 0)
+		close(signal_fd_);
+	if (timer_fd_ >= 0)
+		close(timer_fd_);
+	close(epoll_fd_);
+}
+
+void EventLoop::Add(int fd, Handler handler)
+{
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+	{
+		// epoll won't take regular files (stdin redirected from one, say), but they're
+		// always readable, so we just call the handler every time round.
+		if (errno != EPERM)
+			throw std::runtime_error("EventLoop: failed to add fd " + std::to_string(fd));
+		always_ready_.insert(fd);
+	}
+	handlers_[fd] = handler;
+}
+
+void EventLoop::Remove(int fd)
+{
+	if (!always_ready_.erase(fd))
+		epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	handlers_.erase(fd);
+}
+
+void EventLoop::AddSignals(std::vector<int> const &signals, SignalHandler handler)
+{
+	if (signal_fd_ >= 0)
+		throw std::runtime_error("EventLoop: signals have already been added");
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (int signal_number : signals)
+		sigaddset(&mask, signal_number);
+	if (pthread_sigmask(SIG_BLOCK, &mask, nullptr))
+		throw std::runtime_error("EventLoop: failed to block signals");
+	signal_fd_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd_ < 0)
+		throw std::runtime_error("EventLoop: failed to create signalfd");
+
+	Add(signal_fd_, [this, handler]() {
+		signalfd_siginfo info;
+		while (read(signal_fd_, &info, sizeof(info)) == sizeof(info))
+			handler(info.ssi_signo);
+	});
+}
+
+void EventLoop::SetTimeout(std::chrono::milliseconds timeout, Handler handler)
+{
+	if (timer_fd_ < 0)
+	{
+		timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd_ < 0)
+			throw std::runtime_error("EventLoop: failed to create timerfd");
+	}
+	else
+		Remove(timer_fd_);
+
+	itimerspec spec = {};
+	spec.it_value.tv_sec = timeout.count() / 1000;
+	spec.it_value.tv_nsec = (timeout.count() % 1000) * 1000000;
+	if (timeout.count() == 0)
+		spec.it_value.tv_nsec = 1; // zero would disarm it
+	timerfd_settime(timer_fd_, 0, &spec, nullptr);
+
+	Add(timer_fd_, [this, handler]() {
+		uint64_t expirations;
+		if (read(timer_fd_, &expirations, sizeof(expirations)) == sizeof(expirations))
+			handler();
+	});
+}
+
+void EventLoop::Run()
+{
+	quit_ = false;
+	epoll_event events[8];
+	while (!quit_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 8, always_ready_.empty() ? -1 : 0);
+		if (n < 0 && errno != EINTR)
+			throw std::runtime_error("EventLoop: epoll_wait failed");
+
+		std::vector<int> ready(always_ready_.begin(), always_ready_.end());
+		for (int i = 0; i < n; i++)
+			ready.push_back(events[i].data.fd);
+		for (unsigned int i = 0; i < ready.size() && !quit_; i++)
+		{
+			auto it = handlers_.find(ready[i]);
+			if (it == handlers_.end())
+				continue; // removed by an earlier handler
+			Handler handler = it->second; // the handler may remove itself
+			handler();
+		}
+	}
+}
+
+EventNotifier::EventNotifier()
+{
+	fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd_ < 0)
+		throw std::runtime_error("EventNotifier: failed to create eventfd");
+}
+
+EventNotifier::~EventNotifier()
+{
+	close(fd_);
+}
+
+void EventNotifier::Notify()
+{
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t ret = write(fd_, &one, sizeof(one));
+}
+
+uint64_t EventNotifier::Consume()
+{
+	uint64_t count = 0;
+	if (read(fd_, &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * event_loop.hpp - epoll based event loop for the applications.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+
+// The loop sleeps until one of its file descriptors is readable and then calls its handler.
+// Regular files can't be waited on, so their handlers are called without a wait, and must
+// Remove() them once they reach the end.
+// Signals are delivered through a signalfd, so AddSignals() must be called before any other
+// threads are started, as they need to inherit the blocked signal mask.
+
+class EventLoop
+{
+public:
+	typedef std::function<void()> Handler;
+	typedef std::function<void(int)> SignalHandler;
+
+	EventLoop();
+	~EventLoop();
+
+	void Add(int fd, Handler handler);
+	void Remove(int fd);
+	void AddSignals(std::vector<int> const &signals, SignalHandler handler);
+	// Call the handler once, after this long.
+	void SetTimeout(std::chrono::milliseconds timeout, Handler handler);
+
+	// Dispatch events until one of the handlers calls Quit().
+	void Run();
+	void Quit() { quit_ = true; }
+
+private:
+	int epoll_fd_;
+	int signal_fd_ = -1;
+	int timer_fd_ = -1;
+	std::map<int, Handler> handlers_;
+	// Descriptors that epoll can't watch, whose handlers we call every time round.
+	std::set<int> always_ready_;
+	bool quit_ = false;
+};
+
+// An eventfd that other threads can use to wake the loop. Notify() is safe to call from
+// signal and interrupt handlers too.
+class EventNotifier
+{
+public:
+	EventNotifier();
+	~EventNotifier();
+
+	int Fd() const { return fd_; }
+	void Notify();
+	// Return how many times we were notified since last time, and reset the count.
+	uint64_t Consume();
+
+private:
+	int fd_;
+};
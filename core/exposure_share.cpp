@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * exposure_share.cpp - share one camera's exposure and white balance with others.
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <libcamera/control_ids.h>
+
+#include "core/exposure_share.hpp"
+
+using namespace libcamera;
+
+static sockaddr_un make_address(std::string const &path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("exposure sharing socket path too long: " + path);
+	strcpy(addr.sun_path, path.c_str());
+	return addr;
+}
+
+ExposurePublisher::ExposurePublisher(std::string const &path) : path_(path)
+{
+	sockaddr_un addr = make_address(path);
+	unlink(addr.sun_path);
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("ExposurePublisher: failed to listen on " + path);
+}
+
+ExposurePublisher::~ExposurePublisher()
+{
+	for (int fd : clients_)
+		close(fd);
+	close(listen_fd_);
+	unlink(path_.c_str());
+}
+
+void ExposurePublisher::Publish(ControlList const &metadata)
+{
+	// Followers are picked up here, rather than in a thread of their own, as there's a frame
+	// for them soon enough anyway.
+	for (int fd; (fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0;)
+		clients_.push_back(fd);
+	if (clients_.empty() || !metadata.contains(controls::SensorTimestamp) ||
+		!metadata.contains(controls::ExposureTime) || !metadata.contains(controls::AnalogueGain))
+		return;
+
+	ExposureMessage message = {};
+	message.magic = ExposureMessage::MAGIC;
+	message.sequence = sequence_++;
+	message.timestamp_ns = metadata.get(controls::SensorTimestamp);
+	message.exposure_time = metadata.get(controls::ExposureTime);
+	message.analogue_gain = metadata.get(controls::AnalogueGain);
+	if (metadata.contains(controls::ColourGains))
+	{
+		auto gains = metadata.get(controls::ColourGains);
+		message.colour_gains[0] = gains[0], message.colour_gains[1] = gains[1];
+	}
+
+	// A follower that isn't keeping up just misses a frame, and one that has gone is dropped.
+	clients_.erase(std::remove_if(clients_.begin(), clients_.end(),
+								  [&message](int fd) {
+									  if (send(fd, &message, sizeof(message), MSG_DONTWAIT | MSG_NOSIGNAL) >= 0 ||
+										  errno == EAGAIN)
+										  return false;
+									  close(fd);
+									  return true;
+								  }),
+				   clients_.end());
+}
+
+ExposureFollower::ExposureFollower(std::string const &path, unsigned int latency_frames, bool verbose)
+	: path_(path), latency_frames_(latency_frames), verbose_(verbose)
+{
+	make_address(path); // check it now rather than in the thread
+	abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (abort_fd_ < 0)
+		throw std::runtime_error("ExposureFollower: failed to create eventfd");
+	thread_ = std::thread(&ExposureFollower::receiveThread, this);
+}
+
+ExposureFollower::~ExposureFollower()
+{
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t ret = write(abort_fd_, &one, sizeof(one));
+	thread_.join();
+	close(abort_fd_);
+
+	if (frames_)
+		std::cerr << "Followed the master's exposure for " << frames_ << " frames, average difference: exposure "
+				  << 100 * exposure_error_ / frames_ << "%, gain " << 100 * gain_error_ / frames_ << "%"
+				  << std::endl;
+}
+
+void ExposureFollower::receiveThread()
+{
+	sockaddr_un addr = make_address(path_);
+	while (true)
+	{
+		// The master may not be running yet, or may restart, so keep trying.
+		int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0)
+		{
+			if (verbose_)
+				std::cerr << "ExposureFollower: connected to " << path_ << std::endl;
+			pollfd fds[2] = { { fd, POLLIN, 0 }, { abort_fd_, POLLIN, 0 } };
+			while (poll(fds, 2, -1) >= 0 && !(fds[1].revents & POLLIN))
+			{
+				ExposureMessage message;
+				ssize_t size = recv(fd, &message, sizeof(message), 0);
+				if (size <= 0)
+					break;
+				if (size != sizeof(message) || message.magic != ExposureMessage::MAGIC)
+					continue;
+				std::lock_guard<std::mutex> lock(mutex_);
+				previous_ = latest_;
+				latest_ = message;
+			}
+		}
+		if (fd >= 0)
+			close(fd);
+
+		pollfd abort_fd = { abort_fd_, POLLIN, 0 };
+		if (poll(&abort_fd, 1, 500) > 0)
+			return;
+	}
+}
+
+ExposureMessage ExposureFollower::masterAt(int64_t timestamp_ns) const
+{
+	ExposureMessage result = latest_;
+	int64_t span = latest_.timestamp_ns - previous_.timestamp_ns;
+	if (!previous_.magic || span <= 0)
+		return result;
+
+	// Don't extrapolate too far, in case the master has stopped sending.
+	double t = std::clamp<double>((double)(timestamp_ns - latest_.timestamp_ns) / span, -1.0, 4.0);
+	result.exposure_time = std::max(1.0, latest_.exposure_time + t * (latest_.exposure_time - previous_.exposure_time));
+	result.analogue_gain = std::max(1.0, latest_.analogue_gain + t * (latest_.analogue_gain - previous_.analogue_gain));
+	return result;
+}
+
+void ExposureFollower::Update(ControlList const &metadata, ControlList &controls)
+{
+	if (!metadata.contains(controls::SensorTimestamp) || !metadata.contains(controls::FrameDuration))
+		return;
+	int64_t timestamp_ns = metadata.get(controls::SensorTimestamp);
+	int64_t frame_duration_ns = metadata.get(controls::FrameDuration) * 1000;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!latest_.magic)
+		return;
+
+	// First see how well this frame matched the master's at the same moment.
+	if (metadata.contains(controls::ExposureTime) && metadata.contains(controls::AnalogueGain))
+	{
+		ExposureMessage now = masterAt(timestamp_ns);
+		frames_++;
+		exposure_error_ += std::abs(metadata.get(controls::ExposureTime) - now.exposure_time) /
+						   (double)std::max(now.exposure_time, 1);
+		gain_error_ += std::abs(metadata.get(controls::AnalogueGain) - now.analogue_gain) / now.analogue_gain;
+	}
+
+	// Then ask for what the master will have when these controls take effect.
+	ExposureMessage target = masterAt(timestamp_ns + latency_frames_ * frame_duration_ns);
+	controls.set(controls::AeEnable, false);
+	controls.set(controls::ExposureTime, target.exposure_time);
+	controls.set(controls::AnalogueGain, target.analogue_gain);
+	if (target.colour_gains[0] > 0 && target.colour_gains[1] > 0)
+	{
+		controls.set(controls::AwbEnable, false);
+		controls.set(controls::ColourGains, { target.colour_gains[0], target.colour_gains[1] });
+	}
+}
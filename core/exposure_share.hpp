@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * exposure_share.hpp - share one camera's exposure and white balance with others.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/controls.h>
+
+// Neighbouring cameras in a rig that each run their own AE/AWB settle on different values,
+// which shows up as seams. Instead, one camera publishes the exposure and colour gains of
+// every frame on a SOCK_SEQPACKET Unix socket, and the others copy them.
+//
+// A follower's controls only take effect some frames after it sets them, by which time the
+// master will have moved on. So the follower extrapolates the master's last two frames to
+// the time its own frame will be taken, and sets that.
+
+struct ExposureMessage
+{
+	static constexpr uint32_t MAGIC = 0x70786561; // "aexp"
+	uint32_t magic;
+	uint32_t sequence;
+	int64_t timestamp_ns;
+	int32_t exposure_time;
+	float analogue_gain;
+	float colour_gains[2];
+};
+
+class ExposurePublisher
+{
+public:
+	ExposurePublisher(std::string const &path);
+	~ExposurePublisher();
+
+	// Send this frame's values to every follower, without ever waiting for them.
+	void Publish(libcamera::ControlList const &metadata);
+
+private:
+	std::string path_;
+	int listen_fd_;
+	std::vector<int> clients_;
+	uint32_t sequence_ = 0;
+};
+
+class ExposureFollower
+{
+public:
+	ExposureFollower(std::string const &path, unsigned int latency_frames, bool verbose);
+	~ExposureFollower();
+
+	// Given the metadata of each of our own frames, add the controls that make our frames
+	// match the master's when they take effect.
+	void Update(libcamera::ControlList const &metadata, libcamera::ControlList &controls);
+
+private:
+	void receiveThread();
+	// The master's values at this time, from the last two messages.
+	ExposureMessage masterAt(int64_t timestamp_ns) const;
+
+	std::string path_;
+	unsigned int latency_frames_;
+	bool verbose_;
+	int abort_fd_;
+	std::thread thread_;
+	std::mutex mutex_;
+	ExposureMessage previous_ = {};
+	ExposureMessage latest_ = {};
+	// How well we've matched the master, for the report at the end.
+	uint64_t frames_ = 0;
+	double exposure_error_ = 0;
+	double gain_error_ = 0;
+};
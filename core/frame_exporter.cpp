@@ -0,0 +1,384 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_exporter.cpp - publish frames to other processes over a Unix socket.
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+#include <libcamera/control_ids.h>
+
+#include "core/frame_exporter.hpp"
+#include "core/options.hpp"
+
+static ssize_t send_message(int fd, void const *msg, size_t len, int const *fds, unsigned int num_fds)
+{
+	iovec iov = { const_cast<void *>(msg), len };
+	msghdr msgh = {};
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+
+	char control[CMSG_SPACE(sizeof(int) * ExportHello::MAX_STREAMS)] = {};
+	if (num_fds)
+	{
+		msgh.msg_control = control;
+		msgh.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+	}
+
+	return sendmsg(fd, &msgh, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+FrameExporter::FrameExporter(Options const *options) : options_(options)
+{
+	if (options_->export_mode == "dmabuf")
+		memfd_mode_ = false;
+	else if (options_->export_mode == "memfd")
+		memfd_mode_ = true;
+	else
+		throw std::runtime_error("invalid export mode " + options_->export_mode);
+	depth_ = std::max(options_->export_depth, 1u);
+}
+
+FrameExporter::~FrameExporter()
+{
+	Stop();
+}
+
+void FrameExporter::Start(std::vector<StreamConfig> const &streams)
+{
+	if (streams.empty() || streams.size() > ExportHello::MAX_STREAMS)
+		throw std::runtime_error("FrameExporter: can only export 1 or 2 streams");
+	streams_ = streams;
+
+	if (memfd_mode_)
+	{
+		// Each slot holds a copy of every stream for one frame.
+		slot_size_ = 0;
+		for (auto const &stream : streams_)
+			slot_size_ += (stream.size + 4095) & ~4095;
+		slot_refs_.assign(depth_ + 2, 0);
+		ring_fd_ = memfd_create("libcamera-export", MFD_CLOEXEC);
+		if (ring_fd_ < 0 || ftruncate(ring_fd_, slot_size_ * slot_refs_.size()) < 0)
+			throw std::runtime_error("FrameExporter: failed to create memfd ring");
+		void *mem = mmap(nullptr, slot_size_ * slot_refs_.size(), PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd_, 0);
+		if (mem == MAP_FAILED)
+			throw std::runtime_error("FrameExporter: failed to map memfd ring");
+		ring_ = static_cast<uint8_t *>(mem);
+	}
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (options_->export_path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("FrameExporter: socket path too long");
+	strcpy(addr.sun_path, options_->export_path.c_str());
+	unlink(addr.sun_path);
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("FrameExporter: failed to listen on " + options_->export_path);
+
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd_ < 0)
+		throw std::runtime_error("FrameExporter: failed to create eventfd");
+
+	abort_ = false;
+	frames_dropped_ = 0;
+	thread_ = std::thread(&FrameExporter::exportThread, this);
+	running_ = true;
+
+	if (options_->verbose)
+		std::cerr << "Exporting frames (" << options_->export_mode << ") on " << options_->export_path << std::endl;
+}
+
+void FrameExporter::Stop()
+{
+	if (!running_)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		running_ = false;
+		abort_ = true;
+		queue_ = {};
+	}
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		std::cerr << "FrameExporter: failed to wake export thread" << std::endl;
+	thread_.join();
+
+	// Dropping the clients returns any buffers they were holding.
+	for (auto &client : clients_)
+	{
+		if (options_->verbose)
+			std::cerr << "Export client sent " << client.sent << " frames, skipped " << client.skipped << std::endl;
+		close(client.fd);
+	}
+	clients_.clear();
+	if (frames_dropped_)
+		std::cerr << "FrameExporter: dropped " << frames_dropped_ << " frames" << std::endl;
+
+	close(listen_fd_);
+	unlink(options_->export_path.c_str());
+	close(event_fd_);
+	listen_fd_ = event_fd_ = -1;
+	if (ring_)
+	{
+		munmap(ring_, slot_size_ * slot_refs_.size());
+		close(ring_fd_);
+		ring_ = nullptr;
+		ring_fd_ = -1;
+	}
+}
+
+void FrameExporter::Publish(CompletedRequestPtr &completed_request, std::vector<libcamera::Span<uint8_t>> const &spans)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!running_)
+			return;
+		// Don't let frames pile up here if the export thread gets behind.
+		if (queue_.size() >= 2)
+		{
+			queue_.pop();
+			frames_dropped_++;
+		}
+		queue_.push({ completed_request, spans });
+	}
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		std::cerr << "FrameExporter: failed to wake export thread" << std::endl;
+}
+
+void FrameExporter::exportThread()
+{
+	while (true)
+	{
+		std::vector<pollfd> fds = { { event_fd_, POLLIN, 0 }, { listen_fd_, POLLIN, 0 } };
+		for (auto const &client : clients_)
+			fds.push_back({ client.fd, POLLIN, 0 });
+		if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+		{
+			std::cerr << "FrameExporter: poll failed" << std::endl;
+			return;
+		}
+
+		uint64_t count;
+		if ((fds[0].revents & POLLIN) && read(event_fd_, &count, sizeof(count)) < 0)
+			std::cerr << "FrameExporter: failed to read eventfd" << std::endl;
+		for (unsigned int i = clients_.size(); i-- > 0;)
+		{
+			if (fds[i + 2].revents && !readAcks(clients_[i]))
+				removeClient(i);
+		}
+		if (fds[1].revents & POLLIN)
+			acceptClient();
+
+		while (true)
+		{
+			Item item;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (abort_)
+					return;
+				if (queue_.empty())
+					break;
+				item = std::move(queue_.front());
+				queue_.pop();
+			}
+			sendFrame(item);
+		}
+	}
+}
+
+void FrameExporter::acceptClient()
+{
+	int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	Client client;
+	client.fd = fd;
+	if (!sendHello(client))
+	{
+		close(fd);
+		return;
+	}
+	clients_.push_back(std::move(client));
+
+	if (options_->verbose)
+		std::cerr << "Export client connected" << std::endl;
+}
+
+bool FrameExporter::sendHello(Client &client)
+{
+	ExportHello hello = {};
+	hello.magic = ExportHello::MAGIC;
+	hello.version = ExportHello::VERSION;
+	hello.memfd_mode = memfd_mode_;
+	hello.num_streams = streams_.size();
+	hello.num_slots = slot_refs_.size();
+	hello.slot_size = slot_size_;
+	uint32_t offset = 0;
+	for (unsigned int i = 0; i < streams_.size(); i++)
+	{
+		ExportStreamInfo &info = hello.streams[i];
+		info.width = streams_[i].info.width;
+		info.height = streams_[i].info.height;
+		info.stride = streams_[i].info.stride;
+		info.fourcc = streams_[i].info.pixel_format.fourcc();
+		info.size = streams_[i].size;
+		info.offset = offset;
+		offset += (streams_[i].size + 4095) & ~4095;
+	}
+
+	return send_message(client.fd, &hello, sizeof(hello), &ring_fd_, memfd_mode_ ? 1 : 0) == sizeof(hello);
+}
+
+void FrameExporter::sendFrame(Item &item)
+{
+	using namespace libcamera;
+
+	ControlList const &metadata = item.completed_request->metadata;
+	ExportFrame frame = {};
+	frame.magic = ExportFrame::MAGIC;
+	frame.sequence = item.completed_request->sequence;
+	if (metadata.contains(controls::SensorTimestamp))
+		frame.timestamp_ns = metadata.get(controls::SensorTimestamp);
+	if (metadata.contains(controls::ExposureTime))
+		frame.exposure_time_us = metadata.get(controls::ExposureTime);
+	if (metadata.contains(controls::FrameDuration))
+		frame.frame_duration_us = metadata.get(controls::FrameDuration);
+	if (metadata.contains(controls::AnalogueGain))
+		frame.analogue_gain = metadata.get(controls::AnalogueGain);
+	if (metadata.contains(controls::DigitalGain))
+		frame.digital_gain = metadata.get(controls::DigitalGain);
+	if (metadata.contains(controls::ColourGains))
+	{
+		auto gains = metadata.get(controls::ColourGains);
+		frame.colour_gains[0] = gains[0], frame.colour_gains[1] = gains[1];
+	}
+	if (metadata.contains(controls::Lux))
+		frame.lux = metadata.get(controls::Lux);
+
+	// Only the consumers with room for another frame get this one.
+	std::vector<unsigned int> recipients;
+	for (unsigned int i = 0; i < clients_.size(); i++)
+	{
+		if ((memfd_mode_ ? clients_[i].slots.size() : clients_[i].requests.size()) < depth_)
+			recipients.push_back(i);
+		else
+			clients_[i].skipped++;
+	}
+	if (recipients.empty())
+		return;
+
+	int fds[ExportHello::MAX_STREAMS];
+	int slot = -1;
+	if (memfd_mode_)
+	{
+		slot = findSlot();
+		if (slot < 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			frames_dropped_++;
+			return;
+		}
+		uint8_t *dest = ring_ + slot * slot_size_;
+		for (unsigned int i = 0; i < streams_.size(); i++)
+		{
+			memcpy(dest, item.spans[i].data(), std::min(item.spans[i].size(), streams_[i].size));
+			dest += (streams_[i].size + 4095) & ~4095;
+		}
+		frame.slot = slot;
+	}
+	else
+	{
+		for (unsigned int i = 0; i < streams_.size(); i++)
+		{
+			auto it = item.completed_request->buffers.find(streams_[i].stream);
+			if (it == item.completed_request->buffers.end())
+				return;
+			fds[i] = it->second->planes()[0].fd.get();
+		}
+		frame.num_fds = streams_.size();
+	}
+
+	std::vector<unsigned int> failed;
+	for (unsigned int i : recipients)
+	{
+		Client &client = clients_[i];
+		ssize_t ret = send_message(client.fd, &frame, sizeof(frame), fds, frame.num_fds);
+		if (ret == sizeof(frame))
+		{
+			if (memfd_mode_)
+				client.slots[frame.sequence] = slot, slot_refs_[slot]++;
+			else
+				client.requests[frame.sequence] = item.completed_request;
+			client.sent++;
+		}
+		else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			client.skipped++;
+		else
+			failed.push_back(i);
+	}
+	for (auto it = failed.rbegin(); it != failed.rend(); it++)
+		removeClient(*it);
+}
+
+bool FrameExporter::readAcks(Client &client)
+{
+	while (true)
+	{
+		ExportAck ack;
+		ssize_t ret = recv(client.fd, &ack, sizeof(ack), MSG_DONTWAIT);
+		if (ret < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		else if (ret == 0)
+			return false; // the client has gone
+		else if (ret != sizeof(ack) || ack.magic != ExportAck::MAGIC)
+			continue;
+
+		client.requests.erase(ack.sequence); // so the buffers can go back to the camera
+		auto it = client.slots.find(ack.sequence);
+		if (it != client.slots.end())
+		{
+			slot_refs_[it->second]--;
+			client.slots.erase(it);
+		}
+	}
+}
+
+void FrameExporter::removeClient(unsigned int index)
+{
+	Client &client = clients_[index];
+	for (auto const &[sequence, slot] : client.slots)
+		slot_refs_[slot]--;
+	close(client.fd);
+	if (options_->verbose)
+		std::cerr << "Export client disconnected, sent " << client.sent << " frames, skipped " << client.skipped
+				  << std::endl;
+	clients_.erase(clients_.begin() + index);
+}
+
+int FrameExporter::findSlot()
+{
+	for (unsigned int i = 0; i < slot_refs_.size(); i++)
+	{
+		if (slot_refs_[i] == 0)
+			return i;
+	}
+	return -1;
+}
@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_exporter.hpp - publish frames to other processes over a Unix socket.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/base/span.h>
+#include <libcamera/stream.h>
+
+#include "core/completed_request.hpp"
+#include "core/stream_info.hpp"
+
+struct Options;
+
+// Consumers connect to a SOCK_SEQPACKET Unix socket and are sent an ExportHello describing
+// the streams. After that, each frame arrives as an ExportFrame. In dmabuf mode the frame
+// message carries one fd per stream (SCM_RIGHTS), which the consumer must close. In memfd
+// mode the hello carries a single fd for a ring of slots, and each frame names the slot
+// that holds a copy of it. Either way, the consumer sends an ExportAck with the frame's
+// sequence number once it has finished with it. A consumer that is still holding "depth"
+// frames is simply not sent any more until it acknowledges one.
+
+struct ExportStreamInfo
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t fourcc;
+	uint32_t size; // bytes in the buffer
+	uint32_t offset; // within the slot, in memfd mode
+};
+
+struct ExportHello
+{
+	static constexpr uint32_t MAGIC = 0x4c43454f; // "OECL"
+	static constexpr uint32_t VERSION = 1;
+	static constexpr unsigned int MAX_STREAMS = 2;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t memfd_mode;
+	uint32_t num_streams;
+	uint32_t num_slots;
+	uint32_t slot_size;
+	ExportStreamInfo streams[MAX_STREAMS];
+};
+
+struct ExportFrame
+{
+	static constexpr uint32_t MAGIC = 0x4d524646; // "FFRM"
+	uint32_t magic;
+	uint32_t slot; // memfd mode only
+	uint64_t sequence;
+	int64_t timestamp_ns;
+	int64_t exposure_time_us;
+	int64_t frame_duration_us;
+	float analogue_gain;
+	float digital_gain;
+	float colour_gains[2];
+	float lux;
+	uint32_t num_fds;
+};
+
+struct ExportAck
+{
+	static constexpr uint32_t MAGIC = 0x4b434146; // "FACK"
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t sequence;
+};
+
+class FrameExporter
+{
+public:
+	struct StreamConfig
+	{
+		libcamera::Stream *stream;
+		StreamInfo info;
+		size_t size;
+	};
+
+	FrameExporter(Options const *options);
+	~FrameExporter();
+
+	void Start(std::vector<StreamConfig> const &streams);
+	void Stop();
+	// Offer a frame to the consumers. The spans are the mapped buffers for each of the
+	// streams, in the order they were given to Start().
+	void Publish(CompletedRequestPtr &completed_request, std::vector<libcamera::Span<uint8_t>> const &spans);
+
+private:
+	struct Item
+	{
+		CompletedRequestPtr completed_request;
+		std::vector<libcamera::Span<uint8_t>> spans;
+	};
+	struct Client
+	{
+		int fd;
+		// Either the request (dmabuf mode) or the slot (memfd mode) for each frame sent.
+		std::map<uint64_t, CompletedRequestPtr> requests;
+		std::map<uint64_t, unsigned int> slots;
+		uint64_t sent = 0;
+		uint64_t skipped = 0;
+	};
+
+	void exportThread();
+	void acceptClient();
+	bool sendHello(Client &client);
+	void sendFrame(Item &item);
+	bool readAcks(Client &client);
+	void removeClient(unsigned int index);
+	int findSlot();
+
+	Options const *options_;
+	bool memfd_mode_;
+	unsigned int depth_;
+	std::vector<StreamConfig> streams_;
+	int listen_fd_ = -1;
+	int event_fd_ = -1;
+	std::thread thread_;
+	bool running_ = false;
+	std::mutex mutex_;
+	std::queue<Item> queue_;
+	bool abort_ = false;
+	// These belong to the export thread.
+	std::vector<Client> clients_;
+	int ring_fd_ = -1;
+	uint8_t *ring_ = nullptr;
+	size_t slot_size_ = 0;
+	std::vector<unsigned int> slot_refs_;
+	uint64_t frames_dropped_ = 0;
+};
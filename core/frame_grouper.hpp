@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_grouper.hpp - match up frames from several cameras by their timestamps.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <libcamera/control_ids.h>
+
+#include "core/completed_request.hpp"
+
+// Frames from each camera are held until there is one from every camera whose timestamps
+// all lie within the tolerance, and these are returned as a group. A frame that can no
+// longer be part of any group - because another camera has a frame too much newer - is
+// discarded. Cameras are numbered here from 0 to num_cameras - 1 in the order the
+// application gave them, whatever their libcamera indexes.
+
+class FrameGrouper
+{
+public:
+	typedef std::vector<CompletedRequestPtr> Group;
+
+	FrameGrouper(unsigned int num_cameras, unsigned int tolerance_us, unsigned int max_pending = 4)
+		: pending_(num_cameras), tolerance_(tolerance_us * 1000LL), max_pending_(max_pending)
+	{
+	}
+
+	// Returns any groups this frame completed, each with one frame per camera in order.
+	std::vector<Group> Add(unsigned int camera, CompletedRequestPtr &completed_request)
+	{
+		std::deque<CompletedRequestPtr> &queue = pending_[camera];
+		queue.push_back(completed_request);
+		if (queue.size() > max_pending_)
+		{
+			queue.pop_front();
+			discarded_++;
+		}
+
+		std::vector<Group> groups;
+		while (std::none_of(pending_.begin(), pending_.end(), [](auto &q) { return q.empty(); }))
+		{
+			int64_t newest = 0;
+			for (auto &q : pending_)
+				newest = std::max(newest, timestamp(q.front()));
+
+			bool complete = true;
+			for (auto &q : pending_)
+			{
+				if (timestamp(q.front()) < newest - tolerance_)
+				{
+					q.pop_front();
+					discarded_++;
+					complete = false;
+				}
+			}
+			if (!complete)
+				continue;
+
+			Group group;
+			for (auto &q : pending_)
+			{
+				group.push_back(std::move(q.front()));
+				q.pop_front();
+			}
+			groups.push_back(std::move(group));
+		}
+		return groups;
+	}
+
+	void Clear()
+	{
+		for (auto &q : pending_)
+			q.clear();
+	}
+
+	uint64_t Discarded() const { return discarded_; }
+
+private:
+	static int64_t timestamp(CompletedRequestPtr const &completed_request)
+	{
+		libcamera::ControlList const &metadata = completed_request->metadata;
+		return metadata.contains(libcamera::controls::SensorTimestamp)
+				   ? metadata.get(libcamera::controls::SensorTimestamp)
+				   : 0;
+	}
+
+	std::vector<std::deque<CompletedRequestPtr>> pending_;
+	int64_t tolerance_;
+	unsigned int max_pending_;
+	uint64_t discarded_ = 0;
+};
@@ -0,0 +1,534 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_source.cpp - synthetic and file-replay frame sources.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <random>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
+
+#include "core/frame_source.hpp"
+#include "core/options.hpp"
+
+using namespace libcamera;
+
+namespace
+{
+
+struct RawFormat
+{
+	PixelFormat format;
+	unsigned int bits;
+	bool packed;
+};
+
+const std::vector<RawFormat> raw_formats = {
+	{ formats::SBGGR8, 8, false },		  { formats::SGBRG8, 8, false },
+	{ formats::SGRBG8, 8, false },		  { formats::SRGGB8, 8, false },
+	{ formats::SBGGR10, 10, false },	  { formats::SGBRG10, 10, false },
+	{ formats::SGRBG10, 10, false },	  { formats::SRGGB10, 10, false },
+	{ formats::SBGGR10_CSI2P, 10, true }, { formats::SGBRG10_CSI2P, 10, true },
+	{ formats::SGRBG10_CSI2P, 10, true }, { formats::SRGGB10_CSI2P, 10, true },
+	{ formats::SBGGR12, 12, false },	  { formats::SGBRG12, 12, false },
+	{ formats::SGRBG12, 12, false },	  { formats::SRGGB12, 12, false },
+	{ formats::SBGGR12_CSI2P, 12, true }, { formats::SGBRG12_CSI2P, 12, true },
+	{ formats::SGRBG12_CSI2P, 12, true }, { formats::SRGGB12_CSI2P, 12, true },
+};
+
+RawFormat const *find_raw_format(PixelFormat const &format)
+{
+	for (auto const &raw_format : raw_formats)
+	{
+		if (raw_format.format == format)
+			return &raw_format;
+	}
+	return nullptr;
+}
+
+// The nominal sensor we pretend to have.
+const Size sensor_size(2028, 1520);
+
+unsigned int align_up(unsigned int value, unsigned int alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Streams aren't normally made by applications, but the configuration they carry is
+// only accessible to derived classes.
+class SourceStream : public Stream
+{
+public:
+	void SetConfiguration(StreamConfiguration const &cfg) { configuration_ = cfg; }
+};
+
+// Our configuration lays buffers out in the way that the Pi's ISP and Unicam would.
+class SourceConfiguration : public CameraConfiguration
+{
+public:
+	Status validate() override
+	{
+		if (config_.empty())
+			return Invalid;
+
+		Status status = Valid;
+		for (StreamConfiguration &cfg : config_)
+		{
+			RawFormat const *raw_format = find_raw_format(cfg.pixelFormat);
+			if (!raw_format && cfg.pixelFormat != formats::YUV420 && cfg.pixelFormat != formats::RGB888 &&
+				cfg.pixelFormat != formats::BGR888)
+			{
+				cfg.pixelFormat = formats::YUV420;
+				status = Adjusted;
+			}
+
+			Size size = cfg.size;
+			size.boundTo(Size(8192, 8192)).alignDownTo(2, 2);
+			if (size.width == 0 || size.height == 0)
+				size = raw_format ? sensor_size : Size(640, 480);
+			if (size != cfg.size)
+			{
+				cfg.size = size;
+				status = Adjusted;
+			}
+
+			if (raw_format)
+			{
+				unsigned int bits = raw_format->bits == 8 || raw_format->packed ? raw_format->bits : 16;
+				cfg.stride = align_up((cfg.size.width * bits + 7) / 8, 32);
+				cfg.frameSize = cfg.stride * cfg.size.height;
+				cfg.colorSpace = ColorSpace::Raw;
+			}
+			else if (cfg.pixelFormat == formats::YUV420)
+			{
+				cfg.stride = align_up(cfg.size.width, 64);
+				cfg.frameSize = cfg.stride * cfg.size.height * 3 / 2;
+			}
+			else
+			{
+				cfg.stride = align_up(cfg.size.width * 3, 32);
+				cfg.frameSize = cfg.stride * cfg.size.height;
+			}
+
+			if (cfg.bufferCount == 0)
+			{
+				cfg.bufferCount = 1;
+				status = Adjusted;
+			}
+		}
+
+		return status;
+	}
+};
+
+// Copy "height" rows out of a texture, starting each one at a different offset so that
+// the image has some structure and changes from frame to frame.
+void fill_plane(uint8_t *dst, unsigned int stride, unsigned int height, std::vector<uint8_t> const &texture,
+				unsigned int period, unsigned int row_step, unsigned int start)
+{
+	for (unsigned int y = 0; y < height; y++, dst += stride)
+		memcpy(dst, &texture[(start + y * row_step) % period], stride);
+}
+
+// Nearest-neighbour resize of one YUV420 image into another, used to make the low
+// resolution stream match the images we replay into the main one.
+void resize_yuv420(uint8_t const *src, StreamConfiguration const &src_cfg, uint8_t *dst,
+				   StreamConfiguration const &dst_cfg)
+{
+	for (unsigned int plane = 0; plane < 3; plane++)
+	{
+		unsigned int shift = plane ? 1 : 0;
+		unsigned int src_stride = src_cfg.stride >> shift, dst_stride = dst_cfg.stride >> shift;
+		unsigned int src_w = src_cfg.size.width >> shift, src_h = src_cfg.size.height >> shift;
+		unsigned int dst_w = dst_cfg.size.width >> shift, dst_h = dst_cfg.size.height >> shift;
+
+		std::vector<unsigned int> x_map(dst_w);
+		for (unsigned int x = 0; x < dst_w; x++)
+			x_map[x] = x * src_w / dst_w;
+
+		for (unsigned int y = 0; y < dst_h; y++)
+		{
+			uint8_t const *src_row = src + (y * src_h / dst_h) * src_stride;
+			uint8_t *dst_row = dst + y * dst_stride;
+			for (unsigned int x = 0; x < dst_w; x++)
+				dst_row[x] = src_row[x_map[x]];
+		}
+
+		src += src_stride * src_h;
+		dst += dst_stride * dst_h;
+	}
+}
+
+// Fills every buffer with a moving test pattern. The "bars" pattern compresses about as
+// well as a real scene, the "noise" one is there to give the encoders a hard time.
+class PatternFrameSource : public FrameSource
+{
+public:
+	PatternFrameSource(Options const *options, std::string const &id, std::string const &pattern)
+		: FrameSource(options, id)
+	{
+		if (pattern == "bars")
+		{
+			period_ = 8192, row_step_ = 1, frame_step_ = 4;
+			for (unsigned int i = 0; i < period_; i++)
+				texture_.push_back(((i / 32) * 37) & 0xff);
+		}
+		else if (pattern == "noise")
+		{
+			period_ = 65521, row_step_ = 1031, frame_step_ = 7919;
+			std::minstd_rand rng(1);
+			for (unsigned int i = 0; i < period_; i++)
+				texture_.push_back(rng() & 0xff);
+		}
+		else
+			throw std::runtime_error("unrecognised synthetic pattern " + pattern);
+	}
+
+protected:
+	void fillBuffer(StreamConfiguration const &cfg, uint8_t *mem, uint64_t frame) override
+	{
+		// Extend the texture so that we can always copy a whole row from any offset.
+		while (texture_.size() < period_ + cfg.stride)
+			texture_.push_back(texture_[texture_.size() - period_]);
+
+		unsigned int start = (frame * frame_step_) % period_;
+		if (cfg.pixelFormat == formats::YUV420)
+		{
+			unsigned int chroma_stride = cfg.stride / 2, chroma_height = cfg.size.height / 2;
+			uint8_t *u = mem + cfg.stride * cfg.size.height, *v = u + chroma_stride * chroma_height;
+			fill_plane(mem, cfg.stride, cfg.size.height, texture_, period_, row_step_, start);
+			fill_plane(u, chroma_stride, chroma_height, texture_, period_, row_step_, start + 1000);
+			fill_plane(v, chroma_stride, chroma_height, texture_, period_, row_step_, start + 3000);
+		}
+		else
+			fill_plane(mem, cfg.stride, cfg.size.height, texture_, period_, row_step_, start);
+	}
+
+private:
+	std::vector<uint8_t> texture_;
+	unsigned int period_;
+	unsigned int row_step_;
+	unsigned int frame_step_;
+};
+
+// Replays a file of YUV420 or raw frames, laid out exactly as the buffers of the stream
+// they are read into (as written by "libcamera-vid --codec yuv420" or "libcamera-raw").
+// The file loops when we reach the end. Any other streams get the test pattern, except
+// for a low resolution YUV420 stream which is resized from the replayed image.
+class FileFrameSource : public PatternFrameSource
+{
+public:
+	FileFrameSource(Options const *options, std::string const &filename, bool raw)
+		: PatternFrameSource(options, "file:" + filename, "bars"), filename_(filename), raw_(raw)
+	{
+		fp_ = fopen(filename.c_str(), "rb");
+		if (!fp_)
+			throw std::runtime_error("failed to open frame source file " + filename);
+	}
+	~FileFrameSource() { fclose(fp_); }
+
+protected:
+	void configure() override
+	{
+		file_stream_ = nullptr;
+		last_frame_ = nullptr;
+	}
+
+	void fillBuffer(StreamConfiguration const &cfg, uint8_t *mem, uint64_t frame) override
+	{
+		// Replay into the first suitable stream; the streams are filled in configuration order.
+		bool raw_stream = find_raw_format(cfg.pixelFormat) != nullptr;
+		if (!file_stream_ && (raw_ ? raw_stream : cfg.pixelFormat == formats::YUV420))
+		{
+			file_stream_ = cfg.stream();
+			file_stream_cfg_ = cfg;
+		}
+
+		if (cfg.stream() == file_stream_)
+		{
+			if (fread(mem, cfg.frameSize, 1, fp_) != 1)
+			{
+				rewind(fp_);
+				if (fread(mem, cfg.frameSize, 1, fp_) != 1)
+					throw std::runtime_error(filename_ + " does not contain a whole " + cfg.toString() + " frame");
+			}
+			last_frame_ = raw_ ? nullptr : mem;
+		}
+		else if (last_frame_ && cfg.pixelFormat == formats::YUV420)
+			resize_yuv420(last_frame_, file_stream_cfg_, mem, cfg);
+		else
+			PatternFrameSource::fillBuffer(cfg, mem, frame);
+	}
+
+private:
+	std::string filename_;
+	bool raw_;
+	FILE *fp_;
+	Stream const *file_stream_ = nullptr;
+	StreamConfiguration file_stream_cfg_;
+	uint8_t const *last_frame_ = nullptr;
+};
+
+} // namespace
+
+FrameSource *FrameSource::Create(Options const *options)
+{
+	std::string const &source = options->frame_source;
+	if (source.empty() || source == "camera")
+		return nullptr;
+
+	size_t colon = source.find(':');
+	std::string type = source.substr(0, colon);
+	std::string arg = colon == std::string::npos ? "" : source.substr(colon + 1);
+
+	if (type == "synthetic")
+	{
+		std::string pattern = arg.empty() ? "bars" : arg;
+		return new PatternFrameSource(options, "synthetic:" + pattern, pattern);
+	}
+	else if ((type == "yuv" || type == "raw") && !arg.empty())
+		return new FileFrameSource(options, arg, type == "raw");
+
+	throw std::runtime_error("unrecognised frame source " + source);
+}
+
+FrameSource::FrameSource(Options const *options, std::string const &id) : options_(options), id_(id)
+{
+}
+
+FrameSource::~FrameSource()
+{
+	Stop();
+	Teardown();
+}
+
+std::unique_ptr<CameraConfiguration> FrameSource::GenerateConfiguration(StreamRoles const &roles) const
+{
+	std::unique_ptr<CameraConfiguration> config = std::make_unique<SourceConfiguration>();
+
+	for (StreamRole role : roles)
+	{
+		StreamConfiguration cfg;
+		cfg.pixelFormat = formats::YUV420;
+		cfg.bufferCount = 4;
+		switch (role)
+		{
+		case StreamRole::Raw:
+			cfg.pixelFormat = formats::SBGGR12_CSI2P;
+			cfg.size = sensor_size;
+			break;
+		case StreamRole::StillCapture:
+			cfg.size = sensor_size;
+			cfg.bufferCount = 1;
+			cfg.colorSpace = ColorSpace::Jpeg;
+			break;
+		case StreamRole::VideoRecording:
+			cfg.size = Size(1920, 1080);
+			cfg.colorSpace = ColorSpace::Rec709;
+			break;
+		case StreamRole::Viewfinder:
+			cfg.size = Size(800, 600);
+			cfg.colorSpace = ColorSpace::Jpeg;
+			break;
+		}
+		config->addConfiguration(cfg);
+	}
+
+	config->validate();
+	return config;
+}
+
+void FrameSource::Configure(CameraConfiguration *config)
+{
+	Teardown();
+	configure();
+
+	for (StreamConfiguration &cfg : *config)
+	{
+		std::unique_ptr<SourceStream> stream = std::make_unique<SourceStream>();
+		cfg.setStream(stream.get());
+		stream->SetConfiguration(cfg);
+
+		// The buffers are memfds, so they can be passed around and mmapped just like dmabufs.
+		for (unsigned int i = 0; i < cfg.bufferCount; i++)
+		{
+			int fd = memfd_create("libcamera-apps-frame", MFD_CLOEXEC);
+			if (fd < 0)
+				throw std::runtime_error("failed to create frame source buffer");
+			if (ftruncate(fd, cfg.frameSize) < 0)
+			{
+				close(fd);
+				throw std::runtime_error("failed to size frame source buffer");
+			}
+
+			void *mem = mmap(NULL, cfg.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mem == MAP_FAILED)
+			{
+				close(fd);
+				throw std::runtime_error("failed to mmap frame source buffer");
+			}
+
+			FrameBuffer::Plane plane;
+			plane.fd = SharedFD(std::move(fd));
+			plane.offset = 0;
+			plane.length = cfg.frameSize;
+			std::unique_ptr<FrameBuffer> buffer = std::make_unique<FrameBuffer>(std::vector<FrameBuffer::Plane>{ plane });
+			mapped_buffers_[buffer.get()] = Span<uint8_t>(static_cast<uint8_t *>(mem), cfg.frameSize);
+			buffers_[stream.get()].push_back(std::move(buffer));
+		}
+
+		streams_.push_back(std::move(stream));
+	}
+
+	if (options_->verbose)
+		std::cerr << "Frame source " << id_ << " configured" << std::endl;
+}
+
+std::vector<std::unique_ptr<FrameBuffer>> const &FrameSource::Buffers(Stream *stream) const
+{
+	auto it = buffers_.find(stream);
+	if (it == buffers_.end())
+		throw std::runtime_error("frame source has no buffers for stream");
+	return it->second;
+}
+
+void FrameSource::SetControls(ControlList const &controls)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (controls.contains(controls::FrameDurationLimits))
+		frame_duration_ = controls.get(controls::FrameDurationLimits)[0] * 1000;
+	if (controls.contains(controls::ExposureTime))
+		exposure_time_ = controls.get(controls::ExposureTime);
+	if (controls.contains(controls::AnalogueGain))
+		analogue_gain_ = controls.get(controls::AnalogueGain);
+	if (controls.contains(controls::ColourGains))
+	{
+		auto gains = controls.get(controls::ColourGains);
+		colour_gains_[0] = gains[0], colour_gains_[1] = gains[1];
+	}
+}
+
+void FrameSource::Start(FrameCallback callback)
+{
+	if (streams_.empty())
+		throw std::runtime_error("frame source not configured");
+
+	// Group the buffers into sets, one buffer from each stream, just like requests.
+	for (unsigned int i = 0; i < buffers_[streams_[0].get()].size(); i++)
+	{
+		BufferMap buffers;
+		for (auto &stream : streams_)
+		{
+			if (i >= buffers_[stream.get()].size())
+				throw std::runtime_error("concurrent streams need matching numbers of buffers");
+			buffers[stream.get()] = buffers_[stream.get()][i].get();
+		}
+		free_buffers_.push(std::move(buffers));
+	}
+
+	callback_ = callback;
+	abort_ = false;
+	thread_ = std::thread(&FrameSource::sourceThread, this);
+}
+
+void FrameSource::Stop()
+{
+	if (!thread_.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_one();
+	}
+	thread_.join();
+
+	free_buffers_ = {};
+	callback_ = nullptr;
+}
+
+void FrameSource::QueueBuffers(BufferMap const &buffers)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (abort_)
+		return;
+	free_buffers_.push(buffers);
+	cond_var_.notify_one();
+}
+
+void FrameSource::Teardown()
+{
+	for (auto &it : mapped_buffers_)
+		munmap(it.second.data(), it.second.size());
+	mapped_buffers_.clear();
+	buffers_.clear();
+	streams_.clear();
+}
+
+void FrameSource::sourceThread()
+{
+	using namespace std::chrono;
+	steady_clock::time_point next_frame = steady_clock::now();
+
+	while (true)
+	{
+		BufferMap buffers;
+		ControlList metadata(controls::controls);
+		int64_t frame_duration;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] { return abort_ || !free_buffers_.empty(); });
+			if (abort_)
+				return;
+			buffers = std::move(free_buffers_.front());
+			free_buffers_.pop();
+
+			frame_duration = frame_duration_;
+			int32_t exposure_time = exposure_time_;
+			if (frame_duration && exposure_time > frame_duration / 1000)
+				exposure_time = frame_duration / 1000;
+			metadata.set(controls::ExposureTime, exposure_time);
+			metadata.set(controls::AnalogueGain, analogue_gain_);
+			metadata.set(controls::DigitalGain, 1.0f);
+			metadata.set(controls::ColourGains, { colour_gains_[0], colour_gains_[1] });
+			metadata.set(controls::FrameDuration, frame_duration ? frame_duration / 1000 : exposure_time);
+		}
+
+		steady_clock::time_point now = steady_clock::now();
+		if (frame_duration)
+		{
+			// Like a real sensor, we drop the frames for which nobody gave us buffers.
+			nanoseconds period(frame_duration);
+			if (now > next_frame + period)
+			{
+				auto missed = (now - next_frame) / period;
+				next_frame += missed * period;
+				frame_ += missed;
+			}
+			std::this_thread::sleep_until(next_frame);
+			now = next_frame;
+			next_frame += period;
+		}
+		metadata.set(controls::SensorTimestamp,
+					 (int64_t)duration_cast<nanoseconds>(now.time_since_epoch()).count());
+
+		// Fill the streams in configuration order, so the main one is always first.
+		for (auto const &stream : streams_)
+		{
+			auto it = buffers.find(stream.get());
+			if (it != buffers.end())
+				fillBuffer(stream->configuration(), mapped_buffers_[it->second].data(), frame_);
+		}
+		frame_++;
+
+		callback_(buffers, metadata);
+	}
+}
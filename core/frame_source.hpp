@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * frame_source.hpp - synthetic and file-replay frame sources.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/base/span.h>
+#include <libcamera/camera.h>
+#include <libcamera/controls.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/request.h>
+#include <libcamera/stream.h>
+
+struct Options;
+
+// A FrameSource stands in for the camera so that the applications can be run without
+// one, for example to benchmark the encoders and post-processing on a build machine.
+// It mimics just enough of libcamera::Camera for LibcameraApp to configure streams,
+// allocate (dmabuf-like, mmap-able) buffers and receive completed frames. Frames are
+// produced at the rate given by the FrameDurationLimits control, or as fast as the
+// application hands the buffers back if there is none.
+
+class FrameSource
+{
+public:
+	using Stream = libcamera::Stream;
+	using StreamRoles = libcamera::StreamRoles;
+	using StreamConfiguration = libcamera::StreamConfiguration;
+	using CameraConfiguration = libcamera::CameraConfiguration;
+	using FrameBuffer = libcamera::FrameBuffer;
+	using ControlList = libcamera::ControlList;
+	using BufferMap = libcamera::Request::BufferMap;
+	typedef std::function<void(BufferMap &, ControlList &)> FrameCallback;
+
+	// Returns nullptr if the options ask for the real camera.
+	static FrameSource *Create(Options const *options);
+
+	FrameSource(Options const *options, std::string const &id);
+	virtual ~FrameSource();
+
+	std::string const &Id() const { return id_; }
+	std::unique_ptr<CameraConfiguration> GenerateConfiguration(StreamRoles const &roles) const;
+	void Configure(CameraConfiguration *config);
+	std::vector<std::unique_ptr<FrameBuffer>> const &Buffers(Stream *stream) const;
+	// Apply controls to the frames that follow, just as the camera would.
+	void SetControls(ControlList const &controls);
+	void Start(FrameCallback callback);
+	void Stop();
+	// Give back the buffers from a frame so that they can be filled again.
+	void QueueBuffers(BufferMap const &buffers);
+	void Teardown();
+
+protected:
+	// Called when new streams are configured, before any buffers are filled.
+	virtual void configure() {}
+	// Write the contents of the given frame into a buffer belonging to this stream.
+	virtual void fillBuffer(StreamConfiguration const &cfg, uint8_t *mem, uint64_t frame) = 0;
+
+	Options const *options_;
+
+private:
+	void sourceThread();
+
+	std::string id_;
+	std::vector<std::unique_ptr<Stream>> streams_;
+	std::map<Stream const *, std::vector<std::unique_ptr<FrameBuffer>>> buffers_;
+	std::map<FrameBuffer const *, libcamera::Span<uint8_t>> mapped_buffers_;
+	std::queue<BufferMap> free_buffers_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	bool abort_ = false;
+	std::thread thread_;
+	FrameCallback callback_;
+	// The "sensor" state, as updated by SetControls.
+	int64_t frame_duration_ = 0; // in ns, 0 means "as fast as possible"
+	int32_t exposure_time_ = 10000; // in us
+	float analogue_gain_ = 1.0;
+	float colour_gains_[2] = { 1.5, 1.5 };
+	uint64_t frame_ = 0;
+};
@@ -0,0 +1,310 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * latency_tracer.cpp - per-stage frame latency tracing.
+ */
+
+#include <time.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "core/latency_tracer.hpp"
+
+static char const *stage_names[] = { "capture", "queue", "post-process", "dispatch", "encode", "output", "total" };
+
+static int64_t now_us()
+{
+	// Sensor timestamps are on the same clock.
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * INT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+// A single-producer, single-consumer ring of records. Each thread that records has its
+// own, and gives it back for another thread to use when it exits (the post-processor
+// runs a short-lived thread for every frame).
+
+struct LatencyTracer::Ring
+{
+	static constexpr unsigned int SIZE = 1024;
+	struct Item
+	{
+		int64_t timestamp_us;
+		int64_t time_us;
+		TracePoint point;
+		unsigned int camera;
+	};
+	bool Push(Item const &item)
+	{
+		unsigned int head = head_.load(std::memory_order_relaxed);
+		if (head - tail_.load(std::memory_order_acquire) == SIZE)
+			return false;
+		items_[head % SIZE] = item;
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+	template <typename F>
+	void Drain(F f)
+	{
+		unsigned int tail = tail_.load(std::memory_order_relaxed);
+		unsigned int head = head_.load(std::memory_order_acquire);
+		for (; tail != head; tail++)
+			f(items_[tail % SIZE]);
+		tail_.store(tail, std::memory_order_release);
+	}
+	Item items_[SIZE];
+	std::atomic<unsigned int> head_ = 0;
+	std::atomic<unsigned int> tail_ = 0;
+	std::atomic<uint64_t> overflows_ = 0;
+};
+
+namespace
+{
+
+struct RingHolder
+{
+	~RingHolder()
+	{
+		if (ring)
+			release(ring);
+	}
+	LatencyTracer::Ring *ring = nullptr;
+	std::function<void(LatencyTracer::Ring *)> release;
+};
+
+thread_local RingHolder ring_holder;
+
+} // namespace
+
+LatencyTracer &LatencyTracer::Get()
+{
+	static LatencyTracer tracer;
+	return tracer;
+}
+
+LatencyTracer::~LatencyTracer()
+{
+	Stop();
+}
+
+void LatencyTracer::Start(unsigned int interval_s)
+{
+	if (enabled_)
+		return;
+
+	interval_s_ = interval_s;
+	abort_ = false;
+	for (auto &stats : stats_)
+		stats = Stats();
+	for (auto &stats : interval_stats_)
+		stats = Stats();
+	frames_.clear();
+	incomplete_frames_ = 0;
+
+	collector_thread_ = std::thread(&LatencyTracer::collectorThread, this);
+	enabled_ = true;
+}
+
+void LatencyTracer::Stop()
+{
+	if (!enabled_)
+		return;
+
+	enabled_ = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_one();
+	}
+	collector_thread_.join();
+
+	printReport();
+}
+
+void LatencyTracer::record(TracePoint point, unsigned int camera, int64_t timestamp_us)
+{
+	if (!ring_holder.ring)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (free_rings_.empty())
+		{
+			rings_.push_back(std::make_unique<Ring>());
+			free_rings_.push_back(rings_.back().get());
+		}
+		ring_holder.ring = free_rings_.back();
+		free_rings_.pop_back();
+		ring_holder.release = [this](Ring *ring) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			free_rings_.push_back(ring);
+		};
+	}
+
+	if (!ring_holder.ring->Push({ timestamp_us, now_us(), point, camera }))
+		ring_holder.ring->overflows_++;
+}
+
+void LatencyTracer::Stats::Add(int64_t us)
+{
+	if (buckets.empty())
+		buckets.resize(NUM_BUCKETS);
+	count++;
+	sum += us;
+	max = std::max(max, us);
+	buckets[std::clamp<int64_t>(us / 100, 0, NUM_BUCKETS - 1)]++;
+}
+
+void LatencyTracer::collectorThread()
+{
+	int64_t next_summary = now_us() + interval_s_ * INT64_C(1000000);
+	while (true)
+	{
+		bool abort;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait_for(lock, std::chrono::milliseconds(10), [this] { return abort_; });
+			abort = abort_;
+		}
+
+		int64_t now = now_us();
+		collect(now, abort);
+		if (abort)
+			return;
+
+		if (interval_s_ && now >= next_summary)
+		{
+			printSummary();
+			next_summary += interval_s_ * INT64_C(1000000);
+		}
+	}
+}
+
+void LatencyTracer::collect(int64_t now, bool flush)
+{
+	std::vector<Ring *> rings;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto &ring : rings_)
+			rings.push_back(ring.get());
+	}
+
+	for (Ring *ring : rings)
+	{
+		ring->Drain([this](Ring::Item const &item) {
+			Frame &frame = frames_[{ item.camera, item.timestamp_us }];
+			frame.times[(unsigned int)item.point] = item.time_us;
+			frame.last_update = item.time_us;
+		});
+	}
+
+	// A frame is finished once it has been output. Frames that never get that far (the
+	// application might not encode every frame) are accounted for once they go quiet.
+	for (auto it = frames_.begin(); it != frames_.end();)
+	{
+		Frame const &frame = it->second;
+		if (frame.times[(unsigned int)TracePoint::OutputDone] || flush || now - frame.last_update > 1000000)
+		{
+			finishFrame(it->first.second, frame);
+			it = frames_.erase(it);
+		}
+		else
+			it++;
+	}
+}
+
+void LatencyTracer::finishFrame(int64_t timestamp_us, Frame const &frame)
+{
+	// Each stage is the time since the last point that the frame passed.
+	int64_t previous = timestamp_us;
+	for (unsigned int i = 0; i < (unsigned int)TracePoint::Count; i++)
+	{
+		if (!frame.times[i])
+			continue;
+		stats_[i].Add(frame.times[i] - previous);
+		interval_stats_[i].Add(frame.times[i] - previous);
+		previous = frame.times[i];
+	}
+
+	unsigned int output_done = (unsigned int)TracePoint::OutputDone;
+	if (frame.times[output_done])
+	{
+		stats_[NUM_STAGES - 1].Add(frame.times[output_done] - timestamp_us);
+		interval_stats_[NUM_STAGES - 1].Add(frame.times[output_done] - timestamp_us);
+	}
+	else
+		incomplete_frames_++;
+}
+
+static double percentile(std::vector<uint32_t> const &buckets, uint64_t count, double p)
+{
+	uint64_t target = count * p, total = 0;
+	for (unsigned int i = 0; i < buckets.size(); i++)
+	{
+		total += buckets[i];
+		if (total > target)
+			return (i + 0.5) / 10.0; // in ms
+	}
+	return buckets.size() / 10.0;
+}
+
+void LatencyTracer::printSummary()
+{
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(1) << "Latency (last " << interval_s_ << "s, mean/max ms):";
+	for (unsigned int i = 0; i < NUM_STAGES; i++)
+	{
+		Stats &stats = interval_stats_[i];
+		if (!stats.count)
+			continue;
+		ss << " " << stage_names[i] << " " << stats.sum / 1000.0 / stats.count << "/" << stats.max / 1000.0;
+		stats = Stats();
+	}
+	std::cerr << ss.str() << std::endl;
+}
+
+void LatencyTracer::printReport()
+{
+	uint64_t overflows = 0;
+	for (auto &ring : rings_)
+		overflows += ring->overflows_;
+
+	// Leave std::cerr formatting as we found it.
+	std::ios_base::fmtflags flags = std::cerr.flags();
+	std::streamsize precision = std::cerr.precision();
+
+	std::cerr << "Latency report (ms), " << stats_[NUM_STAGES - 1].count << " frames output, " << incomplete_frames_
+			  << " not output, " << overflows << " records lost" << std::endl;
+	std::cerr << std::fixed << std::setprecision(1);
+	for (unsigned int i = 0; i < NUM_STAGES; i++)
+	{
+		Stats const &stats = stats_[i];
+		if (!stats.count)
+			continue;
+
+		std::cerr << "    " << std::left << std::setw(13) << stage_names[i] << std::right << " mean "
+				  << std::setw(6) << stats.sum / 1000.0 / stats.count << " p50 " << std::setw(6)
+				  << percentile(stats.buckets, stats.count, 0.5) << " p99 " << std::setw(6)
+				  << percentile(stats.buckets, stats.count, 0.99) << " max " << std::setw(6) << stats.max / 1000.0
+				  << std::endl;
+
+		// A coarse histogram, in power-of-two millisecond bins.
+		std::cerr << "        ";
+		unsigned int lower = 0;
+		for (unsigned int upper = 10; lower < NUM_BUCKETS; upper = std::min(upper * 2, NUM_BUCKETS))
+		{
+			uint64_t count = 0;
+			for (unsigned int b = lower; b < upper; b++)
+				count += stats.buckets[b];
+			if (count)
+				std::cerr << "<" << upper / 10 << ":" << count << " ";
+			lower = upper;
+		}
+		std::cerr << std::endl;
+	}
+
+	std::cerr.flags(flags);
+	std::cerr.precision(precision);
+}
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * latency_tracer.hpp - per-stage frame latency tracing.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/controls.h>
+
+// Frames are identified by their camera and sensor timestamp (in microseconds), which
+// follow them all the way through to the output. Each thread records the points that frames
+// pass into its own lock-free ring, and a collector thread pairs them up afterwards,
+// so recording costs very little (and only a relaxed load when tracing is off).
+
+enum class TracePoint
+{
+	RequestComplete,
+	PostProcessStart,
+	PostProcessEnd,
+	EncoderInput,
+	EncoderOutput,
+	OutputDone,
+	Count
+};
+
+class LatencyTracer
+{
+public:
+	static LatencyTracer &Get();
+
+	~LatencyTracer();
+
+	void Record(TracePoint point, unsigned int camera, int64_t timestamp_us)
+	{
+		if (enabled_.load(std::memory_order_relaxed))
+			record(point, camera, timestamp_us);
+	}
+	void Record(TracePoint point, unsigned int camera, libcamera::ControlList const &metadata)
+	{
+		if (enabled_.load(std::memory_order_relaxed) && metadata.contains(libcamera::controls::SensorTimestamp))
+			record(point, camera, metadata.get(libcamera::controls::SensorTimestamp) / 1000);
+	}
+
+	// Print a summary line every interval_s seconds (0 for none) and a histogram at the end.
+	void Start(unsigned int interval_s);
+	void Stop();
+
+	struct Ring;
+
+private:
+	// One for each TracePoint, being the time since the previous point, and the total.
+	static constexpr unsigned int NUM_STAGES = (unsigned int)TracePoint::Count + 1;
+	static constexpr unsigned int NUM_BUCKETS = 10000; // of 100us each
+	struct Frame
+	{
+		int64_t times[(unsigned int)TracePoint::Count] = {};
+		int64_t last_update = 0;
+	};
+	struct Stats
+	{
+		void Add(int64_t us);
+		uint64_t count = 0;
+		int64_t sum = 0;
+		int64_t max = 0;
+		std::vector<uint32_t> buckets;
+	};
+
+	LatencyTracer() = default;
+	void record(TracePoint point, unsigned int camera, int64_t timestamp_us);
+	void collectorThread();
+	void collect(int64_t now, bool flush);
+	void finishFrame(int64_t timestamp_us, Frame const &frame);
+	void printSummary();
+	void printReport();
+
+	std::atomic<bool> enabled_ = false;
+	unsigned int interval_s_ = 0;
+	std::mutex mutex_;
+	std::vector<std::unique_ptr<Ring>> rings_;
+	std::vector<Ring *> free_rings_;
+	std::thread collector_thread_;
+	std::condition_variable cond_var_;
+	bool abort_ = false;
+	// These belong to the collector thread.
+	// Keyed by camera and then timestamp, as with --cameras two frames may share a timestamp.
+	std::map<std::pair<unsigned int, int64_t>, Frame> frames_;
+	Stats stats_[NUM_STAGES];
+	Stats interval_stats_[NUM_STAGES];
+	uint64_t incomplete_frames_ = 0;
+};
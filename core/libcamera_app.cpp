@@ -7,13 +7,16 @@
 
 #include "preview/preview.hpp"
 
+#include "core/clock_sync.hpp"
 #include "core/frame_info.hpp"
+#include "core/latency_tracer.hpp"
 #include "core/libcamera_app.hpp"
 #include "core/options.hpp"
 
 #include <fcntl.h>
 
 #include <sys/ioctl.h>
+#include <time.h>
 
 #include <linux/videodev2.h>
 
@@ -70,20 +73,47 @@ LibcameraApp::LibcameraApp(std::unique_ptr<Options> opts)
 
 LibcameraApp::~LibcameraApp()
 {
-	if (options_->verbose && !options_->help)
+	if ((options_->verbose || options_->preview_fps) && !options_->help)
 		std::cerr << "Closing Libcamera application"
-				  << "(frames displayed " << preview_frames_displayed_ << ", dropped " << preview_frames_dropped_ << ")"
+				  << "(frames displayed " << preview_frames_displayed_ << ", dropped " << preview_frames_dropped_
+				  << ", skipped for preview-fps " << preview_frames_decimated_ << ")" << std::endl;
+	if (frames_dropped_)
+		std::cerr << "WARNING: the camera dropped " << frames_dropped_ << " frames" << std::endl;
+	if (options_->buffer_report && buffer_count_)
+		std::cerr << "At most " << max_buffers_held_ << " of " << buffer_count_ << " buffers were held at once"
 				  << std::endl;
 	StopCamera();
 	Teardown();
 	CloseCamera();
+	LatencyTracer::Get().Stop();
+	ClockSync::Get().Stop();
 }
 
 std::string const &LibcameraApp::CameraId() const
 {
+	if (frame_source_)
+		return frame_source_->Id();
 	return camera_->id();
 }
 
+static std::shared_ptr<libcamera::CameraManager> get_camera_manager()
+{
+	static std::mutex mutex;
+	static std::weak_ptr<libcamera::CameraManager> camera_manager;
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::shared_ptr<libcamera::CameraManager> cm = camera_manager.lock();
+	if (!cm)
+	{
+		cm = std::make_shared<libcamera::CameraManager>();
+		int ret = cm->start();
+		if (ret)
+			throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+		camera_manager = cm;
+	}
+	return cm;
+}
+
 void LibcameraApp::OpenCamera()
 {
 	// Make a preview window.
@@ -93,44 +123,71 @@ void LibcameraApp::OpenCamera()
 	if (options_->verbose)
 		std::cerr << "Opening camera..." << std::endl;
 
-	camera_manager_ = std::make_unique<CameraManager>();
-	int ret = camera_manager_->start();
-	if (ret)
-		throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+	if (options_->trace_latency)
+		LatencyTracer::Get().Start(options_->trace_interval);
+	if (options_->sync_serve)
+		ClockSync::Get().Serve(options_->sync_serve);
+	else if (!options_->sync_with.empty())
+		ClockSync::Get().Follow(options_->sync_with, options_->sync_interval, options_->verbose);
 
-	std::vector<std::shared_ptr<libcamera::Camera>> cameras = camera_manager_->cameras();
-	// Do not show USB webcams as these are not supported in libcamera-apps!
-	auto rem = std::remove_if(cameras.begin(), cameras.end(),
-							  [](auto &cam) { return cam->id().find("/usb") != std::string::npos; });
-	cameras.erase(rem, cameras.end());
+	frame_source_ = std::unique_ptr<FrameSource>(FrameSource::Create(options_.get()));
+	if (frame_source_)
+	{
+		if (options_->verbose)
+			std::cerr << "Using frame source " << frame_source_->Id() << std::endl;
+	}
+	else
+	{
+		camera_manager_ = get_camera_manager();
 
-	if (cameras.size() == 0)
-		throw std::runtime_error("no cameras available");
-	if (options_->camera >= cameras.size())
-		throw std::runtime_error("selected camera is not available");
+		std::vector<std::shared_ptr<libcamera::Camera>> cameras = camera_manager_->cameras();
+		// Do not show USB webcams as these are not supported in libcamera-apps!
+		auto rem = std::remove_if(cameras.begin(), cameras.end(),
+								  [](auto &cam) { return cam->id().find("/usb") != std::string::npos; });
+		cameras.erase(rem, cameras.end());
 
-	std::string const &cam_id = cameras[options_->camera]->id();
-	camera_ = camera_manager_->get(cam_id);
-	if (!camera_)
-		throw std::runtime_error("failed to find camera " + cam_id);
+		if (cameras.size() == 0)
+			throw std::runtime_error("no cameras available");
+		if (options_->camera >= cameras.size())
+			throw std::runtime_error("selected camera is not available");
 
-	if (camera_->acquire())
-		throw std::runtime_error("failed to acquire camera " + cam_id);
-	camera_acquired_ = true;
+		std::string const &cam_id = cameras[options_->camera]->id();
+		camera_ = camera_manager_->get(cam_id);
+		if (!camera_)
+			throw std::runtime_error("failed to find camera " + cam_id);
 
-	if (options_->verbose)
-		std::cerr << "Acquired camera " << cam_id << std::endl;
+		if (camera_->acquire())
+			throw std::runtime_error("failed to acquire camera " + cam_id);
+		camera_acquired_ = true;
+
+		if (options_->verbose)
+			std::cerr << "Acquired camera " << cam_id << std::endl;
+	}
 
 	if (!options_->post_process_file.empty())
 		post_processor_.Read(options_->post_process_file);
+	if (!options_->export_path.empty())
+		frame_exporter_ = std::make_unique<FrameExporter>(options_.get());
+	if (!options_->exposure_publish.empty())
+		exposure_publisher_ = std::make_unique<ExposurePublisher>(options_->exposure_publish);
+	else if (!options_->exposure_follow.empty())
+		exposure_follower_ = std::make_unique<ExposureFollower>(options_->exposure_follow, options_->exposure_latency,
+																options_->verbose);
 	// The queue takes over ownership from the post-processor.
 	post_processor_.SetCallback(
-		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
+		[this](CompletedRequestPtr &r)
+		{
+			if (frame_exporter_)
+				exportFrame(r);
+			this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r)));
+		});
 }
 
 void LibcameraApp::CloseCamera()
 {
 	preview_.reset();
+	exposure_publisher_.reset();
+	exposure_follower_.reset();
 
 	if (camera_acquired_)
 		camera_->release();
@@ -140,6 +197,8 @@ void LibcameraApp::CloseCamera()
 
 	camera_manager_.reset();
 
+	frame_source_.reset();
+
 	if (options_->verbose && !options_->help)
 		std::cerr << "Camera closed" << std::endl;
 }
@@ -160,14 +219,14 @@ void LibcameraApp::ConfigureViewfinder()
 	if (have_raw_stream)
 		stream_roles.push_back(StreamRole::Raw), raw_stream_num = stream_num++;
 
-	configuration_ = camera_->generateConfiguration(stream_roles);
+	configuration_ = generateConfiguration(stream_roles);
 	if (!configuration_)
 		throw std::runtime_error("failed to generate viewfinder configuration");
 
 	Size size(1280, 960);
 	if (options_->viewfinder_width && options_->viewfinder_height)
 		size = Size(options_->viewfinder_width, options_->viewfinder_height);
-	else if (camera_->properties().contains(properties::PixelArrayActiveAreas))
+	else if (camera_ && camera_->properties().contains(properties::PixelArrayActiveAreas))
 	{
 		// The idea here is that most sensors will have a 2x2 binned mode that
 		// we can pick up. If it doesn't, well, you can always specify the size
@@ -195,6 +254,8 @@ void LibcameraApp::ConfigureViewfinder()
 	// Now we get to override any of the default settings from the options_->
 	configuration_->at(0).pixelFormat = libcamera::formats::YUV420;
 	configuration_->at(0).size = size;
+	if (options_->buffer_count)
+		configuration_->at(0).bufferCount = options_->buffer_count;
 
 	if (have_lores_stream)
 	{
@@ -241,7 +302,7 @@ void LibcameraApp::ConfigureStill(unsigned int flags)
 	// Always request a raw stream as this forces the full resolution capture mode.
 	// (options_->mode can override the choice of camera mode, however.)
 	StreamRoles stream_roles = { StreamRole::StillCapture, StreamRole::Raw };
-	configuration_ = camera_->generateConfiguration(stream_roles);
+	configuration_ = generateConfiguration(stream_roles);
 	if (!configuration_)
 		throw std::runtime_error("failed to generate still capture configuration");
 
@@ -252,7 +313,9 @@ void LibcameraApp::ConfigureStill(unsigned int flags)
 		configuration_->at(0).pixelFormat = libcamera::formats::RGB888;
 	else
 		configuration_->at(0).pixelFormat = libcamera::formats::YUV420;
-	if ((flags & FLAG_STILL_BUFFER_MASK) == FLAG_STILL_DOUBLE_BUFFER)
+	if (options_->buffer_count)
+		configuration_->at(0).bufferCount = options_->buffer_count;
+	else if ((flags & FLAG_STILL_BUFFER_MASK) == FLAG_STILL_DOUBLE_BUFFER)
 		configuration_->at(0).bufferCount = 2;
 	else if ((flags & FLAG_STILL_BUFFER_MASK) == FLAG_STILL_TRIPLE_BUFFER)
 		configuration_->at(0).bufferCount = 3;
@@ -300,14 +363,14 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 	}
 	if (have_lores_stream)
 		stream_roles.push_back(StreamRole::Viewfinder);
-	configuration_ = camera_->generateConfiguration(stream_roles);
+	configuration_ = generateConfiguration(stream_roles);
 	if (!configuration_)
 		throw std::runtime_error("failed to generate video configuration");
 
 	// Now we get to override any of the default settings from the options_->
 	StreamConfiguration &cfg = configuration_->at(0);
 	cfg.pixelFormat = libcamera::formats::YUV420;
-	cfg.bufferCount = 6; // 6 buffers is better than 4
+	cfg.bufferCount = options_->buffer_count ? options_->buffer_count : 6; // 6 buffers is better than 4
 	if (options_->width)
 		cfg.size.width = options_->width;
 	if (options_->height)
@@ -382,6 +445,9 @@ void LibcameraApp::Teardown()
 	delete allocator_;
 	allocator_ = nullptr;
 
+	if (frame_source_)
+		frame_source_->Teardown();
+
 	configuration_.reset();
 
 	frame_buffers_.clear();
@@ -395,7 +461,9 @@ libcamera::ControlList LibcameraApp::GetControls()
 
 	// Build a list of initial controls that we must set in the camera before starting it.
 	// We don't overwrite anything the application may have set before calling us.
-	if (!controls.contains(controls::ScalerCrop) && options_->roi_width != 0 && options_->roi_height != 0)
+	// (A frame source has no sensor to crop, so it ignores the roi.)
+	if (!controls.contains(controls::ScalerCrop) && options_->roi_width != 0 && options_->roi_height != 0 &&
+		camera_)
 	{
 		Rectangle sensor_area = camera_->properties().get(properties::ScalerCropMaximum);
 		int x = options_->roi_x * sensor_area.width;
@@ -449,27 +517,50 @@ libcamera::ControlList LibcameraApp::GetControls()
 	return controls;
 }
 
-void LibcameraApp::StartCamera()
+void LibcameraApp::StartCamera(int64_t start_time_us)
 {
-	// This makes all the Request objects that we shall need.
-	makeRequests();
+	// This makes all the Request objects that we shall need. A frame source doesn't
+	// use Requests, it just passes the buffers back and forth.
+	if (!frame_source_)
+		makeRequests();
 
 	controls_.merge(GetControls());
 
-	if (camera_->start(&controls_))
+	// Leave only the camera itself to start after the wait, so that it starts as close to the
+	// requested time as we can manage.
+	if (start_time_us)
+	{
+		timespec ts = { (time_t)(start_time_us / 1000000), (long)(start_time_us % 1000000) * 1000 };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+			;
+	}
+
+	if (frame_source_)
+		frame_source_->SetControls(controls_);
+	else if (camera_->start(&controls_))
 		throw std::runtime_error("failed to start camera");
 	controls_.clear();
 	camera_started_ = true;
 	last_timestamp_ = 0;
 
+	// No frames arrive until the requests are queued, so there's still time to start these.
 	post_processor_.Start();
 
-	camera_->requestCompleted.connect(this, &LibcameraApp::requestComplete);
+	if (frame_exporter_)
+		startExporter();
 
-	for (std::unique_ptr<Request> &request : requests_)
+	if (frame_source_)
+		frame_source_->Start(std::bind(&LibcameraApp::frameSourceComplete, this, std::placeholders::_1,
+									   std::placeholders::_2));
+	else
 	{
-		if (camera_->queueRequest(request.get()) < 0)
-			throw std::runtime_error("Failed to queue request");
+		camera_->requestCompleted.connect(this, &LibcameraApp::requestComplete);
+
+		for (std::unique_ptr<Request> &request : requests_)
+		{
+			if (camera_->queueRequest(request.get()) < 0)
+				throw std::runtime_error("Failed to queue request");
+		}
 	}
 
 	if (options_->verbose)
@@ -478,15 +569,27 @@ void LibcameraApp::StartCamera()
 
 void LibcameraApp::StopCamera()
 {
+	// Exported frames must all come back before the camera can stop.
+	if (frame_exporter_)
+		frame_exporter_->Stop();
+
+	// The frame source thread may be the one returning buffers through queueRequest,
+	// so we mustn't hold the stop mutex while we wait for it to finish.
+	if (frame_source_ && camera_started_)
+		frame_source_->Stop();
+
+	// Frames the post-processor never started are released at the end of this function, after
+	// the stop mutex, which their release takes, is dropped.
+	std::vector<CompletedRequestPtr> unstarted;
 	{
 		// We don't want QueueRequest to run asynchronously while we stop the camera.
 		std::lock_guard<std::mutex> lock(camera_stop_mutex_);
 		if (camera_started_)
 		{
-			if (camera_->stop())
+			if (camera_ && camera_->stop())
 				throw std::runtime_error("failed to stop camera");
 
-			post_processor_.Stop();
+			unstarted = post_processor_.Stop();
 
 			camera_started_ = false;
 		}
@@ -514,13 +617,18 @@ LibcameraApp::Msg LibcameraApp::Wait()
 	return msg_queue_.Wait();
 }
 
+std::optional<LibcameraApp::Msg> LibcameraApp::TryWait()
+{
+	return msg_queue_.TryWait();
+}
+
 void LibcameraApp::queueRequest(CompletedRequest *completed_request)
 {
 	BufferMap buffers(std::move(completed_request->buffers));
 
 	Request *request = completed_request->request;
 	delete completed_request;
-	assert(request);
+	assert(request || frame_source_);
 
 	// This function may run asynchronously so needs protection from the
 	// camera stopping at the same time.
@@ -538,6 +646,16 @@ void LibcameraApp::queueRequest(CompletedRequest *completed_request)
 		completed_requests_.erase(it);
 	}
 
+	if (frame_source_)
+	{
+		std::lock_guard<std::mutex> lock(control_mutex_);
+		if (!controls_.empty())
+			frame_source_->SetControls(controls_);
+		controls_.clear();
+		frame_source_->QueueBuffers(buffers);
+		return;
+	}
+
 	for (auto const &p : buffers)
 	{
 		if (request->addBuffer(p.first, p.second) < 0)
@@ -612,9 +730,67 @@ std::vector<libcamera::Span<uint8_t>> LibcameraApp::Mmap(FrameBuffer *buffer) co
 	return item->second;
 }
 
+void LibcameraApp::startExporter()
+{
+	std::vector<FrameExporter::StreamConfig> configs;
+	export_streams_.clear();
+	for (auto const &name : { "main", "lores" })
+	{
+		if (options_->export_streams.find(name) == std::string::npos)
+			continue;
+		StreamInfo info;
+		Stream *stream = name == std::string("main") ? GetMainStream() : LoresStream(&info);
+		if (!stream)
+			throw std::runtime_error(std::string("no ") + name + " stream to export");
+		info = GetStreamInfo(stream);
+		export_streams_.push_back(stream);
+		configs.push_back({ stream, info, Mmap(frame_buffers_[stream].front())[0].size() });
+	}
+	if (configs.empty())
+		throw std::runtime_error("invalid export streams " + options_->export_streams);
+
+	frame_exporter_->Start(configs);
+}
+
+void LibcameraApp::exportFrame(CompletedRequestPtr &completed_request)
+{
+	std::vector<libcamera::Span<uint8_t>> spans;
+	for (Stream *stream : export_streams_)
+	{
+		auto it = completed_request->buffers.find(stream);
+		if (it == completed_request->buffers.end())
+			return;
+		spans.push_back(Mmap(it->second)[0]);
+	}
+	frame_exporter_->Publish(completed_request, spans);
+}
+
 void LibcameraApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stream)
 {
 	std::lock_guard<std::mutex> lock(preview_item_mutex_);
+
+	// Thin the frames out to the --preview-fps rate using their timestamps. Frames we skip
+	// never reach the preview thread, so the caller's reference is all that holds them.
+	if (options_->preview_fps > 0)
+	{
+		uint64_t timestamp = completed_request->metadata.contains(controls::SensorTimestamp)
+								 ? completed_request->metadata.get(controls::SensorTimestamp)
+								 : completed_request->buffers[stream]->metadata().timestamp;
+		// Frames jitter, so take any within half a period of when the next one is due. Otherwise
+		// one that is just early gets skipped, and the rate falls well below what was asked for.
+		uint64_t period = 1e9 / options_->preview_fps;
+		if (timestamp + period / 2 < next_preview_timestamp_)
+		{
+			preview_frames_decimated_++;
+			return;
+		}
+		// Keep to the schedule on average, but after a gap start it again from this frame.
+		if (timestamp > next_preview_timestamp_ + period / 2)
+			next_preview_timestamp_ = timestamp + period;
+		else
+			next_preview_timestamp_ += period;
+	}
+
 	if (!preview_item_.stream)
 		preview_item_ = PreviewItem(completed_request, stream); // copy the shared_ptr here
 	else
@@ -628,6 +804,11 @@ void LibcameraApp::SetControls(ControlList &controls)
 	controls_ = std::move(controls);
 }
 
+bool LibcameraApp::ReloadPostProcessing(std::string const &filename)
+{
+	return post_processor_.Reload(filename);
+}
+
 StreamInfo LibcameraApp::GetStreamInfo(Stream const *stream) const
 {
 	StreamConfiguration const &cfg = stream->configuration();
@@ -650,22 +831,26 @@ void LibcameraApp::setupCapture()
 	else if (validation == CameraConfiguration::Adjusted)
 		std::cerr << "Stream configuration adjusted" << std::endl;
 
-	if (camera_->configure(configuration_.get()) < 0)
+	if (frame_source_)
+		frame_source_->Configure(configuration_.get());
+	else if (camera_->configure(configuration_.get()) < 0)
 		throw std::runtime_error("failed to configure streams");
 	if (options_->verbose)
 		std::cerr << "Camera streams configured" << std::endl;
 
 	// Next allocate all the buffers we need, mmap them and store them on a free list.
 
-	allocator_ = new FrameBufferAllocator(camera_);
+	if (!frame_source_)
+		allocator_ = new FrameBufferAllocator(camera_);
 	for (StreamConfiguration &config : *configuration_)
 	{
 		Stream *stream = config.stream();
 
-		if (allocator_->allocate(stream) < 0)
+		if (allocator_ && allocator_->allocate(stream) < 0)
 			throw std::runtime_error("failed to allocate capture buffers");
 
-		for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(stream))
+		for (const std::unique_ptr<FrameBuffer> &buffer :
+			 allocator_ ? allocator_->buffers(stream) : frame_source_->Buffers(stream))
 		{
 			// "Single plane" buffers appear as multi-plane here, but we can spot them because then
 			// planes all share the same fd. We accumulate them so as to mmap the buffer only once.
@@ -685,14 +870,24 @@ void LibcameraApp::setupCapture()
 			frame_buffers_[stream].push(buffer.get());
 		}
 	}
+	// Every request needs a buffer from each stream, so the main stream decides how many we get.
+	buffer_count_ = frame_buffers_[configuration_->at(0).stream()].size();
+	max_buffers_held_ = 0;
 	if (options_->verbose)
-		std::cerr << "Buffers allocated and mapped" << std::endl;
+		std::cerr << "Buffers allocated and mapped (" << buffer_count_ << " per stream)" << std::endl;
 
 	startPreview();
 
 	// The requests will be made when StartCamera() is called.
 }
 
+std::unique_ptr<libcamera::CameraConfiguration> LibcameraApp::generateConfiguration(StreamRoles const &stream_roles)
+{
+	if (frame_source_)
+		return frame_source_->GenerateConfiguration(stream_roles);
+	return camera_->generateConfiguration(stream_roles);
+}
+
 void LibcameraApp::makeRequests()
 {
 	auto free_buffers(frame_buffers_);
@@ -730,12 +925,25 @@ void LibcameraApp::requestComplete(Request *request)
 	if (request->status() == Request::RequestCancelled)
 		return;
 
-	CompletedRequest *r = new CompletedRequest(sequence_++, request);
+	processRequest(new CompletedRequest(sequence_++, request));
+}
+
+void LibcameraApp::frameSourceComplete(BufferMap &buffers, ControlList &metadata)
+{
+	processRequest(new CompletedRequest(sequence_++, buffers, metadata));
+}
+
+void LibcameraApp::processRequest(CompletedRequest *r)
+{
+	r->camera = options_->camera;
 	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
+	unsigned int held;
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
 		completed_requests_.insert(r);
+		held = completed_requests_.size();
 	}
+	checkBuffersHeld(held);
 
 	// We calculate the instantaneous framerate in case anyone wants it.
 	// Use the sensor timestamp if possible as it ought to be less glitchy than
@@ -743,15 +951,94 @@ void LibcameraApp::requestComplete(Request *request)
 	uint64_t timestamp = payload->metadata.contains(controls::SensorTimestamp)
 							? payload->metadata.get(controls::SensorTimestamp)
 							: payload->buffers.begin()->second->metadata().timestamp;
+	checkDroppedFrames(r, timestamp);
 	if (last_timestamp_ == 0 || last_timestamp_ == timestamp)
 		payload->framerate = 0;
 	else
 		payload->framerate = 1e9 / (timestamp - last_timestamp_);
 	last_timestamp_ = timestamp;
+	LatencyTracer::Get().Record(TracePoint::RequestComplete, options_->camera, timestamp / 1000);
+
+	if (exposure_publisher_)
+		exposure_publisher_->Publish(payload->metadata);
+	else if (exposure_follower_)
+	{
+		std::lock_guard<std::mutex> lock(control_mutex_);
+		exposure_follower_->Update(payload->metadata, controls_);
+	}
 
 	post_processor_.Process(payload); // post-processor can re-use our shared_ptr
 }
 
+void LibcameraApp::checkDroppedFrames(CompletedRequest *completed_request, uint64_t timestamp)
+{
+	// The camera's sequence numbers tell us directly when frames went missing, and when they
+	// run on we believe them. A frame source doesn't supply any, so there only a gap between
+	// timestamps that is much longer than the frame duration gives it away.
+	unsigned int dropped = 0;
+	if (!frame_source_)
+	{
+		unsigned int sequence = completed_request->buffers.begin()->second->metadata().sequence;
+		if (last_timestamp_ && sequence > last_sensor_sequence_ + 1)
+			dropped = sequence - last_sensor_sequence_ - 1;
+		last_sensor_sequence_ = sequence;
+	}
+	else if (last_timestamp_ && completed_request->metadata.contains(controls::FrameDuration))
+	{
+		uint64_t frame_duration = completed_request->metadata.get(controls::FrameDuration) * 1000;
+		if (frame_duration && timestamp - last_timestamp_ > frame_duration * 3 / 2)
+			dropped = (timestamp - last_timestamp_ + frame_duration / 2) / frame_duration - 1;
+	}
+
+	if (dropped)
+	{
+		frames_dropped_ += dropped;
+		if (options_->verbose)
+			std::cerr << "Camera dropped " << dropped << " frame(s) before frame " << completed_request->sequence
+					  << std::endl;
+	}
+}
+
+void LibcameraApp::checkBuffersHeld(unsigned int held)
+{
+	max_buffers_held_ = std::max(max_buffers_held_, held);
+	if (!options_->buffer_report || held + 1 < buffer_count_)
+		return;
+
+	// The camera has at most one buffer left, so it will start dropping frames soon. Say who
+	// is holding on to them, but not more than once a second.
+	auto now = std::chrono::steady_clock::now();
+	if (now - last_buffer_warning_ < std::chrono::seconds(1))
+		return;
+	last_buffer_warning_ = now;
+
+	std::map<std::string, unsigned int> holders;
+	countBufferHolders(holders);
+	auto most = std::max_element(holders.begin(), holders.end(),
+								 [](auto const &a, auto const &b) { return a.second < b.second; });
+	std::cerr << "WARNING: " << held << " of " << buffer_count_ << " buffers are held (";
+	for (auto const &[name, count] : holders)
+		std::cerr << (name == holders.begin()->first ? "" : ", ") << name << " " << count;
+	std::cerr << ")";
+	if (most != holders.end() && most->second)
+		std::cerr << ", most by " << most->first;
+	std::cerr << std::endl;
+}
+
+void LibcameraApp::countBufferHolders(std::map<std::string, unsigned int> &holders)
+{
+	{
+		std::lock_guard<std::mutex> lock(preview_mutex_);
+		holders["preview"] = preview_completed_requests_.size();
+	}
+	{
+		std::lock_guard<std::mutex> lock(preview_item_mutex_);
+		if (preview_item_.stream)
+			holders["preview"]++;
+	}
+	holders["post-processor"] = post_processor_.RequestsHeld();
+}
+
 void LibcameraApp::previewDoneCallback(int fd)
 {
 	std::lock_guard<std::mutex> lock(preview_mutex_);
@@ -812,6 +1099,14 @@ void LibcameraApp::previewThread()
 		frame_info.fps = item.completed_request->framerate;
 		frame_info.sequence = item.completed_request->sequence;
 
+		// The lores stream goes along too, for those previews that can show it.
+		Stream *lores_stream = LoresStream();
+		if (lores_stream && lores_stream != item.stream && item.completed_request->buffers.count(lores_stream))
+		{
+			FrameBuffer *lores_buffer = item.completed_request->buffers[lores_stream];
+			preview_->ShowSecondary(Mmap(lores_buffer)[0], GetStreamInfo(lores_stream));
+		}
+
 		int fd = buffer->planes()[0].fd.get();
 		{
 			std::lock_guard<std::mutex> lock(preview_mutex_);
@@ -9,10 +9,12 @@
 
 #include <sys/mman.h>
 
+#include <chrono>
 #include <condition_variable>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
 #include <string>
@@ -29,6 +31,10 @@
 #include <libcamera/property_ids.h>
 
 #include "core/completed_request.hpp"
+#include "core/event_loop.hpp"
+#include "core/exposure_share.hpp"
+#include "core/frame_exporter.hpp"
+#include "core/frame_source.hpp"
 #include "core/post_processor.hpp"
 #include "core/stream_info.hpp"
 
@@ -100,10 +106,16 @@ public:
 	void ConfigureVideo(unsigned int flags = FLAG_VIDEO_NONE);
 
 	void Teardown();
-	void StartCamera();
+	// Given a (CLOCK_MONOTONIC) time in microseconds, get everything ready and then wait until
+	// then to start the camera.
+	void StartCamera(int64_t start_time_us = 0);
 	void StopCamera();
 
 	Msg Wait();
+	// For event loops: MessageFd() becomes readable when messages are posted, after which
+	// TryWait() returns them until there are none left.
+	int MessageFd() const { return msg_queue_.Fd(); }
+	std::optional<Msg> TryWait();
 	void PostMessage(MsgType &t, MsgPayload &p);
 
 	Stream *GetStream(std::string const &name, StreamInfo *info = nullptr) const;
@@ -119,11 +131,19 @@ public:
 	void ShowPreview(CompletedRequestPtr &completed_request, Stream *stream);
 
 	void SetControls(ControlList &controls);
+	// Swap in a new post-processing configuration without stopping the camera.
+	bool ReloadPostProcessing(std::string const &filename);
 	ControlList GetControls();
 
 	StreamInfo GetStreamInfo(Stream const *stream) const;
+	// How many buffers each stream was given, once it's configured.
+	unsigned int BufferCount() const { return buffer_count_; }
 
 protected:
+	// Fill in how many completed requests each consumer is holding on to (a request can be
+	// held by more than one). Derived classes with consumers of their own should add them.
+	virtual void countBufferHolders(std::map<std::string, unsigned int> &holders);
+
 	std::unique_ptr<Options> options_;
 
 private:
@@ -137,6 +157,7 @@ private:
 			std::unique_lock<std::mutex> lock(mutex_);
 			queue_.push(std::forward<U>(msg));
 			cond_.notify_one();
+			notifier_.Notify();
 		}
 		T Wait()
 		{
@@ -146,6 +167,19 @@ private:
 			queue_.pop();
 			return msg;
 		}
+		std::optional<T> TryWait()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (queue_.empty())
+			{
+				notifier_.Consume(); // Post notifies under the lock, so we can't miss one
+				return std::nullopt;
+			}
+			T msg = std::move(queue_.front());
+			queue_.pop();
+			return msg;
+		}
+		int Fd() const { return notifier_.Fd(); }
 		void Clear()
 		{
 			std::unique_lock<std::mutex> lock(mutex_);
@@ -156,6 +190,7 @@ private:
 		std::queue<T> queue_;
 		std::mutex mutex_;
 		std::condition_variable cond_;
+		EventNotifier notifier_;
 	};
 	struct PreviewItem
 	{
@@ -174,17 +209,28 @@ private:
 
 	void setupCapture();
 	void makeRequests();
+	std::unique_ptr<CameraConfiguration> generateConfiguration(StreamRoles const &stream_roles);
 	void queueRequest(CompletedRequest *completed_request);
 	void requestComplete(Request *request);
+	void frameSourceComplete(BufferMap &buffers, ControlList &metadata);
+	void processRequest(CompletedRequest *completed_request);
+	void checkDroppedFrames(CompletedRequest *completed_request, uint64_t timestamp);
+	void checkBuffersHeld(unsigned int held);
 	void previewDoneCallback(int fd);
 	void startPreview();
 	void stopPreview();
 	void previewThread();
 	void configureDenoise(const std::string &denoise_mode);
+	void startExporter();
+	void exportFrame(CompletedRequestPtr &completed_request);
 
-	std::unique_ptr<CameraManager> camera_manager_;
+	// There can only be one CameraManager in a process, so apps running different cameras
+	// share it.
+	std::shared_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
 	bool camera_acquired_ = false;
+	// Replaces the camera when frames are synthesised or replayed from a file.
+	std::unique_ptr<FrameSource> frame_source_;
 	std::unique_ptr<CameraConfiguration> configuration_;
 	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
 	std::map<std::string, Stream *> streams_;
@@ -193,6 +239,12 @@ private:
 	std::vector<std::unique_ptr<Request>> requests_;
 	std::mutex completed_requests_mutex_;
 	std::set<CompletedRequest *> completed_requests_;
+	// For spotting when the camera runs short of buffers, and drops frames.
+	unsigned int buffer_count_ = 0;
+	unsigned int max_buffers_held_ = 0;
+	std::chrono::steady_clock::time_point last_buffer_warning_;
+	unsigned int last_sensor_sequence_ = 0;
+	uint64_t frames_dropped_ = 0;
 	bool camera_started_ = false;
 	std::mutex camera_stop_mutex_;
 	MessageQueue<Msg> msg_queue_;
@@ -206,6 +258,8 @@ private:
 	bool preview_abort_ = false;
 	uint32_t preview_frames_displayed_ = 0;
 	uint32_t preview_frames_dropped_ = 0;
+	uint32_t preview_frames_decimated_ = 0;
+	uint64_t next_preview_timestamp_ = 0;
 	std::thread preview_thread_;
 	// For setting camera controls.
 	std::mutex control_mutex_;
@@ -214,4 +268,8 @@ private:
 	uint64_t last_timestamp_;
 	uint64_t sequence_ = 0;
 	PostProcessor post_processor_;
+	std::unique_ptr<FrameExporter> frame_exporter_;
+	std::vector<Stream *> export_streams_;
+	std::unique_ptr<ExposurePublisher> exposure_publisher_;
+	std::unique_ptr<ExposureFollower> exposure_follower_;
 };
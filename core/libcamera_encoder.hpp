@@ -5,7 +5,12 @@
  * libcamera_encoder.cpp - libcamera video encoding class.
  */
 
+#include "core/clock_sync.hpp"
+#include "core/drop_policy.hpp"
+#include "core/latency_tracer.hpp"
 #include "core/libcamera_app.hpp"
+#include "core/metadata_writer.hpp"
+#include "core/phase_lock.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
@@ -25,7 +30,22 @@ public:
 	{
 		createEncoder();
 		encoder_->SetInputDoneCallback(std::bind(&LibcameraEncoder::encodeBufferDone, this, std::placeholders::_1));
-		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		encode_policy_ = DropPolicy(GetOptions()->encode_policy);
+		if (encode_policy_.GetMode() == DropPolicy::Mode::DropOldest && !encoder_->SupportsDropOldest())
+		{
+			std::cerr << "WARNING: " << GetOptions()->codec << " encoder can't drop old frames, dropping new ones instead"
+					  << std::endl;
+			encode_policy_ = DropPolicy("drop-newest:" + std::to_string(encode_policy_.Depth()));
+		}
+		if (!GetOptions()->metadata_out.empty())
+			metadata_writer_ = std::make_unique<MetadataWriter>(
+				GetOptions()->metadata_out, GetOptions()->metadata_format == "json", GetOptions()->metadata_values);
+		encoder_->SetOutputReadyCallback([this](void *mem, size_t size, int64_t timestamp_us, bool keyframe) {
+			LatencyTracer::Get().Record(TracePoint::EncoderOutput, GetOptions()->camera, timestamp_us);
+			if (metadata_writer_)
+				metadata_writer_->Encoded(timestamp_us);
+			encode_output_ready_callback_(mem, size, timestamp_us, keyframe);
+		});
 	}
 	// This is callback when the encoder gives you the encoded output data.
 	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
@@ -42,13 +62,143 @@ public:
 								? completed_request->metadata.get(controls::SensorTimestamp)
 								: buffer->metadata().timestamp;
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+			std::unique_lock<std::mutex> lock(encode_buffer_queue_mutex_);
+			if (!encode_policy_.Accept(encode_buffer_queue_.size()))
+				return;
+			encode_space_cond_var_.wait(lock, [this] { return !encode_policy_.MustWait(encode_buffer_queue_.size()); });
 			encode_buffer_queue_.push(completed_request); // creates a new reference
 		}
+		if (metadata_writer_)
+			metadata_writer_->Add(completed_request, timestamp_ns / 1000);
+		LatencyTracer::Get().Record(TracePoint::EncoderInput, GetOptions()->camera, timestamp_ns / 1000);
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, completed_request->metadata, timestamp_ns / 1000);
 	}
+	// Change the encoding while it runs. These return false if the encoder can't.
+	bool RequestKeyframe() { return encoder_ && encoder_->RequestKeyframe(); }
+	bool SetBitrate(uint32_t bitrate) { return encoder_ && encoder_->SetBitrate(bitrate); }
+	// This changes the camera's frame rate as well as telling the encoder.
+	bool SetFramerate(float framerate)
+	{
+		int64_t frame_duration = 1000000 / framerate;
+		ControlList controls;
+		controls.set(controls::FrameDurationLimits, { frame_duration, frame_duration });
+		SetControls(controls);
+		return encoder_ && encoder_->SetFramerate(framerate);
+	}
+	// A second encoder, for the lores stream, with a queue of its own. When that queue is full
+	// new frames are dropped, so the lores encoder never holds up the main one, nor the other
+	// way round.
+	void StartLoresEncoder(VideoOptions const *options, EncodeOutputReadyCallback callback)
+	{
+		StreamInfo info;
+		if (!LoresStream(&info))
+			throw std::runtime_error("no lores stream to encode");
+		lores_encoder_ = std::unique_ptr<Encoder>(Encoder::Create(options, info));
+		lores_encoder_->SetInputDoneCallback([this](void *) {
+			std::lock_guard<std::mutex> lock(lores_queue_mutex_);
+			if (lores_queue_.empty())
+				throw std::runtime_error("no lores buffer available to return");
+			lores_queue_.pop();
+		});
+		lores_encoder_->SetOutputReadyCallback(callback);
+		lores_policy_ = DropPolicy("drop-newest:2");
+	}
+	void EncodeLoresBuffer(CompletedRequestPtr &completed_request)
+	{
+		assert(lores_encoder_);
+		Stream *stream = LoresStream();
+		StreamInfo info = GetStreamInfo(stream);
+		FrameBuffer *buffer = completed_request->buffers[stream];
+		libcamera::Span span = Mmap(buffer)[0];
+		int64_t timestamp_ns = completed_request->metadata.contains(controls::SensorTimestamp)
+								   ? completed_request->metadata.get(controls::SensorTimestamp)
+								   : buffer->metadata().timestamp;
+		{
+			std::lock_guard<std::mutex> lock(lores_queue_mutex_);
+			if (!lores_policy_.Accept(lores_queue_.size()))
+				return;
+			lores_queue_.push(completed_request);
+		}
+		lores_encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), span.data(), info,
+									 completed_request->metadata, timestamp_ns / 1000);
+	}
+	void StopLoresEncoder()
+	{
+		if (!lores_encoder_)
+			return;
+		lores_encoder_.reset();
+		{
+			std::lock_guard<std::mutex> lock(lores_queue_mutex_);
+			lores_queue_ = {};
+		}
+		if (lores_policy_.Dropped())
+			std::cerr << "Lores encoder dropped " << lores_policy_.Dropped() << " frames" << std::endl;
+	}
+	// With --start-delay (on the clock server) or --wait-start (on its followers), returns the
+	// rig-global time at which every node should start its camera, otherwise 0.
+	int64_t ScheduledStart()
+	{
+		VideoOptions const *options = GetOptions();
+		if (options->start_delay)
+			ClockSync::Get().SetStart(ClockSync::Now() + options->start_delay * INT64_C(1000));
+		else if (!options->wait_start)
+			return 0;
+		int64_t start_us = ClockSync::Get().WaitStart(options->wait_start_timeout);
+		if (!start_us)
+			throw std::runtime_error("no start time from the clock server within " +
+									 std::to_string(options->wait_start_timeout) + "ms, does it have --start-delay?");
+		return start_us;
+	}
+	// Start the camera at this rig-global time, or straight away for 0.
+	void StartCameraAt(int64_t start_us)
+	{
+		start_us_ = start_us;
+		phase_lock_.reset();
+		StartCamera(start_us ? ClockSync::Get().ToLocal(start_us) : 0);
+	}
+	// After a scheduled start, report the phase of the first frame and keep the rest in phase,
+	// if --phase-lock asks for it.
+	void TrackPhase(CompletedRequestPtr &completed_request)
+	{
+		ControlList const &metadata = completed_request->metadata;
+		if (!start_us_ || !metadata.contains(controls::SensorTimestamp))
+			return;
+		int64_t global_us = ClockSync::Get().ToGlobal(metadata.get(controls::SensorTimestamp) / 1000);
+		if (!phase_lock_)
+		{
+			int64_t period_us = 0;
+			if (metadata.contains(controls::FrameDuration))
+				period_us = metadata.get(controls::FrameDuration);
+			else if (GetOptions()->framerate > 0)
+				period_us = 1000000 / GetOptions()->framerate;
+			if (period_us <= 0)
+			{
+				start_us_ = 0; // can't tell the phase without the frame period
+				return;
+			}
+			phase_lock_ = std::make_unique<PhaseLock>(start_us_, period_us, GetOptions()->phase_lock);
+			std::cerr << "First frame " << global_us - start_us_ << "us after the scheduled start, phase "
+					  << phase_lock_->Phase(global_us) << "us" << std::endl;
+		}
+		else if (GetOptions()->verbose && phase_lock_->Locking())
+			std::cerr << "Frame phase " << phase_lock_->Phase(global_us) << "us" << std::endl;
+
+		if (auto duration = phase_lock_->Update(global_us))
+		{
+			ControlList controls;
+			controls.set(controls::FrameDurationLimits, { *duration, *duration });
+			SetControls(controls);
+		}
+	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(options_.get()); }
-	void StopEncoder() { encoder_.reset(); }
+	void StopEncoder()
+	{
+		encoder_.reset();
+		metadata_writer_.reset();
+		if (encode_policy_.Dropped())
+			std::cerr << "Encoder dropped " << encode_policy_.Dropped() << " frames (policy " << encode_policy_.Spec()
+					  << ")" << std::endl;
+	}
 
 protected:
 	virtual void createEncoder()
@@ -59,6 +209,17 @@ protected:
 			throw std::runtime_error("video steam is not configured");
 		encoder_ = std::unique_ptr<Encoder>(Encoder::Create(GetOptions(), info));
 	}
+	void countBufferHolders(std::map<std::string, unsigned int> &holders) override
+	{
+		LibcameraApp::countBufferHolders(holders);
+		{
+			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+			holders["encoder"] = encode_buffer_queue_.size();
+		}
+		std::lock_guard<std::mutex> lock(lores_queue_mutex_);
+		if (!lores_queue_.empty())
+			holders["lores encoder"] = lores_queue_.size();
+	}
 	std::unique_ptr<Encoder> encoder_;
 
 private:
@@ -74,10 +235,21 @@ private:
 			if (encode_buffer_queue_.empty())
 				throw std::runtime_error("no buffer available to return");
 			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			encode_space_cond_var_.notify_one();
 		}
 	}
 
 	std::queue<CompletedRequestPtr> encode_buffer_queue_;
 	std::mutex encode_buffer_queue_mutex_;
+	// Applied to encode_buffer_queue_ when the encoder can't keep up.
+	DropPolicy encode_policy_;
+	std::condition_variable encode_space_cond_var_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
+	std::unique_ptr<MetadataWriter> metadata_writer_;
+	int64_t start_us_ = 0;
+	std::unique_ptr<PhaseLock> phase_lock_;
+	std::unique_ptr<Encoder> lores_encoder_;
+	std::queue<CompletedRequestPtr> lores_queue_;
+	std::mutex lores_queue_mutex_;
+	DropPolicy lores_policy_;
 };
@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * metadata_writer.cpp - write per-frame metadata to a sidecar file.
+ */
+
+#include <cinttypes>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <libcamera/control_ids.h>
+
+#include "core/metadata_writer.hpp"
+
+using namespace libcamera;
+
+MetadataWriter::MetadataWriter(std::string const &filename, bool json, std::string const &value_names)
+	: json_(json)
+{
+	std::stringstream ss(value_names);
+	for (std::string name; std::getline(ss, name, ',');)
+	{
+		if (name.empty())
+			continue;
+		if (name.size() >= MetadataFileHeader::NAME_LENGTH)
+			throw std::runtime_error("metadata value name " + name + " is too long");
+		value_names_.push_back(name);
+	}
+	if (value_names_.size() > MetadataFileHeader::MAX_VALUES)
+		throw std::runtime_error("at most " + std::to_string(MetadataFileHeader::MAX_VALUES) +
+								 " metadata values can be recorded");
+
+	fp_ = fopen(filename.c_str(), json ? "w" : "wb");
+	if (!fp_)
+		throw std::runtime_error("failed to open metadata file " + filename);
+	// Only the writer thread touches the file, so let it gather up plenty before writing.
+	setvbuf(fp_, nullptr, _IOFBF, 1 << 16);
+
+	if (!json_)
+	{
+		MetadataFileHeader header = {};
+		header.magic = MetadataFileHeader::MAGIC;
+		header.version = MetadataFileHeader::VERSION;
+		header.record_size = sizeof(MetadataRecord);
+		header.num_values = value_names_.size();
+		for (unsigned int i = 0; i < value_names_.size(); i++)
+			strcpy(header.value_names[i], value_names_[i].c_str());
+		fwrite(&header, sizeof(header), 1, fp_);
+	}
+
+	thread_ = std::thread(&MetadataWriter::writerThread, this);
+}
+
+MetadataWriter::~MetadataWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_one();
+	thread_.join();
+	fclose(fp_);
+}
+
+// Post-processing stages store whatever type they like, so try the ones that make sense
+// as a number.
+static double get_value(Metadata &metadata, std::string const &name)
+{
+	std::lock_guard<Metadata> lock(metadata);
+	if (auto value = metadata.GetLocked<bool>(name))
+		return *value;
+	if (auto value = metadata.GetLocked<int>(name))
+		return *value;
+	if (auto value = metadata.GetLocked<unsigned int>(name))
+		return *value;
+	if (auto value = metadata.GetLocked<int64_t>(name))
+		return *value;
+	if (auto value = metadata.GetLocked<float>(name))
+		return *value;
+	if (auto value = metadata.GetLocked<double>(name))
+		return *value;
+	return std::numeric_limits<double>::quiet_NaN();
+}
+
+void MetadataWriter::Add(CompletedRequestPtr const &completed_request, int64_t timestamp_us)
+{
+	ControlList const &metadata = completed_request->metadata;
+	MetadataRecord record = {};
+	record.sequence = completed_request->sequence;
+	if (metadata.contains(controls::SensorTimestamp))
+		record.timestamp_ns = metadata.get(controls::SensorTimestamp);
+	if (metadata.contains(controls::ExposureTime))
+		record.exposure_time = metadata.get(controls::ExposureTime);
+	if (metadata.contains(controls::ColourTemperature))
+		record.colour_temperature = metadata.get(controls::ColourTemperature);
+	if (metadata.contains(controls::AnalogueGain))
+		record.analogue_gain = metadata.get(controls::AnalogueGain);
+	if (metadata.contains(controls::DigitalGain))
+		record.digital_gain = metadata.get(controls::DigitalGain);
+	if (metadata.contains(controls::ColourGains))
+	{
+		Span<const float> gains = metadata.get(controls::ColourGains);
+		record.colour_gains[0] = gains[0], record.colour_gains[1] = gains[1];
+	}
+	if (metadata.contains(controls::Lux))
+		record.lux = metadata.get(controls::Lux);
+	if (metadata.contains(controls::FocusFoM))
+		record.focus = metadata.get(controls::FocusFoM);
+	for (unsigned int i = 0; i < value_names_.size(); i++)
+		record.values[i] = get_value(completed_request->post_process_metadata, value_names_[i]);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	pending_.emplace_back(timestamp_us, record);
+}
+
+void MetadataWriter::Encoded(int64_t timestamp_us)
+{
+	// The encoders all output frames in the order they were given them.
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		while (!pending_.empty() && pending_.front().first < timestamp_us)
+			pending_.pop_front();
+		if (pending_.empty() || pending_.front().first != timestamp_us)
+			return;
+		queue_.push_back(pending_.front().second);
+		pending_.pop_front();
+	}
+	cond_var_.notify_one();
+}
+
+void MetadataWriter::writerThread()
+{
+	std::vector<MetadataRecord> records;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			if (queue_.empty())
+				break; // only once we've been told to stop, and everything is written
+			records.swap(queue_);
+		}
+		for (MetadataRecord const &record : records)
+		{
+			if (json_)
+				writeJson(record);
+			else
+				fwrite(&record, sizeof(record), 1, fp_);
+		}
+		records.clear();
+	}
+	fflush(fp_);
+}
+
+void MetadataWriter::writeJson(MetadataRecord const &record)
+{
+	fprintf(fp_,
+			"{\"sequence\": %" PRIu64 ", \"timestamp_ns\": %" PRId64 ", \"exposure_time\": %" PRId32
+			", \"analogue_gain\": %g, \"digital_gain\": %g, \"colour_gains\": [%g, %g], "
+			"\"colour_temperature\": %" PRIu32 ", \"lux\": %g, \"focus\": %g",
+			record.sequence, record.timestamp_ns, record.exposure_time, record.analogue_gain, record.digital_gain,
+			record.colour_gains[0], record.colour_gains[1], record.colour_temperature, record.lux, record.focus);
+	for (unsigned int i = 0; i < value_names_.size(); i++)
+	{
+		// JSON has no NaN.
+		if (std::isnan(record.values[i]))
+			fprintf(fp_, ", \"%s\": null", value_names_[i].c_str());
+		else
+			fprintf(fp_, ", \"%s\": %.17g", value_names_[i].c_str(), record.values[i]);
+	}
+	fprintf(fp_, "}\n");
+}
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * metadata_writer.hpp - write per-frame metadata to a sidecar file.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/completed_request.hpp"
+
+// One fixed-size record is written for every frame the encoder outputs, so that the
+// exposure and gains of each frame can be recovered without parsing any text. Records
+// are queued by the caller and written by a thread of our own, so a slow disk never
+// holds up the camera.
+//
+// A binary file starts with a MetadataFileHeader, naming the post-processing metadata
+// values that were asked for, followed by one MetadataRecord per frame, all little
+// endian. In JSON mode each record is instead a line of JSON. utils/metadata_read.py
+// reads either.
+
+struct MetadataFileHeader
+{
+	static constexpr uint32_t MAGIC = 0x6372646d; // "mdrc"
+	static constexpr uint32_t VERSION = 1;
+	static constexpr unsigned int MAX_VALUES = 8;
+	static constexpr unsigned int NAME_LENGTH = 32;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t num_values;
+	char value_names[MAX_VALUES][NAME_LENGTH];
+};
+
+struct MetadataRecord
+{
+	uint64_t sequence;
+	int64_t timestamp_ns; // sensor timestamp
+	int32_t exposure_time; // microseconds
+	uint32_t colour_temperature;
+	float analogue_gain;
+	float digital_gain;
+	float colour_gains[2];
+	float lux;
+	float focus;
+	// The post-processing metadata values, NaN where a frame doesn't have one.
+	double values[MetadataFileHeader::MAX_VALUES];
+};
+
+class MetadataWriter
+{
+public:
+	// value_names is a comma-separated list of post-processing metadata tags, whose values
+	// must be numbers or bools.
+	MetadataWriter(std::string const &filename, bool json, std::string const &value_names);
+	~MetadataWriter();
+
+	// Make the record for a frame as it goes to the encoder. It is written only once the
+	// encoder outputs the frame (see Encoded), because the encoder may drop it instead.
+	void Add(CompletedRequestPtr const &completed_request, int64_t timestamp_us);
+	// The encoder has output the frame with this timestamp. Any earlier frames it never
+	// output were dropped, and their records are discarded.
+	void Encoded(int64_t timestamp_us);
+
+private:
+	void writerThread();
+	void writeJson(MetadataRecord const &record);
+
+	FILE *fp_;
+	bool json_;
+	std::vector<std::string> value_names_;
+	// Records of the frames the encoder has yet to output, oldest first, by timestamp.
+	std::deque<std::pair<int64_t, MetadataRecord>> pending_;
+	std::vector<MetadataRecord> queue_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	bool abort_ = false;
+	std::thread thread_;
+};
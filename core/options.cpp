@@ -183,6 +183,15 @@ bool Options::Parse(int argc, char *argv[])
 	if (sscanf(awbgains.c_str(), "%f,%f", &awb_gain_r, &awb_gain_b) != 2)
 		throw std::runtime_error("Invalid AWB gains");
 
+	if (!exposure_publish.empty() && !exposure_follow.empty())
+		throw std::runtime_error("a camera can't both publish its exposure and follow another's");
+	if (sync_serve && !sync_with.empty())
+		throw std::runtime_error("a node can't both serve the rig clock and follow another");
+	if (sync_serve > 65535)
+		throw std::runtime_error("--sync-serve port must be between 1 and 65535");
+	if (!sync_interval)
+		throw std::runtime_error("--sync-interval must be greater than 0");
+
 	brightness = std::clamp(brightness, -1.0f, 1.0f);
 	contrast = std::clamp(contrast, 0.0f, 15.99f); // limits are arbitrary..
 	saturation = std::clamp(saturation, 0.0f, 15.99f); // limits are arbitrary..
@@ -199,10 +208,54 @@ bool Options::Parse(int argc, char *argv[])
 	return true;
 }
 
+void Options::CopyRuntimeSettings(Options const &other)
+{
+	// These are the ones that GetControls reads, and the post-processing file.
+	roi = other.roi;
+	roi_x = other.roi_x, roi_y = other.roi_y, roi_width = other.roi_width, roi_height = other.roi_height;
+	shutter = other.shutter;
+	gain = other.gain;
+	metering = other.metering;
+	metering_index = other.metering_index;
+	exposure = other.exposure;
+	exposure_index = other.exposure_index;
+	ev = other.ev;
+	awb = other.awb;
+	awb_index = other.awb_index;
+	awbgains = other.awbgains;
+	awb_gain_r = other.awb_gain_r;
+	awb_gain_b = other.awb_gain_b;
+	brightness = other.brightness;
+	contrast = other.contrast;
+	saturation = other.saturation;
+	sharpness = other.sharpness;
+	framerate = other.framerate;
+	post_process_file = other.post_process_file;
+}
+
 void Options::Print() const
 {
 	std::cerr << "Options:" << std::endl;
 	std::cerr << "    verbose: " << verbose << std::endl;
+	if (frame_source != "camera")
+		std::cerr << "    frame-source: " << frame_source << std::endl;
+	if (buffer_count)
+		std::cerr << "    buffer-count: " << buffer_count << std::endl;
+	if (buffer_report)
+		std::cerr << "    buffer-report: " << buffer_report << std::endl;
+	if (!export_path.empty())
+		std::cerr << "    export: " << export_path << " mode " << export_mode << " streams " << export_streams
+				  << " depth " << export_depth << std::endl;
+	if (trace_latency)
+		std::cerr << "    trace-latency: interval " << trace_interval << "s" << std::endl;
+	if (!exposure_publish.empty())
+		std::cerr << "    exposure-publish: " << exposure_publish << std::endl;
+	if (!exposure_follow.empty())
+		std::cerr << "    exposure-follow: " << exposure_follow << " latency " << exposure_latency << std::endl;
+	if (sync_serve)
+		std::cerr << "    sync-serve: " << sync_serve << std::endl;
+	if (!sync_with.empty())
+		std::cerr << "    sync-with: " << sync_with << " interval " << sync_interval << "ms" << std::endl;
 	if (!config_file.empty())
 		std::cerr << "    config file: " << config_file << std::endl;
 	std::cerr << "    info_text:" << info_text << std::endl;
@@ -211,6 +264,7 @@ void Options::Print() const
 	std::cerr << "    height: " << height << std::endl;
 	std::cerr << "    output: " << output << std::endl;
 	std::cerr << "    post_process_file: " << post_process_file << std::endl;
+	std::cerr << "    post_process_policy: " << post_process_policy << std::endl;
 	std::cerr << "    rawfull: " << rawfull << std::endl;
 	if (nopreview)
 		std::cerr << "    preview: none" << std::endl;
@@ -222,6 +276,11 @@ void Options::Print() const
 		std::cerr << "    preview: " << preview_x << "," << preview_y << "," << preview_width << ","
 					<< preview_height << std::endl;
 	std::cerr << "    qt-preview: " << qt_preview << std::endl;
+	if (!composite.empty())
+		std::cerr << "    composite: " << composite << " tiles " << composite_tiles << " tile " << composite_tile
+				  << " shm " << composite_shm << " fps " << composite_fps << std::endl;
+	if (preview_fps)
+		std::cerr << "    preview-fps: " << preview_fps << std::endl;
 	std::cerr << "    transform: " << transformToString(transform) << std::endl;
 	if (roi_width == 0 || roi_height == 0)
 		std::cerr << "    roi: all" << std::endl;
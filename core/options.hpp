@@ -48,6 +48,41 @@ struct Options
 			 "Lists the available cameras attached to the system.")
 			("camera", value<unsigned int>(&camera)->default_value(0),
 			 "Chooses the camera to use. To list the available indexes, use the --list-cameras option.")
+			("frame-source", value<std::string>(&frame_source)->default_value("camera"),
+			 "Where frames come from: camera, synthetic[:bars|noise], yuv:<file> or raw:<file> (files are replayed "
+			 "in a loop and must match the stream format). Use --framerate 0 to run as fast as possible.")
+			("buffer-count", value<unsigned int>(&buffer_count)->default_value(0),
+			 "Number of buffers to allocate for each stream (0 for the default, which depends on the use case)")
+			("buffer-report", value<bool>(&buffer_report)->default_value(false)->implicit_value(true),
+			 "Warn when the camera is running out of buffers, naming what is holding on to them, and report the "
+			 "most buffers that were ever held at the end")
+			("export", value<std::string>(&export_path),
+			 "Publish frames to other processes through a Unix socket with this path")
+			("export-mode", value<std::string>(&export_mode)->default_value("dmabuf"),
+			 "How exported frames are shared: dmabuf (the camera buffers themselves) or memfd (a copy in a ring "
+			 "of shared memory slots)")
+			("export-streams", value<std::string>(&export_streams)->default_value("main"),
+			 "Streams to export: main, lores or main,lores")
+			("export-depth", value<unsigned int>(&export_depth)->default_value(2),
+			 "Most frames any one consumer may hold before it is sent no more")
+			("trace-latency", value<bool>(&trace_latency)->default_value(false)->implicit_value(true),
+			 "Trace how long each frame spends in each stage from capture to output, and print a histogram at the end")
+			("trace-interval", value<unsigned int>(&trace_interval)->default_value(0),
+			 "With --trace-latency, also print a summary every this many seconds (0 for none)")
+			("exposure-publish", value<std::string>(&exposure_publish),
+			 "Publish each frame's exposure and colour gains on a Unix socket with this path, for other cameras "
+			 "to follow")
+			("exposure-follow", value<std::string>(&exposure_follow),
+			 "Copy the exposure and colour gains published on the Unix socket with this path, instead of running "
+			 "our own AE/AWB")
+			("exposure-latency", value<unsigned int>(&exposure_latency)->default_value(2),
+			 "With --exposure-follow, the number of frames before the camera applies new controls")
+			("sync-serve", value<unsigned int>(&sync_serve)->default_value(0),
+			 "Serve this node's clock to the rest of the rig on this UDP port, making it the rig-global clock")
+			("sync-with", value<std::string>(&sync_with),
+			 "Follow the clock served at host:port, so that timestamps can be given in rig-global time")
+			("sync-interval", value<unsigned int>(&sync_interval)->default_value(1000),
+			 "With --sync-with, measure the clock offset every this many milliseconds")
 			("verbose,v", value<bool>(&verbose)->default_value(false)->implicit_value(true),
 			 "Output extra debug and diagnostics")
 			("config,c", value<std::string>(&config_file)->implicit_value("config.txt"),
@@ -69,6 +104,9 @@ struct Options
 			 "Set the output file name")
 			("post-process-file", value<std::string>(&post_process_file),
 			 "Set the file name for configuring the post-processing")
+			("post-process-policy", value<std::string>(&post_process_policy)->default_value("block"),
+			 "What to do with frames when post-processing can't keep up: block[:depth], drop-oldest[:depth], "
+			 "drop-newest[:depth] or every:N (keep only every Nth frame)")
 			("rawfull", value<bool>(&rawfull)->default_value(false)->implicit_value(true),
 			 "Force use of full resolution raw frames")
 			("nopreview,n", value<bool>(&nopreview)->default_value(false)->implicit_value(true),
@@ -79,6 +117,20 @@ struct Options
 			 "Use a fullscreen preview window")
 			("qt-preview", value<bool>(&qt_preview)->default_value(false)->implicit_value(true),
 			 "Use Qt-based preview window (WARNING: causes heavy CPU load, fullscreen not supported)")
+			("composite", value<std::string>(&composite),
+			 "Tile the preview stream (and any lores stream) into a canvas of the preview size, which is shown "
+			 "with drm, written to file:<name>, or only shared with other processes (shm)")
+			("composite-tiles", value<unsigned int>(&composite_tiles)->default_value(0),
+			 "Number of tiles in the composite canvas (0 for just enough for our own streams)")
+			("composite-tile", value<unsigned int>(&composite_tile)->default_value(0),
+			 "Canvas tile for the preview stream, the lores stream taking the next one")
+			("composite-shm", value<std::string>(&composite_shm),
+			 "Share the composite canvas with other processes through this shared memory name (they must all "
+			 "give the same --composite-tiles)")
+			("composite-fps", value<float>(&composite_fps)->default_value(10),
+			 "Rate at which the composite canvas is shown or written out")
+			("preview-fps", value<float>(&preview_fps)->default_value(0),
+			 "Show at most this many frames per second in the preview window (0 for every frame)")
 			("hflip", value<bool>(&hflip_)->default_value(false)->implicit_value(true), "Request a horizontal flip transform")
 			("vflip", value<bool>(&vflip_)->default_value(false)->implicit_value(true), "Request a vertical flip transform")
 			("rotation", value<int>(&rotation_)->default_value(0), "Request an image rotation, 0 or 180")
@@ -143,6 +195,7 @@ struct Options
 	std::string config_file;
 	std::string output;
 	std::string post_process_file;
+	std::string post_process_policy;
 	unsigned int width;
 	unsigned int height;
 	bool rawfull;
@@ -178,9 +231,30 @@ struct Options
 	unsigned int viewfinder_height;
 	std::string tuning_file;
 	bool qt_preview;
+	float preview_fps;
+	std::string composite;
+	unsigned int composite_tiles;
+	unsigned int composite_tile;
+	std::string composite_shm;
+	float composite_fps;
 	unsigned int lores_width;
 	unsigned int lores_height;
 	unsigned int camera;
+	std::string frame_source;
+	unsigned int buffer_count;
+	bool buffer_report;
+	std::string export_path;
+	std::string export_mode;
+	std::string export_streams;
+	unsigned int export_depth;
+	bool trace_latency;
+	unsigned int trace_interval;
+	std::string exposure_publish;
+	std::string exposure_follow;
+	unsigned int exposure_latency;
+	unsigned int sync_serve;
+	std::string sync_with;
+	unsigned int sync_interval;
 	std::string mode_string;
 	Mode mode;
 	std::string viewfinder_mode_string;
@@ -188,6 +262,8 @@ struct Options
 
 	virtual bool Parse(int argc, char *argv[]);
 	virtual void Print() const;
+	// Take just the settings that may change while the camera runs from a fresh set of options.
+	void CopyRuntimeSettings(Options const &other);
 
 protected:
 	boost::program_options::options_description options_;
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * phase_lock.hpp - pull a sensor's frames into phase with the rig's start time.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+
+// When every node in a rig starts its camera at the same scheduled time, their frames should
+// all lie on the same grid of start + n * period in rig-global time. Starting the sensors
+// isn't that precise, so for the first few frames we measure how far off the grid each one
+// is, and ask for a single frame of a different length to shift the rest back onto it.
+// Controls take a few frames to act, so after each nudge we wait for it to show before
+// measuring again.
+
+class PhaseLock
+{
+public:
+	PhaseLock(int64_t start_us, int64_t period_us, unsigned int frames)
+		: start_us_(start_us), period_us_(period_us), frames_(frames)
+	{
+	}
+
+	// How far the frame is from the nearest point on the grid, in [-period/2, period/2).
+	int64_t Phase(int64_t global_us) const
+	{
+		int64_t phase = (global_us - start_us_) % period_us_;
+		if (phase < 0)
+			phase += period_us_;
+		return phase >= period_us_ / 2 ? phase - period_us_ : phase;
+	}
+
+	// Whether we're still nudging, or waiting to see the effect of the last nudge.
+	bool Locking() const { return count_ <= frames_ || nudging_ || settle_; }
+
+	// Given each frame's rig-global timestamp, returns a new frame duration to ask for, if
+	// it should change.
+	std::optional<int64_t> Update(int64_t global_us)
+	{
+		count_++;
+		if (nudging_)
+		{
+			nudging_ = false;
+			settle_ = SETTLE_FRAMES;
+			return period_us_;
+		}
+		if (settle_)
+		{
+			settle_--;
+			return {};
+		}
+		if (count_ > frames_)
+			return {};
+
+		int64_t phase = Phase(global_us);
+		if (std::abs(phase) <= TOLERANCE_US)
+			return {};
+		// A frame this much shorter puts all the following ones back on the grid, though we
+		// won't ask the sensor to change its frame length by more than a quarter at a time.
+		nudging_ = true;
+		return period_us_ - std::clamp(phase, -period_us_ / 4, period_us_ / 4);
+	}
+
+private:
+	static constexpr int64_t TOLERANCE_US = 50;
+	static constexpr unsigned int SETTLE_FRAMES = 4;
+	int64_t start_us_;
+	int64_t period_us_;
+	unsigned int frames_;
+	unsigned int count_ = 0;
+	unsigned int settle_ = 0;
+	bool nudging_ = false;
+};
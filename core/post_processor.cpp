@@ -5,9 +5,12 @@
  * post_processor.cpp - Post processor implementation.
  */
 
+#include <cstring>
 #include <iostream>
 
+#include "core/latency_tracer.hpp"
 #include "core/libcamera_app.hpp"
+#include "core/options.hpp"
 #include "core/post_processor.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -15,7 +18,7 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
-PostProcessor::PostProcessor(LibcameraApp *app) : app_(app)
+PostProcessor::PostProcessor(LibcameraApp *app) : app_(app), chain_(std::make_shared<StageChain>())
 {
 }
 
@@ -23,8 +26,25 @@ PostProcessor::~PostProcessor()
 {
 }
 
+PostProcessor::StageChain::~StageChain()
+{
+	if (!retired)
+		return;
+	for (auto &stage : stages)
+	{
+		stage->Stop();
+		stage->Teardown();
+	}
+}
+
 void PostProcessor::Read(std::string const &filename)
 {
+	chain_->stages = readStages(filename);
+}
+
+std::vector<StagePtr> PostProcessor::readStages(std::string const &filename)
+{
+	std::vector<StagePtr> stages;
 	boost::property_tree::ptree root;
 	boost::property_tree::read_json(filename, root);
 	for (auto const &key_and_value : root)
@@ -33,12 +53,79 @@ void PostProcessor::Read(std::string const &filename)
 		if (stage)
 		{
 			std::cerr << "Reading post processing stage \"" << key_and_value.first << "\"" << std::endl;
+			stages.push_back(StagePtr(stage));
 			stage->Read(key_and_value.second);
-			stages_.push_back(StagePtr(stage));
 		}
 		else
 			std::cerr << "No post processing stage found for \"" << key_and_value.first << "\"" << std::endl;
 	}
+	return stages;
+}
+
+bool PostProcessor::Reload(std::string const &filename)
+{
+	if (!running_)
+	{
+		std::cerr << "Post-processing can only be reloaded while the camera is running" << std::endl;
+		return false;
+	}
+
+	std::shared_ptr<StageChain> old_chain = currentChain();
+	auto new_chain = std::make_shared<StageChain>();
+	unsigned int configured = 0, started = 0;
+	try
+	{
+		if (!filename.empty())
+			new_chain->stages = readStages(filename);
+		// Pair stages up by name, in order, so a stage listed twice inherits from its namesake.
+		// Each old stage is paired at most once.
+		std::vector<bool> paired(old_chain->stages.size(), false);
+		for (auto &stage : new_chain->stages)
+		{
+			stage->Configure();
+			configured++;
+			for (unsigned int i = 0; i < old_chain->stages.size(); i++)
+			{
+				if (!paired[i] && old_chain->stages[i] && !strcmp(old_chain->stages[i]->Name(), stage->Name()))
+				{
+					stage->Inherit(*old_chain->stages[i]);
+					paired[i] = true;
+					break;
+				}
+			}
+		}
+		for (auto &stage : new_chain->stages)
+		{
+			stage->Start();
+			started++;
+		}
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "Failed to reload post-processing from \"" << filename << "\": " << e.what()
+				  << ", keeping the current configuration" << std::endl;
+		// Undo whatever the new stages got as far as doing.
+		for (unsigned int i = 0; i < started; i++)
+			new_chain->stages[i]->Stop();
+		for (unsigned int i = 0; i < configured; i++)
+			new_chain->stages[i]->Teardown();
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		chain_ = new_chain;
+		old_chain->retired = true;
+	}
+
+	std::cerr << "Reloaded post-processing with " << new_chain->stages.size() << " stages" << std::endl;
+	return true;
+}
+
+std::shared_ptr<PostProcessor::StageChain> PostProcessor::currentChain()
+{
+	std::lock_guard<std::mutex> l(mutex_);
+	return chain_;
 }
 
 PostProcessingStage *PostProcessor::createPostProcessingStage(char const *name)
@@ -54,7 +141,7 @@ void PostProcessor::SetCallback(PostProcessorCallback callback)
 
 void PostProcessor::AdjustConfig(std::string const &use_case, StreamConfiguration *config)
 {
-	for (auto &stage : stages_)
+	for (auto &stage : chain_->stages)
 	{
 		stage->AdjustConfig(use_case, config);
 	}
@@ -62,7 +149,7 @@ void PostProcessor::AdjustConfig(std::string const &use_case, StreamConfiguratio
 
 void PostProcessor::Configure()
 {
-	for (auto &stage : stages_)
+	for (auto &stage : chain_->stages)
 	{
 		stage->Configure();
 	}
@@ -71,9 +158,11 @@ void PostProcessor::Configure()
 void PostProcessor::Start()
 {
 	quit_ = false;
+	policy_ = DropPolicy(app_->GetOptions()->post_process_policy);
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
+	running_ = true;
 
-	for (auto &stage : stages_)
+	for (auto &stage : chain_->stages)
 	{
 		stage->Start();
 	}
@@ -81,34 +170,68 @@ void PostProcessor::Start()
 
 void PostProcessor::Process(CompletedRequestPtr &request)
 {
-	if (stages_.empty())
+	// Each frame holds on to the chain it started with, in case a reload replaces it.
+	std::shared_ptr<StageChain> chain = currentChain();
+	std::deque<CompletedRequestPtr> dropped;
 	{
-		callback_(request);
-		return;
+		std::unique_lock<std::mutex> l(mutex_);
+		// With no stages a frame can go straight out, but not while earlier frames are still on
+		// their way, as it would overtake them.
+		if (chain->stages.empty() && requests_.empty() && waiting_.empty() && !delivering_)
+		{
+			l.unlock();
+			callback_(request);
+			return;
+		}
+		if (!policy_.Accept(requests_.size() + waiting_.size()))
+			return; // the caller's reference goes, so the buffers return to the camera
+		space_cv_.wait(l, [this] { return quit_ || !policy_.MustWait(requests_.size() + waiting_.size()); });
+		waiting_.push_back({ std::move(request), chain }); // caller has given us ownership of this reference
+		// Only frames that haven't started yet can be dropped, so the stages never do work
+		// that gets thrown away.
+		while (policy_.DropOldest(waiting_.size()))
+		{
+			dropped.push_back(std::move(waiting_.front().request));
+			waiting_.pop_front();
+		}
+		startProcessing();
 	}
+	// The dropped frames' buffers go back to the camera here, outside the lock.
+}
 
-	std::unique_lock<std::mutex> l(mutex_);
-	requests_.push(std::move(request)); // caller has given us ownership of this reference
+void PostProcessor::startProcessing()
+{
+	// With drop-oldest, only as many frames as its depth are processed at once, and the rest
+	// wait their turn. Otherwise every frame starts straight away.
+	while (!waiting_.empty() && !quit_ &&
+		   (policy_.GetMode() != DropPolicy::Mode::DropOldest || requests_.size() < policy_.Depth()))
+	{
+		requests_.push(std::move(waiting_.front().request));
+		std::shared_ptr<StageChain> chain = std::move(waiting_.front().chain);
+		waiting_.pop_front();
 
-	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
-		bool drop_request = false;
-		for (auto &stage : stages_)
-		{
-			if (stage->Process(request))
+		std::promise<bool> promise;
+		auto process_fn = [this, chain](CompletedRequestPtr &request, std::promise<bool> promise) {
+			bool drop_request = false;
+			LatencyTracer::Get().Record(TracePoint::PostProcessStart, request->camera, request->metadata);
+			for (auto &stage : chain->stages)
 			{
-				drop_request = true;
-				break;
+				if (stage->Process(request))
+				{
+					drop_request = true;
+					break;
+				}
 			}
-		}
-		promise.set_value(drop_request);
-		cv_.notify_one();
-	};
+			LatencyTracer::Get().Record(TracePoint::PostProcessEnd, request->camera, request->metadata);
+			promise.set_value(drop_request);
+			cv_.notify_one();
+		};
 
-	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
-	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
-	futures_.push(promise.get_future());
-	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
+		// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
+		// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
+		futures_.push(promise.get_future());
+		std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
+	}
 }
 
 void PostProcessor::outputThread()
@@ -134,32 +257,56 @@ void PostProcessor::outputThread()
 			futures_.pop();
 			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
 			requests_.pop();
+			delivering_ = true;
+			startProcessing();
+			space_cv_.notify_one();
 		}
 
 		if (!drop_request)
 			callback_(request); // callback can take over ownership from us
+
+		std::lock_guard<std::mutex> l(mutex_);
+		delivering_ = false;
 	}
 }
 
-void PostProcessor::Stop()
+std::vector<CompletedRequestPtr> PostProcessor::Stop()
 {
-	for (auto &stage : stages_)
+	running_ = false;
+	for (auto &stage : chain_->stages)
 	{
 		stage->Stop();
 	}
 
+	// Anything that never got started goes back to the caller.
+	std::vector<CompletedRequestPtr> unstarted;
 	{
 		std::unique_lock<std::mutex> l(mutex_);
 		quit_ = true;
+		for (auto &waiting : waiting_)
+			unstarted.push_back(std::move(waiting.request));
+		waiting_.clear();
 		cv_.notify_one();
+		space_cv_.notify_all();
 	}
 
 	output_thread_.join();
+
+	if (policy_.Dropped())
+		std::cerr << "Post-processing dropped " << policy_.Dropped() << " frames (policy " << policy_.Spec() << ")"
+				  << std::endl;
+	return unstarted;
+}
+
+unsigned int PostProcessor::RequestsHeld()
+{
+	std::lock_guard<std::mutex> l(mutex_);
+	return requests_.size() + waiting_.size();
 }
 
 void PostProcessor::Teardown()
 {
-	for (auto &stage : stages_)
+	for (auto &stage : chain_->stages)
 	{
 		stage->Teardown();
 	}
@@ -9,11 +9,15 @@
 
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <future>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <vector>
 
 #include "core/completed_request.hpp"
+#include "core/drop_policy.hpp"
 
 namespace libcamera
 {
@@ -47,22 +51,58 @@ public:
 
 	void Process(CompletedRequestPtr &request);
 
-	void Stop();
+	// Returns the frames that were never started. They must be released only once the caller
+	// no longer holds the camera stop lock, as that sends them back to the camera.
+	std::vector<CompletedRequestPtr> Stop();
 
 	void Teardown();
 
+	// Read a new configuration and swap it in while the camera runs. Frames already being
+	// processed finish with the old stages, and stages that appear in both configurations
+	// may carry their state across. The stream configuration can't change, so on any error
+	// we keep the current stages. Returns true if the new stages were installed.
+	bool Reload(std::string const &filename);
+
+	// Number of requests currently held for processing.
+	unsigned int RequestsHeld();
+
 private:
+	// A stage chain that has been replaced gets stopped and torn down once the last frame
+	// using it has finished.
+	struct StageChain
+	{
+		~StageChain();
+		std::vector<StagePtr> stages;
+		bool retired = false;
+	};
+
 	PostProcessingStage *createPostProcessingStage(char const *name);
+	std::vector<StagePtr> readStages(std::string const &filename);
+	std::shared_ptr<StageChain> currentChain();
 
 	LibcameraApp *app_;
-	std::vector<StagePtr> stages_;
+	std::shared_ptr<StageChain> chain_;
+	bool running_ = false;
 	void outputThread();
-
+	void startProcessing();
+
+	// Frames not yet started, each with the chain that was current when it arrived.
+	struct WaitingRequest
+	{
+		CompletedRequestPtr request;
+		std::shared_ptr<StageChain> chain;
+	};
+	std::deque<WaitingRequest> waiting_;
 	std::queue<CompletedRequestPtr> requests_;
 	std::queue<std::future<bool>> futures_;
 	std::thread output_thread_;
+	// The output thread is handing a frame to the callback.
+	bool delivering_ = false;
 	bool quit_;
 	PostProcessorCallback callback_;
 	std::mutex mutex_;
 	std::condition_variable cv_;
+	// Applied to requests_ when the stages can't keep up.
+	DropPolicy policy_;
+	std::condition_variable space_cv_;
 };
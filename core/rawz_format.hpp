@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * rawz_format.hpp - layout of the compressed raw (rawz) files.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// A .rawz file is a RawzFileHeader, then a record for each frame, then an index of those
+// records so that readers can go straight to any frame. A recording that wasn't closed
+// properly has no index, but the frames can still be found by following their sizes.
+//
+// Each frame record is a RawzFrameHeader, a RawzSlice for each slice, and then the slices'
+// data. Slices are bands of whole rows that are coded independently, so that they can be
+// done in parallel. The samples are predicted from the nearest ones of the same colour to
+// the left and above (within the slice), and the differences, mapped to unsigned numbers
+// by zigzag coding (0, -1, 1, -2...), are stored in blocks of RAWZ_BLOCK_SIZE. The data is
+// a byte for each block giving the number of bits per value, and then all the values,
+// packed as a little-endian bitstream. Decode with utils/rawz_decode.py.
+//
+// Everything is little-endian.
+
+static constexpr uint32_t RAWZ_VERSION = 1;
+static constexpr unsigned int RAWZ_BLOCK_SIZE = 16;
+
+struct RawzFileHeader
+{
+	char magic[4]; // "rawz"
+	uint32_t version;
+};
+
+enum RawzPacking : uint8_t
+{
+	RAWZ_PACKING_8BIT = 0, // a byte per sample
+	RAWZ_PACKING_CSI2 = 1, // MIPI CSI-2 packed, as the 10 and 12-bit _CSI2P formats
+	RAWZ_PACKING_16BIT = 2, // two bytes per sample
+};
+
+struct RawzFrameHeader
+{
+	char magic[4]; // "rzfr"
+	uint32_t num_slices;
+	uint64_t frame_size; // of the whole record
+	uint64_t sequence;
+	int64_t timestamp_us;
+	uint32_t width;
+	uint32_t height;
+	uint32_t fourcc; // the libcamera pixel format
+	uint8_t bits;
+	uint8_t packing;
+	uint8_t bayer_order; // 0 = RGGB, 1 = GRBG, 2 = BGGR, 3 = GBRG
+	uint8_t block_size;
+};
+
+struct RawzSlice
+{
+	uint32_t rows;
+	uint32_t bytes;
+};
+
+struct RawzIndexHeader
+{
+	char magic[4]; // "rzix"
+	uint32_t entry_size;
+	uint64_t num_entries;
+};
+
+struct RawzIndexEntry
+{
+	uint64_t sequence;
+	uint64_t offset;
+	int64_t timestamp_us;
+};
+
+// The very end of the file, saying where the index starts.
+struct RawzIndexFooter
+{
+	uint64_t index_offset;
+	char magic[4]; // "rzie"
+	uint32_t version;
+};
+
+static_assert(sizeof(RawzFrameHeader) == 48 && sizeof(RawzIndexEntry) == 24 && sizeof(RawzIndexFooter) == 16,
+			  "rawz structures must have no padding");
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * trigger_log.cpp - record the timing of every trigger to a binary log.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "core/clock_sync.hpp"
+#include "core/trigger_log.hpp"
+
+TriggerLog::TriggerLog(std::string const &filename, unsigned int camera)
+{
+	fp_ = fopen(filename.c_str(), "wb");
+	if (!fp_)
+		throw std::runtime_error("failed to open trigger log " + filename);
+
+	TriggerLogHeader header = {};
+	header.magic = TriggerLogHeader::MAGIC;
+	header.version = TriggerLogHeader::VERSION;
+	header.record_size = sizeof(TriggerRecord);
+	header.camera = camera;
+	gethostname(header.node, sizeof(header.node) - 1);
+	if (fwrite(&header, sizeof(header), 1, fp_) != 1)
+		throw std::runtime_error("failed to write trigger log " + filename);
+}
+
+TriggerLog::~TriggerLog()
+{
+	for (auto const &[timestamp, record] : pending_)
+		write(record);
+	fclose(fp_);
+}
+
+int64_t TriggerLog::Now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+void TriggerLog::Triggered(int64_t edge_ns, int64_t sensor_timestamp_ns, int32_t exposure_time)
+{
+	TriggerRecord record = {};
+	record.edge = edge_ns;
+	record.sensor_timestamp = sensor_timestamp_ns;
+	record.exposure_time = exposure_time;
+	record.synced = ClockSync::Get().Synced();
+	record.clock_offset = record.synced ? ClockSync::Get().OffsetUs() * 1000 : 0;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	record.trigger = triggers_++;
+	pending_.emplace(sensor_timestamp_ns / 1000, record);
+}
+
+void TriggerLog::Encoded(int64_t timestamp_us)
+{
+	int64_t now = Now();
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto [begin, end] = pending_.equal_range(timestamp_us);
+	for (auto it = begin; it != end; it++)
+	{
+		if (!it->second.encoded)
+		{
+			it->second.encoded = now;
+			break;
+		}
+	}
+}
+
+void TriggerLog::Written(int64_t timestamp_us)
+{
+	int64_t now = Now();
+	std::lock_guard<std::mutex> lock(mutex_);
+	// Frames are written in the order they were encoded, so it's the oldest trigger's.
+	auto it = pending_.lower_bound(timestamp_us);
+	if (it == pending_.end() || it->first != timestamp_us)
+		return;
+	it->second.written = now;
+	write(it->second);
+	pending_.erase(it);
+}
+
+void TriggerLog::write(TriggerRecord const &record)
+{
+	// It's only a few dozen bytes per trigger, so the stdio buffering is plenty.
+	fwrite(&record, sizeof(record), 1, fp_);
+}
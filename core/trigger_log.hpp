@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * trigger_log.hpp - record the timing of every trigger to a binary log.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+
+// For every trigger we note when the edge came, which frame it chose, and when that frame
+// had been encoded and written out. A record is written once the frame has been written,
+// and records for frames that never made it are written with zero for the missing times
+// when the log closes. utils/trigger_merge.py reads the logs of several cameras and works
+// out the latencies and the skew between cameras.
+//
+// The file starts with a TriggerLogHeader, followed by TriggerRecords, all little endian.
+// Times are CLOCK_MONOTONIC nanoseconds on the node that wrote them, and the clock_offset
+// turns them into rig-global time (see ClockSync), if the node was synchronised.
+
+struct TriggerLogHeader
+{
+	static constexpr uint32_t MAGIC = 0x6c677274; // "trgl"
+	static constexpr uint32_t VERSION = 1;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t camera;
+	char node[32];
+};
+
+struct TriggerRecord
+{
+	uint64_t trigger;
+	int64_t edge;
+	int64_t sensor_timestamp;
+	int64_t encoded;
+	int64_t written;
+	int64_t clock_offset;
+	int32_t exposure_time; // microseconds
+	uint32_t synced; // whether clock_offset is valid
+};
+
+class TriggerLog
+{
+public:
+	TriggerLog(std::string const &filename, unsigned int camera);
+	~TriggerLog();
+
+	static int64_t Now();
+
+	// The trigger whose edge came at this time chose the frame with this sensor timestamp.
+	void Triggered(int64_t edge_ns, int64_t sensor_timestamp_ns, int32_t exposure_time);
+	// The encoder and output report frames by their sensor timestamps in microseconds.
+	void Encoded(int64_t timestamp_us);
+	void Written(int64_t timestamp_us);
+
+private:
+	void write(TriggerRecord const &record);
+
+	FILE *fp_;
+	std::mutex mutex_;
+	uint64_t triggers_ = 0;
+	// Keyed by sensor timestamp in microseconds. Two triggers can choose the same frame, which
+	// is then encoded and written once for each, so they stay in the order they came.
+	std::multimap<int64_t, TriggerRecord> pending_;
+};
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * trigger_ring.hpp - pick out the frames that were being exposed when a trigger fired.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <libcamera/control_ids.h>
+
+#include "core/completed_request.hpp"
+
+// We hold on to the last few frames, and trigger edges are timestamped on the same clock as
+// the SensorTimestamp (CLOCK_MONOTONIC). Each edge selects the frame whose exposure window
+// - from the SensorTimestamp for ExposureTime - contains it or, failing that, the nearest
+// one. We can only decide once a frame has started after the edge, so the selected frame
+// comes out of AddFrame up to a frame later than the edge. Bear in mind that the frames in
+// the ring can't go back to the camera, so --buffer-count may need to be raised.
+
+class TriggerRing
+{
+public:
+	struct Match
+	{
+		CompletedRequestPtr completed_request;
+		int64_t edge; // ns
+		int64_t offset; // ns from the start of the exposure to the edge
+	};
+
+	TriggerRing(unsigned int depth) : depth_(std::max(depth, 1u)) {}
+
+	static int64_t Now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+
+	// This may be called from any thread, for example a GPIO interrupt handler.
+	void AddEdge(int64_t timestamp)
+	{
+		std::lock_guard<std::mutex> lock(edges_mutex_);
+		edges_.push_back(timestamp);
+	}
+
+	// Add the latest frame to the ring, and return any frames that have now been selected
+	// by a trigger edge, oldest first. No frame is ever returned twice.
+	std::vector<Match> AddFrame(CompletedRequestPtr &completed_request)
+	{
+		using namespace libcamera;
+		ControlList const &metadata = completed_request->metadata;
+		if (!metadata.contains(controls::SensorTimestamp))
+			return {};
+		Frame frame;
+		frame.completed_request = completed_request;
+		frame.start = metadata.get(controls::SensorTimestamp);
+		int64_t exposure = metadata.contains(controls::ExposureTime) ? metadata.get(controls::ExposureTime)
+																	 : metadata.get(controls::FrameDuration);
+		frame.end = frame.start + exposure * 1000;
+		frames_.push_back(std::move(frame));
+		if (frames_.size() > depth_)
+			frames_.pop_front();
+
+		std::deque<int64_t> edges;
+		{
+			std::lock_guard<std::mutex> lock(edges_mutex_);
+			std::swap(edges, edges_);
+		}
+
+		std::vector<Match> matches;
+		while (!edges.empty())
+		{
+			int64_t edge = edges.front();
+			// Wait until a frame starts after the edge, unless this one contains it.
+			if (edge > frames_.back().end)
+				break;
+			edges.pop_front();
+
+			Frame *best = nullptr;
+			int64_t best_distance = 0;
+			for (auto &f : frames_)
+			{
+				int64_t distance = edge < f.start ? f.start - edge : (edge > f.end ? edge - f.end : 0);
+				if (!best || distance < best_distance)
+					best = &f, best_distance = distance;
+			}
+			// If the edge is before everything we still have, the ring was too short.
+			if (best == &frames_.front() && edge < best->start && frames_.size() == depth_ && depth_ > 1)
+			{
+				missed_++;
+				continue;
+			}
+			if (best->selected)
+				continue;
+			best->selected = true;
+			matches.push_back({ best->completed_request, edge, edge - best->start });
+		}
+
+		if (!edges.empty())
+		{
+			std::lock_guard<std::mutex> lock(edges_mutex_);
+			edges_.insert(edges_.begin(), edges.begin(), edges.end());
+		}
+		return matches;
+	}
+
+	// Let go of all the frames, so that they can return to the camera.
+	void Clear() { frames_.clear(); }
+
+	uint64_t Missed() const { return missed_; }
+
+private:
+	struct Frame
+	{
+		CompletedRequestPtr completed_request;
+		int64_t start;
+		int64_t end;
+		bool selected = false;
+	};
+
+	unsigned int depth_;
+	std::deque<Frame> frames_;
+	std::mutex edges_mutex_;
+	std::deque<int64_t> edges_;
+	uint64_t missed_ = 0;
+};
+
+// Fires a trigger every period_ms at a random phase relative to the frames, so that the
+// frame selection can be tested without any hardware.
+class SimulatedTrigger
+{
+public:
+	SimulatedTrigger(unsigned int period_ms, std::function<void(int64_t)> callback)
+		: period_ms_(period_ms), callback_(callback), thread_(&SimulatedTrigger::threadFunc, this)
+	{
+	}
+	~SimulatedTrigger()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		cond_var_.notify_one();
+		thread_.join();
+	}
+
+private:
+	void threadFunc()
+	{
+		std::mt19937 rng(std::random_device {}());
+		std::uniform_int_distribution<unsigned int> jitter(0, period_ms_ / 2);
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (!cond_var_.wait_for(lock, std::chrono::milliseconds(period_ms_ + jitter(rng)), [this] { return abort_; }))
+			callback_(TriggerRing::Now());
+	}
+
+	unsigned int period_ms_;
+	std::function<void(int64_t)> callback_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	bool abort_ = false;
+	std::thread thread_;
+};
@@ -33,7 +33,8 @@ struct VideoOptions : public Options
 			("inline", value<bool>(&inline_headers)->default_value(false)->implicit_value(true),
 			 "Force PPS/SPS header with every I frame (h264 only)")
 			("codec", value<std::string>(&codec)->default_value("h264"),
-			 "Set the codec to use, either h264, mjpeg or yuv420")
+			 "Set the codec to use, either h264, mjpeg or yuv420, or for libcamera-raw, rawz to compress the "
+			 "frames without loss (read them with utils/rawz_decode.py)")
 			("save-pts", value<std::string>(&save_pts),
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&quality)->default_value(50),
@@ -41,7 +42,7 @@ struct VideoOptions : public Options
 			("listen,l", value<bool>(&listen)->default_value(false)->implicit_value(true),
 			 "Listen for an incoming client network connection before sending data to the client")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
-			 "Pause or resume video recording when ENTER pressed")
+			 "Pause or resume video recording when ENTER pressed (k then ENTER asks the encoder for a keyframe)")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
 			 "Pause or resume video recording when signal received")
 			("initial,i", value<std::string>(&initial)->default_value("record"),
@@ -56,6 +57,78 @@ struct VideoOptions : public Options
 			 "Run for the exact number of frames specified. This will override any timeout set.")
 			("gpio", value<unsigned int>(&gpio)->default_value(1),
 			 "GPIO synchronization type.")
+			("trigger-history", value<unsigned int>(&trigger_history)->default_value(0),
+			 "Keep this many recent frames, and on a trigger use the one that was being exposed when it fired "
+			 "rather than the next one to arrive (0 to disable). Raise --buffer-count to suit.")
+			("trigger-simulate", value<unsigned int>(&trigger_simulate)->default_value(0),
+			 "Generate a trigger about every this many milliseconds, for testing --trigger-history")
+			("trigger-log", value<std::string>(&trigger_log),
+			 "Write the timing of every trigger to this file, for utils/trigger_merge.py")
+			("cameras", value<std::string>(&cameras),
+			 "Record from several cameras at once, given as a comma-separated list of indexes. Put a # in the "
+			 "output name, and in any --exposure-publish path, which is replaced by the camera index.")
+			("group-tolerance", value<unsigned int>(&group_tolerance)->default_value(0),
+			 "With --cameras, only record frames that have a partner from every camera with a timestamp within "
+			 "this many microseconds (0 to record every frame)")
+			("stitch", value<std::string>(&stitch),
+			 "With --cameras and --group-tolerance, stitch each group of frames into an equirectangular panorama "
+			 "using this LUT file (made by utils/make_stitch_lut.py)")
+			("stitch-output", value<std::string>(&stitch_output),
+			 "Where to send the panorama, given like --output")
+			("stitch-codec", value<std::string>(&stitch_codec)->default_value("yuv420"),
+			 "Codec for the panorama: yuv420, mjpeg or jpeg")
+			("stitch-threads", value<unsigned int>(&stitch_threads)->default_value(2),
+			 "Number of threads that share the stitching")
+			("encode-pool", value<unsigned int>(&encode_pool)->default_value(0),
+			 "Share this many encode threads between all the cameras, rather than each encoder having its own "
+			 "(mjpeg and rawz only)")
+			("encode-cores", value<std::string>(&encode_cores),
+			 "Pin the encode pool threads to these cores, given as a comma-separated list")
+			("mjpeg-threading", value<std::string>(&mjpeg_threading)->default_value("frame"),
+			 "Give the mjpeg encode threads a frame each (frame), or have them share each frame between them in "
+			 "stripes (slice), which finishes each frame sooner")
+			("monitor", value<std::string>(&monitor),
+			 "Encode the lores stream continuously and send it here (given like --output), alongside the "
+			 "triggered captures from the main stream")
+			("monitor-codec", value<std::string>(&monitor_codec)->default_value("mjpeg"),
+			 "Codec for the --monitor stream: mjpeg or h264")
+			("monitor-bitrate", value<uint32_t>(&monitor_bitrate)->default_value(1000000),
+			 "Bitrate for the --monitor stream, in bits/second (h264 only)")
+			("start-delay", value<unsigned int>(&start_delay)->default_value(0),
+			 "With --sync-serve, schedule the rig's start for this many milliseconds from now, and tell the "
+			 "followers. Allow for them to hear it, so more than their --sync-interval.")
+			("wait-start", value<bool>(&wait_start)->default_value(false)->implicit_value(true),
+			 "With --sync-with, wait for the start time scheduled by the clock server before starting the camera")
+			("wait-start-timeout", value<unsigned int>(&wait_start_timeout)->default_value(30000),
+			 "Give up with an error if the clock server hasn't sent a start time within this many milliseconds")
+			("phase-lock", value<unsigned int>(&phase_lock)->default_value(0),
+			 "After a scheduled start, nudge the frame duration during this many frames to keep the frames in "
+			 "phase with the start time")
+			("encode-policy", value<std::string>(&encode_policy)->default_value("block"),
+			 "What to do with frames when the encoder can't keep up: block[:depth], drop-oldest[:depth], "
+			 "drop-newest[:depth] or every:N (keep only every Nth frame)")
+			("h264-device", value<std::string>(&h264_device)->default_value("/dev/video11"),
+			 "The V4L2 device for h264 encoding, x264 to encode in software (used anyway if there is no such "
+			 "device), or mock[:ms] for a pretend one taking that long per frame")
+			("x264-preset", value<std::string>(&x264_preset)->default_value("superfast"),
+			 "The x264 speed preset, from ultrafast to placebo (software h264 only)")
+			("x264-threads", value<unsigned int>(&x264_threads)->default_value(0),
+			 "Number of x264 threads, or 0 to suit the number of cores (software h264 only)")
+			("x264-threading", value<std::string>(&x264_threading)->default_value("frame"),
+			 "Give x264 threads whole frames (frame), which is faster, or slices of each frame (slice), "
+			 "which adds no latency (software h264 only)")
+			("h264-stall", value<std::string>(&h264_stall)->default_value("wait:1000"),
+			 "What to do with a frame when the h264 codec has no input buffer free: wait[:ms] (and drop it "
+			 "if none comes free in time), drop, or keyframe (drop it and make the next frame a keyframe)")
+			("adaptive-bitrate", value<uint32_t>(&adaptive_bitrate)->default_value(0),
+			 "When streaming over the network, lower the bitrate as far as this (in bits/second) whenever the "
+			 "link falls behind, and raise it back towards --bitrate as it recovers (0 to disable)")
+			("metadata-out", value<std::string>(&metadata_out),
+			 "Write a record of each encoded frame's metadata to this file (read it with utils/metadata_read.py)")
+			("metadata-format", value<std::string>(&metadata_format)->default_value("binary"),
+			 "Write --metadata-out records as binary or json (one object per line)")
+			("metadata-values", value<std::string>(&metadata_values),
+			 "Comma-separated list of post-processing metadata values to add to each --metadata-out record")
 			;
 		// clang-format on
 	}
@@ -78,6 +151,41 @@ struct VideoOptions : public Options
 	size_t circular;
 	uint32_t frames;
 	uint32_t gpio;
+	unsigned int trigger_history;
+	unsigned int trigger_simulate;
+	std::string trigger_log;
+	std::string cameras;
+	unsigned int group_tolerance;
+	std::string stitch;
+	std::string stitch_output;
+	std::string stitch_codec;
+	unsigned int stitch_threads;
+	unsigned int encode_pool;
+	std::string encode_cores;
+	std::string mjpeg_threading;
+	std::string encode_policy;
+	std::string monitor;
+	std::string monitor_codec;
+	uint32_t monitor_bitrate;
+	unsigned int start_delay;
+	bool wait_start;
+	unsigned int wait_start_timeout;
+	unsigned int phase_lock;
+	std::string h264_device;
+	std::string h264_stall;
+	std::string x264_preset;
+	unsigned int x264_threads;
+	std::string x264_threading;
+	uint32_t adaptive_bitrate;
+	std::string metadata_out;
+	std::string metadata_format;
+	std::string metadata_values;
+
+	void CopyRuntimeSettings(VideoOptions const &other)
+	{
+		Options::CopyRuntimeSettings(other);
+		bitrate = other.bitrate;
+	}
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -96,6 +204,8 @@ struct VideoOptions : public Options
 			codec = "mjpeg";
 		else if (strcasecmp(codec.c_str(), "jpeg") == 0)
 			codec = "jpeg";
+		else if (strcasecmp(codec.c_str(), "rawz") == 0)
+			codec = "rawz";
 		else
 			throw std::runtime_error("unrecognised codec " + codec);
 		if (strcasecmp(initial.c_str(), "pause") == 0)
@@ -108,6 +218,26 @@ struct VideoOptions : public Options
 			std::cerr << "WARNING: consider inline headers with 'pause'/split/segment/circular" << std::endl;
 		if ((split || segment) && output.find('%') == std::string::npos)
 			std::cerr << "WARNING: expected % directive in output filename" << std::endl;
+		if (!stitch.empty() && (cameras.find(',') == std::string::npos || !group_tolerance))
+			throw std::runtime_error("--stitch needs several --cameras and a --group-tolerance");
+		if (!stitch.empty() && strcasecmp(stitch_codec.c_str(), "h264") == 0)
+			throw std::runtime_error("the panorama can't be encoded as h264, which needs a dmabuf");
+		if (adaptive_bitrate && adaptive_bitrate >= bitrate)
+			throw std::runtime_error("--adaptive-bitrate needs a higher --bitrate to work up to");
+		if (mjpeg_threading != "frame" && mjpeg_threading != "slice")
+			throw std::runtime_error("--mjpeg-threading must be frame or slice");
+		if (x264_threading != "frame" && x264_threading != "slice")
+			throw std::runtime_error("--x264-threading must be frame or slice");
+		if (metadata_format != "binary" && metadata_format != "json")
+			throw std::runtime_error("--metadata-format must be binary or json");
+		if (!monitor.empty() && (!lores_width || !lores_height))
+			lores_width = 640, lores_height = 480;
+		if (!monitor.empty() && monitor_codec != "mjpeg" && monitor_codec != "h264")
+			throw std::runtime_error("unrecognised monitor codec " + monitor_codec);
+		if (start_delay && !sync_serve)
+			throw std::runtime_error("--start-delay needs --sync-serve");
+		if (wait_start && sync_with.empty())
+			throw std::runtime_error("--wait-start needs --sync-with");
 
 		return true;
 	}
@@ -118,10 +248,19 @@ struct VideoOptions : public Options
 		std::cerr << "    profile: " << profile << std::endl;
 		std::cerr << "    level:  " << level << std::endl;
 		std::cerr << "    intra: " << intra << std::endl;
+		if (codec == "h264")
+			std::cerr << "    h264-device: " << h264_device << " stall: " << h264_stall << std::endl;
+		if (codec == "h264" && h264_device == "x264")
+			std::cerr << "    x264-preset: " << x264_preset << " threads: " << x264_threads << " threading: "
+					  << x264_threading << std::endl;
+		if (adaptive_bitrate)
+			std::cerr << "    adaptive-bitrate: " << adaptive_bitrate << std::endl;
 		std::cerr << "    inline: " << inline_headers << std::endl;
 		std::cerr << "    save-pts: " << save_pts << std::endl;
 		std::cerr << "    codec: " << codec << std::endl;
 		std::cerr << "    quality (for MJPEG or JPEG): " << quality << std::endl;
+		if (codec == "mjpeg")
+			std::cerr << "    mjpeg-threading: " << mjpeg_threading << std::endl;
 		std::cerr << "    keypress: " << keypress << std::endl;
 		std::cerr << "    signal: " << signal << std::endl;
 		std::cerr << "    initial: " << initial << std::endl;
@@ -129,5 +268,26 @@ struct VideoOptions : public Options
 		std::cerr << "    segment: " << segment << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
 		std::cerr << "    gpio: " << gpio << std::endl;
+		if (trigger_history)
+			std::cerr << "    trigger-history: " << trigger_history << " simulate " << trigger_simulate << std::endl;
+		if (!trigger_log.empty())
+			std::cerr << "    trigger-log: " << trigger_log << std::endl;
+		std::cerr << "    encode-policy: " << encode_policy << std::endl;
+		if (!metadata_out.empty())
+			std::cerr << "    metadata-out: " << metadata_out << " format: " << metadata_format
+					  << " values: " << metadata_values << std::endl;
+		if (!cameras.empty())
+			std::cerr << "    cameras: " << cameras << " group-tolerance: " << group_tolerance << std::endl;
+		if (encode_pool)
+			std::cerr << "    encode-pool: " << encode_pool << " cores: " << encode_cores << std::endl;
+		if (!stitch.empty())
+			std::cerr << "    stitch: " << stitch << " output: " << stitch_output << " codec: " << stitch_codec
+					  << " threads: " << stitch_threads << std::endl;
+		if (!monitor.empty())
+			std::cerr << "    monitor: " << monitor << " codec: " << monitor_codec << " bitrate: " << monitor_bitrate
+					  << std::endl;
+		if (start_delay || wait_start)
+			std::cerr << "    start-delay: " << start_delay << " wait-start: " << wait_start << " timeout: "
+					  << wait_start_timeout << " phase-lock: " << phase_lock << std::endl;
 	}
 };
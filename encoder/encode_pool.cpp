@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * encode_pool.cpp - worker threads shared by all the encoders in a process.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <iostream>
+#include <sstream>
+
+#include "encode_pool.hpp"
+
+std::shared_ptr<EncodePool> EncodePool::Get(unsigned int num_threads, std::string const &cores, bool verbose)
+{
+	static std::mutex mutex;
+	static std::weak_ptr<EncodePool> pool;
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::shared_ptr<EncodePool> p = pool.lock();
+	if (!p)
+	{
+		std::vector<int> core_list;
+		std::stringstream ss(cores);
+		for (std::string core; std::getline(ss, core, ',');)
+			core_list.push_back(std::stoi(core));
+		p = std::make_shared<EncodePool>(num_threads, core_list);
+		pool = p;
+		if (verbose)
+			std::cerr << "Made encode pool with " << num_threads << " threads" << std::endl;
+	}
+	return p;
+}
+
+EncodePool::EncodePool(unsigned int num_threads, std::vector<int> const &cores)
+{
+	for (unsigned int i = 0; i < num_threads; i++)
+	{
+		threads_.emplace_back(&EncodePool::workerThread, this);
+		if (cores.empty())
+			continue;
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(cores[i % cores.size()], &cpuset);
+		if (pthread_setaffinity_np(threads_.back().native_handle(), sizeof(cpuset), &cpuset))
+			std::cerr << "WARNING: failed to pin encode thread to core " << cores[i % cores.size()] << std::endl;
+	}
+}
+
+EncodePool::~EncodePool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_all();
+	for (auto &thread : threads_)
+		thread.join();
+}
+
+void EncodePool::Submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		tasks_.push(std::move(task));
+	}
+	cond_var_.notify_one();
+}
+
+void EncodePool::workerThread()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] { return abort_ || !tasks_.empty(); });
+			// Encoders wait for their own tasks before they let go of the pool, so there's
+			// never anything left to do when we get here.
+			if (tasks_.empty())
+				return;
+			task = std::move(tasks_.front());
+			tasks_.pop();
+		}
+		task();
+	}
+}
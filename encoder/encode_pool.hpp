@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * encode_pool.hpp - worker threads shared by all the encoders in a process.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+// When several cameras run in one process, giving each encoder its own threads means far
+// more threads than cores. Instead, encoders can hand their work to this pool, whose
+// threads may be pinned to particular cores.
+
+class EncodePool
+{
+public:
+	// The first encoder to ask makes the pool, and it goes when the last one lets go. The
+	// cores are given as a comma-separated list, and the threads are pinned to them in turn.
+	static std::shared_ptr<EncodePool> Get(unsigned int num_threads, std::string const &cores, bool verbose);
+
+	EncodePool(unsigned int num_threads, std::vector<int> const &cores);
+	~EncodePool();
+
+	void Submit(std::function<void()> task);
+
+private:
+	void workerThread();
+
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::queue<std::function<void()>> tasks_;
+	bool abort_ = false;
+};
@@ -32,6 +32,13 @@ public:
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, libcamera::ControlList const &metadata, int64_t timestamp_us) = 0;
+	// Encoders that queue frames up for themselves can apply a drop-oldest policy there.
+	virtual bool SupportsDropOldest() const { return false; }
+	// These change the encoding while it runs, and return false if the encoder can't. A
+	// keyframe request applies to the next frame to be encoded.
+	virtual bool RequestKeyframe() { return false; }
+	virtual bool SetBitrate(uint32_t bitrate) { return false; }
+	virtual bool SetFramerate(float framerate) { return false; }
 
 protected:
 	InputDoneCallback input_done_callback_;
@@ -0,0 +1,341 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * h264_device.cpp - the codec behind the H264Encoder.
+ */
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include <iostream>
+#include <map>
+
+#include "h264_device.hpp"
+#include "mock_h264_device.hpp"
+#if X264_PRESENT
+#include "x264_h264_device.hpp"
+#endif
+
+H264Device *H264Device::Create(VideoOptions const *options, StreamInfo const &info)
+{
+	if (options->h264_device.compare(0, 4, "mock") == 0)
+		return new MockH264Device(options, info);
+#if X264_PRESENT
+	if (options->h264_device == "x264")
+		return new X264H264Device(options, info);
+	if (access(options->h264_device.c_str(), F_OK) < 0)
+	{
+		std::cerr << "No H264 codec at " << options->h264_device << ", using x264" << std::endl;
+		return new X264H264Device(options, info);
+	}
+#else
+	if (options->h264_device == "x264")
+		throw std::runtime_error("not built with libx264, so no software H264 encoding");
+#endif
+	return new V4L2H264Device(options, info);
+}
+
+static int xioctl(int fd, unsigned long ctl, void *arg)
+{
+	int ret, num_tries = 10;
+	do
+	{
+		ret = ioctl(fd, ctl, arg);
+	} while (ret == -1 && errno == EINTR && num_tries-- > 0);
+	return ret;
+}
+
+static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
+{
+	if (cs == libcamera::ColorSpace::Rec709)
+		return V4L2_COLORSPACE_REC709;
+	else if (cs == libcamera::ColorSpace::Smpte170m)
+		return V4L2_COLORSPACE_SMPTE170M;
+
+	std::cerr << "H264: surprising colour space: " << libcamera::ColorSpace::toString(cs) << std::endl;
+	return V4L2_COLORSPACE_SMPTE170M;
+}
+
+V4L2H264Device::V4L2H264Device(VideoOptions const *options, StreamInfo const &info) : options_(options)
+{
+	// First open the encoder device. Maybe we should double-check its "caps". It's
+	// non-blocking so that we can dequeue whatever is ready and then go back to polling.
+
+	const char *device_name = options->h264_device.c_str();
+	fd_ = open(device_name, O_RDWR | O_NONBLOCK, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open V4L2 H264 encoder");
+	if (options->verbose)
+		std::cerr << "Opened H264Encoder on " << device_name << " as fd " << fd_ << std::endl;
+
+	// Apply any options->
+
+	v4l2_control ctrl = {};
+	if (options->bitrate)
+	{
+		ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+		ctrl.value = options->bitrate;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			throw std::runtime_error("failed to set bitrate");
+	}
+	if (!options->profile.empty())
+	{
+		static const std::map<std::string, int> profile_map =
+			{ { "baseline", V4L2_MPEG_VIDEO_H264_PROFILE_BASELINE },
+			  { "main", V4L2_MPEG_VIDEO_H264_PROFILE_MAIN },
+			  { "high", V4L2_MPEG_VIDEO_H264_PROFILE_HIGH } };
+		auto it = profile_map.find(options->profile);
+		if (it == profile_map.end())
+			throw std::runtime_error("no such profile " + options->profile);
+		ctrl.id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
+		ctrl.value = it->second;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			throw std::runtime_error("failed to set profile");
+	}
+	if (!options->level.empty())
+	{
+		static const std::map<std::string, int> level_map =
+			{ { "4", V4L2_MPEG_VIDEO_H264_LEVEL_4_0 },
+			  { "4.1", V4L2_MPEG_VIDEO_H264_LEVEL_4_1 },
+			  { "4.2", V4L2_MPEG_VIDEO_H264_LEVEL_4_2 } };
+		auto it = level_map.find(options->level);
+		if (it == level_map.end())
+			throw std::runtime_error("no such level " + options->level);
+		ctrl.id = V4L2_CID_MPEG_VIDEO_H264_LEVEL;
+		ctrl.value = it->second;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			throw std::runtime_error("failed to set level");
+	}
+	if (options->intra)
+	{
+		ctrl.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+		ctrl.value = options->intra;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			throw std::runtime_error("failed to set intra period");
+	}
+	if (options->inline_headers)
+	{
+		ctrl.id = V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER;
+		ctrl.value = 1;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			throw std::runtime_error("failed to set inline headers");
+	}
+
+	// Set the output and capture formats. We know exactly what they will be.
+
+	v4l2_format fmt = {};
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	fmt.fmt.pix_mp.width = info.width;
+	fmt.fmt.pix_mp.height = info.height;
+	// We assume YUV420 here, but it would be nice if we could do something
+	// like info.pixel_format.toV4L2Fourcc();
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = info.stride;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+	fmt.fmt.pix_mp.colorspace = get_v4l2_colorspace(info.colour_space);
+	fmt.fmt.pix_mp.num_planes = 1;
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set output format");
+
+	fmt = {};
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	fmt.fmt.pix_mp.width = options->width;
+	fmt.fmt.pix_mp.height = options->height;
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+	fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
+	fmt.fmt.pix_mp.num_planes = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = 0;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = 512 << 10;
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set capture format");
+
+	// Request that the necessary buffers are allocated. The output queue
+	// (input to the encoder) shares buffers from our caller, these must be
+	// DMABUFs. Buffers for the encoded bitstream must be allocated and
+	// m-mapped.
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = NUM_OUTPUT_BUFFERS;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for output buffers failed");
+	if (options->verbose)
+		std::cerr << "Got " << reqbufs.count << " output buffers" << std::endl;
+	num_input_buffers_ = reqbufs.count;
+
+	reqbufs = {};
+	reqbufs.count = NUM_CAPTURE_BUFFERS;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for capture buffers failed");
+	if (options->verbose)
+		std::cerr << "Got " << reqbufs.count << " capture buffers" << std::endl;
+	num_capture_buffers_ = reqbufs.count;
+
+	for (unsigned int i = 0; i < reqbufs.count; i++)
+	{
+		v4l2_plane planes[VIDEO_MAX_PLANES];
+		v4l2_buffer buffer = {};
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = i;
+		buffer.length = 1;
+		buffer.m.planes = planes;
+		if (xioctl(fd_, VIDIOC_QUERYBUF, &buffer) < 0)
+			throw std::runtime_error("failed to capture query buffer " + std::to_string(i));
+		buffers_[i].mem = mmap(0, buffer.m.planes[0].length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
+							   buffer.m.planes[0].m.mem_offset);
+		if (buffers_[i].mem == MAP_FAILED)
+			throw std::runtime_error("failed to mmap capture buffer " + std::to_string(i));
+		buffers_[i].size = buffer.m.planes[0].length;
+		// Whilst we're going through all the capture buffers, we may as well queue
+		// them ready for the encoder to write into.
+		if (xioctl(fd_, VIDIOC_QBUF, &buffer) < 0)
+			throw std::runtime_error("failed to queue capture buffer " + std::to_string(i));
+	}
+
+	// Enable streaming and we're done.
+
+	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start output streaming");
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start capture streaming");
+	if (options->verbose)
+		std::cerr << "Codec streaming started" << std::endl;
+}
+
+V4L2H264Device::~V4L2H264Device()
+{
+	// Turn off streaming on both the output and capture queues, and "free" the
+	// buffers that we requested. The capture ones need to be "munmapped" first.
+
+	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMOFF, &type) < 0)
+		std::cerr << "Failed to stop output streaming" << std::endl;
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMOFF, &type) < 0)
+		std::cerr << "Failed to stop capture streaming" << std::endl;
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		std::cerr << "Request to free output buffers failed" << std::endl;
+
+	for (int i = 0; i < num_capture_buffers_; i++)
+		if (munmap(buffers_[i].mem, buffers_[i].size) < 0)
+			std::cerr << "Failed to unmap buffer" << std::endl;
+	reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		std::cerr << "Request to free capture buffers failed" << std::endl;
+
+	close(fd_);
+}
+
+void V4L2H264Device::QueueInput(unsigned int index, int fd, size_t size, void *mem, int64_t timestamp_us)
+{
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	buf.index = index;
+	buf.field = V4L2_FIELD_NONE;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.length = 1;
+	buf.timestamp.tv_sec = timestamp_us / 1000000;
+	buf.timestamp.tv_usec = timestamp_us % 1000000;
+	buf.m.planes = planes;
+	buf.m.planes[0].m.fd = fd;
+	buf.m.planes[0].bytesused = size;
+	buf.m.planes[0].length = size;
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		throw std::runtime_error("failed to queue input to codec");
+}
+
+bool V4L2H264Device::DequeueInput(unsigned int &index)
+{
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.length = 1;
+	buf.m.planes = planes;
+	if (xioctl(fd_, VIDIOC_DQBUF, &buf) < 0)
+		return false;
+	index = buf.index;
+	return true;
+}
+
+bool V4L2H264Device::DequeueOutput(Output &output)
+{
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.length = 1;
+	buf.m.planes = planes;
+	if (xioctl(fd_, VIDIOC_DQBUF, &buf) < 0)
+		return false;
+	output.mem = buffers_[buf.index].mem;
+	output.bytes_used = buf.m.planes[0].bytesused;
+	output.index = buf.index;
+	output.keyframe = !!(buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+	output.timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+	return true;
+}
+
+void V4L2H264Device::QueueOutput(unsigned int index)
+{
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+	buf.length = 1;
+	buf.m.planes = planes;
+	buf.m.planes[0].bytesused = 0;
+	buf.m.planes[0].length = buffers_[index].size;
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		throw std::runtime_error("failed to re-queue encoded buffer");
+}
+
+void V4L2H264Device::ForceKeyframe()
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+	ctrl.value = 1;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+		std::cerr << "H264: failed to force a keyframe" << std::endl;
+}
+
+bool V4L2H264Device::SetBitrate(uint32_t bitrate)
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+	ctrl.value = bitrate;
+	return xioctl(fd_, VIDIOC_S_CTRL, &ctrl) == 0;
+}
+
+bool V4L2H264Device::SetFramerate(float framerate)
+{
+	// The codec only uses this for its rate control; the timestamps still say when each
+	// frame really came.
+	v4l2_streamparm parm = {};
+	parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	parm.parm.output.timeperframe.numerator = 1000;
+	parm.parm.output.timeperframe.denominator = framerate * 1000;
+	return xioctl(fd_, VIDIOC_S_PARM, &parm) == 0;
+}
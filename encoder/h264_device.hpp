@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * h264_device.hpp - the codec behind the H264Encoder.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <poll.h>
+
+#include "core/stream_info.hpp"
+#include "core/video_options.hpp"
+
+// The H264Encoder drives the codec through this, so that it needn't care whether that's
+// the V4L2 hardware codec, libx264 (--h264-device x264) or the mock one we use for testing
+// (--h264-device mock).
+//
+// Input buffers hold frames to be encoded, and come back in the order they were queued.
+// Output buffers hold the encoded bitstream, and belong to the device, which keeps them
+// queued for itself until one is dequeued, and must be queued again afterwards.
+
+class H264Device
+{
+public:
+	static H264Device *Create(VideoOptions const *options, StreamInfo const &info);
+
+	virtual ~H264Device() {}
+
+	// This polls with one of PollEvents() whenever there may be buffers to dequeue.
+	virtual int Fd() const = 0;
+	virtual short PollEvents() const { return POLLIN; }
+	virtual unsigned int NumInputBuffers() const = 0;
+	virtual void QueueInput(unsigned int index, int fd, size_t size, void *mem, int64_t timestamp_us) = 0;
+	// These return false when there's nothing to dequeue.
+	virtual bool DequeueInput(unsigned int &index) = 0;
+	struct Output
+	{
+		void *mem;
+		size_t bytes_used;
+		unsigned int index;
+		bool keyframe;
+		int64_t timestamp_us;
+	};
+	virtual bool DequeueOutput(Output &output) = 0;
+	virtual void QueueOutput(unsigned int index) = 0;
+	// Make the next frame queued a keyframe.
+	virtual void ForceKeyframe() = 0;
+	// These return false if the codec won't take the new value.
+	virtual bool SetBitrate(uint32_t bitrate) = 0;
+	virtual bool SetFramerate(float framerate) = 0;
+	// When closing, the encoder calls this until it returns true, which it must do once the
+	// codec has finished encoding any frames it has kept back (but not necessarily
+	// before they have been dequeued).
+	virtual bool Flush() { return true; }
+};
+
+// The hardware codec, through its V4L2 memory-to-memory device.
+class V4L2H264Device : public H264Device
+{
+public:
+	V4L2H264Device(VideoOptions const *options, StreamInfo const &info);
+	~V4L2H264Device();
+
+	int Fd() const override { return fd_; }
+	// Finished input buffers show as POLLOUT, and bitstream buffers as POLLIN.
+	short PollEvents() const override { return POLLIN | POLLOUT; }
+	unsigned int NumInputBuffers() const override { return num_input_buffers_; }
+	void QueueInput(unsigned int index, int fd, size_t size, void *mem, int64_t timestamp_us) override;
+	bool DequeueInput(unsigned int &index) override;
+	bool DequeueOutput(Output &output) override;
+	void QueueOutput(unsigned int index) override;
+	void ForceKeyframe() override;
+	bool SetBitrate(uint32_t bitrate) override;
+	bool SetFramerate(float framerate) override;
+
+private:
+	// We want at least as many output buffers as there are in the camera queue
+	// (we always want to be able to queue them when they arrive). Make loads
+	// of capture buffers, as this is our buffering mechanism in case of delays
+	// dealing with the output bitstream.
+	static constexpr int NUM_OUTPUT_BUFFERS = 6;
+	static constexpr int NUM_CAPTURE_BUFFERS = 12;
+
+	VideoOptions const *options_;
+	int fd_;
+	unsigned int num_input_buffers_;
+	struct BufferDescription
+	{
+		void *mem;
+		size_t size;
+	};
+	BufferDescription buffers_[NUM_CAPTURE_BUFFERS];
+	int num_capture_buffers_;
+};
@@ -7,12 +7,18 @@
 
 #pragma once
 
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
 
+#include "core/event_loop.hpp"
+
 #include "encoder.hpp"
+#include "h264_device.hpp"
 
 class H264Encoder : public Encoder
 {
@@ -21,49 +27,61 @@ public:
 	~H264Encoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, libcamera::ControlList const &metadata, int64_t timestamp_us) override;
+	bool RequestKeyframe() override;
+	bool SetBitrate(uint32_t bitrate) override { return device_->SetBitrate(bitrate); }
+	bool SetFramerate(float framerate) override { return device_->SetFramerate(framerate); }
 
 private:
-	// We want at least as many output buffers as there are in the camera queue
-	// (we always want to be able to queue them when they arrive). Make loads
-	// of capture buffers, as this is our buffering mechanism in case of delays
-	// dealing with the output bitstream.
-	static constexpr int NUM_OUTPUT_BUFFERS = 6;
-	static constexpr int NUM_CAPTURE_BUFFERS = 12;
+	// What to do with a frame when the codec has none of its input buffers free, as given
+	// by --h264-stall:
+	//   wait[:ms] - wait up to that long (default 1000ms) for one, and drop the frame if not,
+	//   drop      - drop the frame straight away,
+	//   keyframe  - drop it, and make the next frame that does get encoded a keyframe.
+	enum class StallMode
+	{
+		Wait,
+		Drop,
+		Keyframe
+	};
 
 	// This thread just sits waiting for the encoder to finish stuff. It will either:
 	// * receive "output" buffers (codec inputs), which we must return to the caller
 	// * receive encoded buffers, which we pass to the application.
 	void pollThread();
+	void dequeueOutputs();
 
 	// Handle the output buffers in another thread so as not to block the encoder. The
 	// application can take its time, after which we return this buffer to the encoder for
 	// re-use.
 	void outputThread();
 
-	bool abortPoll_;
-	bool abortOutput_;
-	int fd_;
-	struct BufferDescription
-	{
-		void *mem;
-		size_t size;
-	};
-	BufferDescription buffers_[NUM_CAPTURE_BUFFERS];
-	int num_capture_buffers_;
+	// Input buffers are returned to the caller in the order they arrived, and a dropped frame
+	// may have to wait behind those still in the codec. Call with input_mutex_ held, and make
+	// this many input done callbacks afterwards.
+	unsigned int releaseInputs();
+
+	std::unique_ptr<H264Device> device_;
+	StallMode stall_mode_;
+	std::chrono::milliseconds stall_timeout_;
+	// Wakes the poll thread to tell it we're closing.
+	EventNotifier abort_poll_;
+
+	std::mutex input_mutex_;
+	std::condition_variable input_cond_var_;
+	std::queue<unsigned int> input_buffers_available_;
+	// One for each frame the caller is still waiting to get back, oldest first, saying
+	// whether we've finished with it.
+	std::deque<bool> inputs_pending_;
+	bool keyframe_needed_ = false;
+	uint64_t stalls_ = 0;
+	uint64_t dropped_ = 0;
+	std::chrono::duration<double> stall_time_ = {};
+	std::chrono::duration<double> longest_stall_ = {};
 	std::thread poll_thread_;
-	std::mutex input_buffers_available_mutex_;
-	std::queue<int> input_buffers_available_;
-	struct OutputItem
-	{
-		void *mem;
-		size_t bytes_used;
-		size_t length;
-		unsigned int index;
-		bool keyframe;
-		int64_t timestamp_us;
-	};
-	std::queue<OutputItem> output_queue_;
+
+	std::queue<H264Device::Output> output_queue_;
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
+	bool abort_output_ = false;
 	std::thread output_thread_;
 };
@@ -24,7 +24,7 @@ static const unsigned int exif_image_offset = 20; // offset of image in JPEG buf
 static const unsigned char exif_header[] = { 0xff, 0xd8, 0xff, 0xe1 };
 
 JpegEncoder::JpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0), drop_policy_(options->encode_policy)
 {
 	output_thread_ = std::thread(&JpegEncoder::outputThread, this);
 	for (int i = 0; i < NUM_ENC_THREADS; i++)
@@ -40,6 +40,8 @@ JpegEncoder::~JpegEncoder()
 		encode_thread_[i].join();
 	abortOutput_ = true;
 	output_thread_.join();
+	if (drop_policy_.Dropped())
+		std::cerr << "JpegEncoder dropped " << drop_policy_.Dropped() << " frames" << std::endl;
 	if (options_->verbose)
 		std::cerr << "JpegEncoder closed" << std::endl;
 }
@@ -50,6 +52,15 @@ void JpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	EncodeItem item = { mem, info, metadata, timestamp_us, index_++ };
 	encode_queue_.push(item);
 	encode_cond_var_.notify_all();
+
+	while (drop_policy_.DropOldest(encode_queue_.size()))
+	{
+		OutputItem output_item = { nullptr, 0, encode_queue_.front().timestamp_us, encode_queue_.front().index };
+		encode_queue_.pop();
+		std::lock_guard<std::mutex> output_lock(output_mutex_);
+		output_queue_[NUM_ENC_THREADS].push(output_item);
+		output_cond_var_.notify_one();
+	}
 }
 
 void JpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
@@ -384,7 +395,8 @@ void JpegEncoder::outputThread()
 	got_item:
 		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
+		if (item.mem)
+			output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
 		free(item.mem);
 		index++;
 	}
@@ -12,6 +12,8 @@
 #include <queue>
 #include <thread>
 
+#include "core/drop_policy.hpp"
+
 #include "encoder.hpp"
 
 struct jpeg_compress_struct;
@@ -23,6 +25,7 @@ public:
 	~JpegEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, libcamera::ControlList const &metadata,  int64_t timestamp_us) override;
+	bool SupportsDropOldest() const override { return true; }
 
 private:
 	// How many threads to use. Whichever thread is idle will pick up the next frame.
@@ -49,6 +52,7 @@ private:
 		uint64_t index;
 	};
 	std::queue<EncodeItem> encode_queue_;
+	DropPolicy drop_policy_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
 	std::thread encode_thread_[NUM_ENC_THREADS];
@@ -61,7 +65,9 @@ private:
 		int64_t timestamp_us;
 		uint64_t index;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
+	// The extra queue is for frames that were dropped, so their input buffers still get
+	// returned in order.
+	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS + 1];
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
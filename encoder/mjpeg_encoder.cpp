@@ -6,6 +6,7 @@
  */
 
 #include <chrono>
+#include <cstring>
 #include <iostream>
 
 #include <jpeglib.h>
@@ -19,22 +20,47 @@ typedef unsigned long jpeg_mem_len_t;
 #endif
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0),
+	  sliced_(options->mjpeg_threading == "slice"), drop_policy_(options->encode_policy)
 {
-	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
+	output_thread_ = std::thread(sliced_ ? &MjpegEncoder::sliceOutputThread : &MjpegEncoder::outputThread, this);
+	num_stripes_ = options_->encode_pool ? options_->encode_pool : NUM_ENC_THREADS;
+	if (options_->encode_pool)
+		pool_ = EncodePool::Get(options_->encode_pool, options_->encode_cores, options_->verbose);
+	else if (sliced_)
+		pool_ = std::make_shared<EncodePool>(NUM_ENC_THREADS, std::vector<int>());
+	else
+	{
+		for (int i = 0; i < NUM_ENC_THREADS; i++)
+			encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
+	}
 	if (options_->verbose)
-		std::cerr << "Opened MjpegEncoder" << std::endl;
+		std::cerr << "Opened MjpegEncoder" << (sliced_ ? " in slice mode" : "") << std::endl;
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
-	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
-	abortOutput_ = true;
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		abortEncode_ = true;
+	}
+	if (pool_)
+	{
+		std::unique_lock<std::mutex> lock(encode_mutex_);
+		pool_cond_var_.wait(lock, [this] { return pool_tasks_ == 0; });
+	}
+	else
+	{
+		for (int i = 0; i < NUM_ENC_THREADS; i++)
+			encode_thread_[i].join();
+	}
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+	}
 	output_thread_.join();
+	if (drop_policy_.Dropped())
+		std::cerr << "MjpegEncoder dropped " << drop_policy_.Dropped() << " frames" << std::endl;
 	if (options_->verbose)
 		std::cerr << "MjpegEncoder closed" << std::endl;
 }
@@ -43,16 +69,55 @@ void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 {
 	std::lock_guard<std::mutex> lock(encode_mutex_);
 	EncodeItem item = { mem, info, timestamp_us, index_++ };
+	if (sliced_)
+	{
+		// Share the MCU rows (16 pixels high) out evenly, though a restart interval can't be
+		// more than 65535 MCUs.
+		unsigned int mcu_rows = (info.height + 15) / 16, mcus_per_row = (info.width + 15) / 16;
+		unsigned int stripe_mcu_rows = std::min((mcu_rows + num_stripes_ - 1) / num_stripes_, 65535 / mcus_per_row);
+		unsigned int num_stripes = (mcu_rows + stripe_mcu_rows - 1) / stripe_mcu_rows;
+
+		// The output thread mustn't see the frame until it's all filled in.
+		auto new_frame = std::make_unique<SliceFrame>();
+		SliceFrame *frame = new_frame.get();
+		frame->item = item;
+		frame->stripe_rows = stripe_mcu_rows * 16;
+		frame->buffers.resize(num_stripes);
+		frame->lengths.resize(num_stripes);
+		frame->stripes_left = num_stripes;
+		{
+			std::lock_guard<std::mutex> output_lock(output_mutex_);
+			slice_frames_.push_back(std::move(new_frame));
+		}
+		pool_tasks_ += num_stripes;
+		for (unsigned int i = 0; i < num_stripes; i++)
+			pool_->Submit(std::bind(&MjpegEncoder::encodeStripe, this, frame, i));
+		return;
+	}
 	encode_queue_.push(item);
 	encode_cond_var_.notify_all();
+	if (pool_)
+	{
+		pool_tasks_++;
+		pool_->Submit(std::bind(&MjpegEncoder::encodePooled, this));
+	}
+
+	while (drop_policy_.DropOldest(encode_queue_.size()))
+	{
+		OutputItem output_item = { nullptr, 0, encode_queue_.front().timestamp_us, encode_queue_.front().index };
+		encode_queue_.pop();
+		std::lock_guard<std::mutex> output_lock(output_mutex_);
+		output_queue_[NUM_ENC_THREADS].push(output_item);
+		output_cond_var_.notify_one();
+	}
 }
 
 void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
+							  size_t &buffer_len, unsigned int first_row, unsigned int num_rows)
 {
 	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
 	cinfo.image_width = item.info.width;
-	cinfo.image_height = item.info.height;
+	cinfo.image_height = num_rows ? num_rows : item.info.height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
 	cinfo.restart_interval = 0;
@@ -78,7 +143,9 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.info.height;)
+	for (uint8_t *Y_row = Y + first_row * item.info.stride, *U_row = U + first_row / 2 * stride2,
+				 *V_row = V + first_row / 2 * stride2;
+		 cinfo.next_scanline < cinfo.image_height;)
 	{
 		for (int i = 0; i < 16; i++, Y_row += item.info.stride)
 			y_rows[i] = std::min(Y_row, Y_max);
@@ -149,6 +216,163 @@ void MjpegEncoder::encodeThread(int num)
 	}
 }
 
+namespace
+{
+// Each pool thread encodes for every encoder, so it keeps a compressor of its own.
+struct ThreadCompressor
+{
+	ThreadCompressor()
+	{
+		cinfo.err = jpeg_std_error(&jerr);
+		jpeg_create_compress(&cinfo);
+	}
+	~ThreadCompressor() { jpeg_destroy_compress(&cinfo); }
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+};
+} // namespace
+
+void MjpegEncoder::encodePooled()
+{
+	static thread_local ThreadCompressor compressor;
+
+	// The item may have gone already if it was dropped.
+	EncodeItem encode_item;
+	bool have_item = false;
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		if (!encode_queue_.empty())
+		{
+			encode_item = encode_queue_.front();
+			encode_queue_.pop();
+			have_item = true;
+		}
+	}
+
+	if (have_item)
+	{
+		uint8_t *encoded_buffer = nullptr;
+		size_t buffer_len = 0;
+		encodeJPEG(compressor.cinfo, encode_item, encoded_buffer, buffer_len);
+
+		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		pool_output_[output_item.index] = output_item;
+		output_cond_var_.notify_one();
+	}
+
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	pool_tasks_--;
+	pool_cond_var_.notify_all();
+}
+
+void MjpegEncoder::encodeStripe(SliceFrame *frame, unsigned int stripe)
+{
+	static thread_local ThreadCompressor compressor;
+
+	unsigned int first_row = stripe * frame->stripe_rows;
+	unsigned int num_rows = std::min(frame->stripe_rows, frame->item.info.height - first_row);
+	uint8_t *encoded_buffer = nullptr;
+	size_t buffer_len = 0;
+	encodeJPEG(compressor.cinfo, frame->item, encoded_buffer, buffer_len, first_row, num_rows);
+
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		frame->buffers[stripe] = encoded_buffer;
+		frame->lengths[stripe] = buffer_len;
+		if (--frame->stripes_left == 0)
+			output_cond_var_.notify_one();
+	}
+
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	pool_tasks_--;
+	pool_cond_var_.notify_all();
+}
+
+// Return where the given marker's segment starts in the JPEG headers.
+static size_t find_marker(uint8_t const *jpeg, size_t len, uint8_t marker)
+{
+	for (size_t pos = 2; pos + 4 <= len && jpeg[pos] == 0xff; pos += 2 + (jpeg[pos + 2] << 8 | jpeg[pos + 3]))
+	{
+		if (jpeg[pos + 1] == marker)
+			return pos;
+	}
+	throw std::runtime_error("MjpegEncoder: JPEG marker " + std::to_string(marker) + " not found");
+}
+
+// Join the stripes into a single JPEG. The first one gives us the headers, which are the same
+// for all of them but for the image height, and we add a DRI segment with a restart interval
+// of a whole stripe. Then comes the entropy-coded data of each stripe in turn, with restart
+// markers (which count round from 0 to 7) in between. The decoder resets the DC predictions at
+// each restart marker, just as each stripe started afresh when it was encoded.
+static uint8_t *join_stripes(std::vector<uint8_t *> const &buffers, std::vector<size_t> const &lengths,
+							 StreamInfo const &info, unsigned int stripe_rows, size_t &joined_len)
+{
+	size_t sof = find_marker(buffers[0], lengths[0], 0xc0);
+	size_t sos = find_marker(buffers[0], lengths[0], 0xda);
+	unsigned int restart_interval = (info.width + 15) / 16 * (stripe_rows / 16);
+
+	// Where we copy each stripe from: the first keeps its SOS segment, the others start after it.
+	std::vector<size_t> data(buffers.size());
+	joined_len = sos + 6 + 2; // the DRI segment and EOI
+	for (unsigned int i = 0; i < buffers.size(); i++)
+	{
+		size_t pos = find_marker(buffers[i], lengths[i], 0xda);
+		data[i] = i ? pos + 2 + (buffers[i][pos + 2] << 8 | buffers[i][pos + 3]) : pos;
+		joined_len += lengths[i] - 2 - data[i] + (i ? 2 : 0);
+	}
+
+	uint8_t *joined = (uint8_t *)malloc(joined_len);
+	uint8_t *ptr = joined;
+	memcpy(ptr, buffers[0], sos);
+	ptr[sof + 5] = info.height >> 8, ptr[sof + 6] = info.height;
+	ptr += sos;
+	uint8_t dri[] = { 0xff, 0xdd, 0, 4, (uint8_t)(restart_interval >> 8), (uint8_t)restart_interval };
+	ptr = std::copy(dri, dri + sizeof(dri), ptr);
+	for (unsigned int i = 0; i < buffers.size(); i++)
+	{
+		if (i)
+			*ptr++ = 0xff, *ptr++ = 0xd0 + ((i - 1) & 7);
+		// Leave off the EOI, and put one on at the very end.
+		ptr = std::copy(buffers[i] + data[i], buffers[i] + lengths[i] - 2, ptr);
+	}
+	*ptr++ = 0xff, *ptr++ = 0xd9;
+	return joined;
+}
+
+void MjpegEncoder::sliceOutputThread()
+{
+	while (true)
+	{
+		std::unique_ptr<SliceFrame> frame;
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			using namespace std::chrono_literals;
+			while (slice_frames_.empty() || slice_frames_.front()->stripes_left)
+			{
+				if (abortOutput_ && slice_frames_.empty())
+					return;
+				output_cond_var_.wait_for(lock, 200ms);
+			}
+			frame = std::move(slice_frames_.front());
+			slice_frames_.pop_front();
+		}
+		input_done_callback_(nullptr);
+
+		if (frame->buffers.size() == 1)
+			output_ready_callback_(frame->buffers[0], frame->lengths[0], frame->item.timestamp_us, true);
+		else
+		{
+			size_t len;
+			uint8_t *mem = join_stripes(frame->buffers, frame->lengths, frame->item.info, frame->stripe_rows, len);
+			output_ready_callback_(mem, len, frame->item.timestamp_us, true);
+			free(mem);
+		}
+		for (uint8_t *buffer : frame->buffers)
+			free(buffer);
+	}
+}
+
 void MjpegEncoder::outputThread()
 {
 	OutputItem item;
@@ -179,7 +403,13 @@ void MjpegEncoder::outputThread()
 						goto got_item;
 					}
 				}
-				if (abort)
+				if (!pool_output_.empty() && pool_output_.begin()->first == index)
+				{
+					item = pool_output_.begin()->second;
+					pool_output_.erase(pool_output_.begin());
+					goto got_item;
+				}
+				if (abort && pool_output_.empty())
 					return;
 
 				output_cond_var_.wait_for(lock, 200ms);
@@ -188,7 +418,8 @@ void MjpegEncoder::outputThread()
 	got_item:
 		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
+		if (item.mem)
+			output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
 		free(item.mem);
 		index++;
 	}
@@ -8,10 +8,17 @@
 #pragma once
 
 #include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
+#include "core/drop_policy.hpp"
+
+#include "encode_pool.hpp"
 #include "encoder.hpp"
 
 struct jpeg_compress_struct;
@@ -23,6 +30,9 @@ public:
 	~MjpegEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, libcamera::ControlList const &metadata, int64_t timestamp_us) override;
+	// In slice mode frames go straight to the encode threads, so none are left waiting to drop.
+	bool SupportsDropOldest() const override { return !sliced_; }
+	bool RequestKeyframe() override { return true; } // they all are
 
 private:
 	// How many threads to use. Whichever thread is idle will pick up the next frame.
@@ -30,6 +40,8 @@ private:
 
 	// These threads do the actual encoding.
 	void encodeThread(int num);
+	// Or with --encode-pool, the pool threads run this once for each frame.
+	void encodePooled();
 
 	// Handle the output buffers in another thread so as not to block the encoders. The
 	// application can take its time, after which we return this buffer to the encoder for
@@ -39,6 +51,7 @@ private:
 	bool abortEncode_;
 	bool abortOutput_;
 	uint64_t index_;
+	bool sliced_;
 
 	struct EncodeItem
 	{
@@ -48,10 +61,35 @@ private:
 		uint64_t index;
 	};
 	std::queue<EncodeItem> encode_queue_;
+	DropPolicy drop_policy_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
 	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::shared_ptr<EncodePool> pool_;
+	unsigned int pool_tasks_ = 0;
+	std::condition_variable pool_cond_var_;
+	// This encodes the rows from first_row onwards, or all of them if num_rows is zero.
+	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len,
+					unsigned int first_row = 0, unsigned int num_rows = 0);
+
+	// In slice mode each frame is split into stripes of whole MCU rows, and they are joined up
+	// with restart markers in between, so the stripes can be coded independently.
+	struct SliceFrame
+	{
+		EncodeItem item;
+		unsigned int stripe_rows; // in pixels
+		std::vector<uint8_t *> buffers;
+		std::vector<size_t> lengths;
+		unsigned int stripes_left;
+	};
+	// With --mjpeg-threading slice, the pool threads run this once for each stripe of a frame
+	// instead, and this output thread joins the stripes up.
+	void encodeStripe(SliceFrame *frame, unsigned int stripe);
+	void sliceOutputThread();
+	unsigned int num_stripes_;
+	// Oldest first. Each frame is passed on once all its stripes are done, so they come out
+	// in order without any need to sort them.
+	std::deque<std::unique_ptr<SliceFrame>> slice_frames_;
 
 	struct OutputItem
 	{
@@ -60,7 +98,11 @@ private:
 		int64_t timestamp_us;
 		uint64_t index;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
+	// The extra queue is for frames that were dropped, so their input buffers still get
+	// returned in order.
+	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS + 1];
+	// Pool threads finish frames in any order, so these are kept by index instead.
+	std::map<uint64_t, OutputItem> pool_output_;
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
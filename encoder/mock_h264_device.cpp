@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * mock_h264_device.cpp - a pretend codec for testing the H264Encoder.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "mock_h264_device.hpp"
+
+MockH264Device::MockH264Device(VideoOptions const *options, StreamInfo const &info)
+	: frame_time_ms_(10), intra_(options->intra ? options->intra : 60), bitrate_(options->bitrate),
+	  framerate_(options->framerate > 0 ? options->framerate : 30)
+{
+	std::string const &device = options->h264_device;
+	if (device.size() > 5 && device[4] == ':')
+		frame_time_ms_ = std::stoul(device.substr(5));
+	else if (device != "mock")
+		throw std::runtime_error("bad mock H264 device " + device);
+
+	buffers_.resize(NUM_OUTPUT_BUFFERS, std::vector<uint8_t>(OUTPUT_SIZE));
+	for (unsigned int i = 0; i < NUM_OUTPUT_BUFFERS; i++)
+		outputs_free_.push(i);
+	if (options->verbose)
+		std::cerr << "Opened mock H264 device taking " << frame_time_ms_ << "ms per frame" << std::endl;
+
+	codec_thread_ = std::thread(&MockH264Device::codecThread, this);
+}
+
+MockH264Device::~MockH264Device()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_one();
+	codec_thread_.join();
+}
+
+void MockH264Device::QueueInput(unsigned int index, int fd, size_t size, void *mem, int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	inputs_.push({ index, timestamp_us, force_keyframe_ });
+	force_keyframe_ = false;
+	cond_var_.notify_one();
+}
+
+bool MockH264Device::DequeueInput(unsigned int &index)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (inputs_done_.empty())
+		return false;
+	index = inputs_done_.front();
+	inputs_done_.pop();
+	if (inputs_done_.empty() && outputs_done_.empty())
+		ready_.Consume();
+	return true;
+}
+
+bool MockH264Device::DequeueOutput(Output &output)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (outputs_done_.empty())
+		return false;
+	output = outputs_done_.front();
+	outputs_done_.pop();
+	if (inputs_done_.empty() && outputs_done_.empty())
+		ready_.Consume();
+	return true;
+}
+
+void MockH264Device::QueueOutput(unsigned int index)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	outputs_free_.push(index);
+	cond_var_.notify_one();
+}
+
+void MockH264Device::ForceKeyframe()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	force_keyframe_ = true;
+}
+
+bool MockH264Device::SetBitrate(uint32_t bitrate)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	bitrate_ = bitrate;
+	return true;
+}
+
+bool MockH264Device::SetFramerate(float framerate)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	framerate_ = framerate;
+	return true;
+}
+
+void MockH264Device::codecThread()
+{
+	unsigned int count = 0;
+	while (true)
+	{
+		Input input;
+		unsigned int index;
+		size_t bytes_used = 64;
+		{
+			// Like the real thing, we can't finish a frame until there's somewhere to put it.
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] { return abort_ || (!inputs_.empty() && !outputs_free_.empty()); });
+			if (abort_)
+				return;
+			input = inputs_.front();
+			inputs_.pop();
+			index = outputs_free_.front();
+			outputs_free_.pop();
+			if (bitrate_)
+				bytes_used = std::clamp<size_t>(bitrate_ / 8 / framerate_, bytes_used, OUTPUT_SIZE);
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(frame_time_ms_));
+		bool keyframe = input.keyframe || count++ % intra_ == 0;
+		if (keyframe)
+			count = 1;
+		uint8_t *mem = buffers_[index].data();
+		std::fill(mem, mem + bytes_used, 0xff);
+		mem[0] = mem[1] = mem[2] = 0, mem[3] = 1, mem[4] = keyframe ? 0x65 : 0x41;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		inputs_done_.push(input.index);
+		outputs_done_.push({ mem, bytes_used, index, keyframe, input.timestamp_us });
+		ready_.Notify();
+	}
+}
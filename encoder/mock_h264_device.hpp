@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * mock_h264_device.hpp - a pretend codec for testing the H264Encoder.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "core/event_loop.hpp"
+
+#include "h264_device.hpp"
+
+// Stands in for the hardware codec with --h264-device mock[:<ms>], taking that many
+// milliseconds over each frame (default 10) so that we can make the encoder fall behind
+// on purpose. The "bitstream" is just a start code and a NAL header for each frame, padded
+// out to suit the bitrate, which is enough for the outputs, but no decoder will make sense
+// of it.
+
+class MockH264Device : public H264Device
+{
+public:
+	MockH264Device(VideoOptions const *options, StreamInfo const &info);
+	~MockH264Device();
+
+	int Fd() const override { return ready_.Fd(); }
+	unsigned int NumInputBuffers() const override { return NUM_INPUT_BUFFERS; }
+	void QueueInput(unsigned int index, int fd, size_t size, void *mem, int64_t timestamp_us) override;
+	bool DequeueInput(unsigned int &index) override;
+	bool DequeueOutput(Output &output) override;
+	void QueueOutput(unsigned int index) override;
+	void ForceKeyframe() override;
+	bool SetBitrate(uint32_t bitrate) override;
+	bool SetFramerate(float framerate) override;
+
+private:
+	static constexpr unsigned int NUM_INPUT_BUFFERS = 6;
+	static constexpr unsigned int NUM_OUTPUT_BUFFERS = 12;
+	static constexpr size_t OUTPUT_SIZE = 64 << 10;
+
+	void codecThread();
+
+	unsigned int frame_time_ms_;
+	unsigned int intra_;
+	// Kept readable for as long as there are buffers waiting to be dequeued.
+	EventNotifier ready_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	bool abort_ = false;
+	bool force_keyframe_ = false;
+	uint32_t bitrate_;
+	float framerate_;
+	struct Input
+	{
+		unsigned int index;
+		int64_t timestamp_us;
+		bool keyframe;
+	};
+	std::queue<Input> inputs_;
+	std::queue<unsigned int> inputs_done_;
+	std::queue<unsigned int> outputs_free_;
+	std::queue<Output> outputs_done_;
+	std::vector<std::vector<uint8_t>> buffers_;
+	std::thread codec_thread_;
+};
@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * rawz_encoder.cpp - lossless compressed raw video encoder.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+
+#include <libcamera/formats.h>
+
+#include "rawz_encoder.hpp"
+
+using namespace libcamera;
+
+struct RawzFormat
+{
+	uint8_t bits;
+	uint8_t packing;
+	uint8_t bayer_order;
+};
+
+static const std::map<PixelFormat, RawzFormat> rawz_formats =
+{
+	{ formats::SRGGB8, { 8, RAWZ_PACKING_8BIT, 0 } },
+	{ formats::SGRBG8, { 8, RAWZ_PACKING_8BIT, 1 } },
+	{ formats::SBGGR8, { 8, RAWZ_PACKING_8BIT, 2 } },
+	{ formats::SGBRG8, { 8, RAWZ_PACKING_8BIT, 3 } },
+	{ formats::SRGGB10, { 10, RAWZ_PACKING_16BIT, 0 } },
+	{ formats::SGRBG10, { 10, RAWZ_PACKING_16BIT, 1 } },
+	{ formats::SBGGR10, { 10, RAWZ_PACKING_16BIT, 2 } },
+	{ formats::SGBRG10, { 10, RAWZ_PACKING_16BIT, 3 } },
+	{ formats::SRGGB12, { 12, RAWZ_PACKING_16BIT, 0 } },
+	{ formats::SGRBG12, { 12, RAWZ_PACKING_16BIT, 1 } },
+	{ formats::SBGGR12, { 12, RAWZ_PACKING_16BIT, 2 } },
+	{ formats::SGBRG12, { 12, RAWZ_PACKING_16BIT, 3 } },
+	{ formats::SRGGB10_CSI2P, { 10, RAWZ_PACKING_CSI2, 0 } },
+	{ formats::SGRBG10_CSI2P, { 10, RAWZ_PACKING_CSI2, 1 } },
+	{ formats::SBGGR10_CSI2P, { 10, RAWZ_PACKING_CSI2, 2 } },
+	{ formats::SGBRG10_CSI2P, { 10, RAWZ_PACKING_CSI2, 3 } },
+	{ formats::SRGGB12_CSI2P, { 12, RAWZ_PACKING_CSI2, 0 } },
+	{ formats::SGRBG12_CSI2P, { 12, RAWZ_PACKING_CSI2, 1 } },
+	{ formats::SBGGR12_CSI2P, { 12, RAWZ_PACKING_CSI2, 2 } },
+	{ formats::SGBRG12_CSI2P, { 12, RAWZ_PACKING_CSI2, 3 } },
+};
+
+RawzEncoder::RawzEncoder(VideoOptions const *options, StreamInfo const &info) : Encoder(options), info_(info)
+{
+	auto it = rawz_formats.find(info.pixel_format);
+	if (it == rawz_formats.end())
+		throw std::runtime_error("rawz can't encode format " + info.pixel_format.toString());
+	bits_ = it->second.bits;
+	packing_ = it->second.packing;
+	bayer_order_ = it->second.bayer_order;
+
+	num_slices_ = options->encode_pool ? options->encode_pool : std::max(std::thread::hardware_concurrency(), 1u);
+	pool_ = EncodePool::Get(num_slices_, options->encode_cores, options->verbose);
+	// An even number of rows in each slice keeps the colours in the same place.
+	slice_rows_ = ((info.height + num_slices_ - 1) / num_slices_ + 1) & ~1;
+	num_slices_ = (info.height + slice_rows_ - 1) / slice_rows_;
+
+	if (options->verbose)
+		std::cerr << "Opened RawzEncoder for " << info.width << "x" << info.height << " "
+				  << info.pixel_format.toString() << " in " << num_slices_ << " slices" << std::endl;
+	output_thread_ = std::thread(&RawzEncoder::outputThread, this);
+}
+
+RawzEncoder::~RawzEncoder()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_all();
+	// This finishes off any frames still being encoded before it goes.
+	output_thread_.join();
+	if (options_->verbose && encoded_bytes_)
+		std::cerr << "RawzEncoder closed, compressed " << raw_bytes_ << " bytes to " << encoded_bytes_ << " ("
+				  << (double)raw_bytes_ / encoded_bytes_ << ":1)" << std::endl;
+}
+
+void RawzEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, libcamera::ControlList const &metadata, int64_t timestamp_us)
+{
+	Frame *frame;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		frames_.push_back(std::make_unique<Frame>());
+		frame = frames_.back().get();
+		frame->mem = (uint8_t *)mem;
+		frame->timestamp_us = timestamp_us;
+		frame->sequence = sequence_++;
+		frame->slices.resize(num_slices_);
+		frame->slices_left = num_slices_;
+	}
+	for (unsigned int i = 0; i < num_slices_; i++)
+		pool_->Submit([this, frame, i]() { encodeSlice(*frame, i); });
+}
+
+void RawzEncoder::unpackRow(uint8_t const *src, uint16_t *dest) const
+{
+	unsigned int width = info_.width;
+	if (packing_ == RAWZ_PACKING_8BIT)
+		std::copy(src, src + width, dest);
+	else if (packing_ == RAWZ_PACKING_16BIT)
+		memcpy(dest, src, width * 2);
+	else if (bits_ == 10)
+	{
+		// As many whole groups of 4 as there are, and the last group may be partial.
+		for (unsigned int x = 0; x < width; x += 4, src += 5)
+			for (unsigned int i = 0; i < 4 && x + i < width; i++)
+				dest[x + i] = (src[i] << 2) | ((src[4] >> (i * 2)) & 3);
+	}
+	else
+	{
+		for (unsigned int x = 0; x < width; x += 2, src += 3)
+			for (unsigned int i = 0; i < 2 && x + i < width; i++)
+				dest[x + i] = (src[i] << 4) | ((src[2] >> (i * 4)) & 15);
+	}
+}
+
+void RawzEncoder::encodeSlice(Frame &frame, unsigned int slice)
+{
+	unsigned int width = info_.width;
+	unsigned int y0 = slice * slice_rows_;
+	unsigned int y1 = std::min(y0 + slice_rows_, info_.height);
+	size_t num_values = (size_t)width * (y1 - y0);
+	size_t num_blocks = (num_values + RAWZ_BLOCK_SIZE - 1) / RAWZ_BLOCK_SIZE;
+
+	// The widths go first, then the bits. No value takes more than 18 bits, and we write
+	// 4 bytes at a time, so leave room for that.
+	std::vector<uint8_t> &out = frame.slices[slice];
+	out.resize(num_blocks + num_blocks * RAWZ_BLOCK_SIZE * 18 / 8 + 8);
+	uint8_t *widths = out.data();
+	uint8_t *bits = widths + num_blocks;
+	uint64_t acc = 0;
+	unsigned int acc_bits = 0;
+
+	uint32_t block[RAWZ_BLOCK_SIZE];
+	unsigned int n = 0;
+	auto flush_block = [&]() {
+		std::fill(block + n, block + RAWZ_BLOCK_SIZE, 0);
+		uint32_t all = 0;
+		for (unsigned int i = 0; i < RAWZ_BLOCK_SIZE; i++)
+			all |= block[i];
+		unsigned int w = all ? 32 - __builtin_clz(all) : 0;
+		*widths++ = w;
+		if (w == 0)
+			return;
+		for (unsigned int i = 0; i < RAWZ_BLOCK_SIZE; i++)
+		{
+			acc |= (uint64_t)block[i] << acc_bits;
+			acc_bits += w;
+			if (acc_bits >= 32)
+			{
+				uint32_t word = acc;
+				memcpy(bits, &word, 4); // we're little-endian
+				bits += 4, acc >>= 32, acc_bits -= 32;
+			}
+		}
+	};
+
+	// The sample above is 2 rows up, so we keep the last two rows, and treat those above
+	// the slice as zero.
+	std::vector<uint16_t> rows[2] = { std::vector<uint16_t>(width), std::vector<uint16_t>(width) };
+	std::vector<uint16_t> cur(width);
+	uint8_t const *src = frame.mem + (size_t)y0 * info_.stride;
+	for (unsigned int y = 0; y < y1 - y0; y++, src += info_.stride)
+	{
+		unpackRow(src, cur.data());
+		uint16_t const *above = rows[y & 1].data();
+		int32_t left[2] = { 0, 0 };
+		for (unsigned int x = 0; x < width; x++)
+		{
+			// The prediction is left + above - above-left, or in other words, the change from
+			// the row above is predicted to be the same as it was to the left.
+			int32_t d = (int32_t)cur[x] - above[x];
+			int32_t r = d - left[x & 1];
+			left[x & 1] = d;
+			block[n++] = ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+			if (n == RAWZ_BLOCK_SIZE)
+				flush_block(), n = 0;
+		}
+		rows[y & 1].swap(cur);
+	}
+	if (n)
+		flush_block();
+	while (acc_bits > 0)
+	{
+		*bits++ = acc;
+		acc >>= 8;
+		acc_bits = acc_bits > 8 ? acc_bits - 8 : 0;
+	}
+	out.resize(bits - out.data());
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (--frame.slices_left == 0)
+		cond_var_.notify_all();
+}
+
+void RawzEncoder::outputThread()
+{
+	while (true)
+	{
+		std::unique_ptr<Frame> frame;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] {
+				return (abort_ && frames_.empty()) || (!frames_.empty() && frames_.front()->slices_left == 0);
+			});
+			if (frames_.empty())
+				return;
+			frame = std::move(frames_.front());
+			frames_.pop_front();
+		}
+		// We're done with the camera's buffer already.
+		input_done_callback_(nullptr);
+
+		RawzFrameHeader header = {};
+		memcpy(header.magic, "rzfr", 4);
+		header.num_slices = num_slices_;
+		header.frame_size = sizeof(header) + num_slices_ * sizeof(RawzSlice);
+		for (auto const &slice : frame->slices)
+			header.frame_size += slice.size();
+		header.sequence = frame->sequence;
+		header.timestamp_us = frame->timestamp_us;
+		header.width = info_.width;
+		header.height = info_.height;
+		header.fourcc = info_.pixel_format.fourcc();
+		header.bits = bits_;
+		header.packing = packing_;
+		header.bayer_order = bayer_order_;
+		header.block_size = RAWZ_BLOCK_SIZE;
+
+		record_.resize(header.frame_size);
+		uint8_t *ptr = record_.data();
+		memcpy(ptr, &header, sizeof(header));
+		ptr += sizeof(header);
+		for (unsigned int i = 0; i < num_slices_; i++, ptr += sizeof(RawzSlice))
+		{
+			unsigned int rows = std::min(slice_rows_, info_.height - i * slice_rows_);
+			RawzSlice slice = { rows, (uint32_t)frame->slices[i].size() };
+			memcpy(ptr, &slice, sizeof(slice));
+		}
+		for (auto const &slice : frame->slices)
+			ptr = std::copy(slice.begin(), slice.end(), ptr);
+
+		raw_bytes_ += (uint64_t)info_.stride * info_.height;
+		encoded_bytes_ += record_.size();
+		output_ready_callback_(record_.data(), record_.size(), frame->timestamp_us, true);
+	}
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * rawz_encoder.hpp - lossless compressed raw video encoder.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "core/rawz_format.hpp"
+
+#include "encode_pool.hpp"
+#include "encoder.hpp"
+
+// Compresses raw Bayer frames without loss (--codec rawz in libcamera-raw), leaving out the
+// stride padding. Each frame is split into slices, one for each thread of the encode pool,
+// which share the work, and the finished frames are passed on in order. The layout of what
+// comes out is described in core/rawz_format.hpp.
+
+class RawzEncoder : public Encoder
+{
+public:
+	RawzEncoder(VideoOptions const *options, StreamInfo const &info);
+	~RawzEncoder();
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, libcamera::ControlList const &metadata, int64_t timestamp_us) override;
+	bool RequestKeyframe() override { return true; } // they all are
+
+private:
+	struct Frame
+	{
+		uint8_t *mem;
+		int64_t timestamp_us;
+		uint64_t sequence;
+		std::vector<std::vector<uint8_t>> slices;
+		unsigned int slices_left;
+	};
+
+	void encodeSlice(Frame &frame, unsigned int slice);
+	void unpackRow(uint8_t const *src, uint16_t *dest) const;
+	void outputThread();
+
+	StreamInfo info_;
+	uint8_t bits_;
+	uint8_t packing_;
+	uint8_t bayer_order_;
+	unsigned int num_slices_;
+	unsigned int slice_rows_;
+	uint64_t sequence_ = 0;
+	uint64_t raw_bytes_ = 0;
+	uint64_t encoded_bytes_ = 0;
+	std::shared_ptr<EncodePool> pool_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	// Oldest first, and passed on only once all their slices are done.
+	std::deque<std::unique_ptr<Frame>> frames_;
+	bool abort_ = false;
+	std::vector<uint8_t> record_;
+	std::thread output_thread_;
+};
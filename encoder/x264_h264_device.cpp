@@ -0,0 +1,273 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * x264_h264_device.cpp - software h264 codec using libx264.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+extern "C"
+{
+#include <x264.h>
+}
+
+#include "x264_h264_device.hpp"
+
+X264H264Device::X264H264Device(VideoOptions const *options, StreamInfo const &info)
+	: options_(options), info_(info), abr_(options->bitrate != 0)
+{
+	bool sliced = options->x264_threading == "slice";
+	x264_param_t param;
+	// Slice threads are there to keep the latency down, so the "zerolatency" tuning (no
+	// lookahead) goes with them.
+	if (x264_param_default_preset(&param, options->x264_preset.c_str(), sliced ? "zerolatency" : nullptr) < 0)
+		throw std::runtime_error("no such x264 preset " + options->x264_preset);
+
+	param.i_threads = options->x264_threads ? options->x264_threads : X264_THREADS_AUTO;
+	param.b_sliced_threads = sliced;
+	param.i_width = info.width;
+	param.i_height = info.height;
+	param.i_csp = X264_CSP_I420;
+	param.i_log_level = options->verbose ? X264_LOG_WARNING : X264_LOG_NONE;
+	// Rate control follows the timestamps, so there's nothing to do when the framerate
+	// changes, though it still wants a rough idea to start with.
+	param.b_vfr_input = 1;
+	param.i_timebase_num = 1;
+	param.i_timebase_den = 1000000;
+	param.i_fps_num = options->framerate > 0 ? options->framerate * 1000 : 30000;
+	param.i_fps_den = 1000;
+	// Like the hardware codec, no B frames, so that frames come out in the order they went in.
+	param.i_bframe = 0;
+	param.b_annexb = 1;
+	param.b_repeat_headers = options->inline_headers;
+	if (options->intra)
+		param.i_keyint_max = options->intra;
+	if (abr_)
+	{
+		param.rc.i_rc_method = X264_RC_ABR;
+		param.rc.i_bitrate = options->bitrate / 1000;
+		param.rc.i_vbv_max_bitrate = param.rc.i_bitrate;
+		param.rc.i_vbv_buffer_size = param.rc.i_bitrate;
+	}
+	if (!options->level.empty())
+	{
+		static const std::map<std::string, int> level_map = { { "4", 40 }, { "4.1", 41 }, { "4.2", 42 } };
+		auto it = level_map.find(options->level);
+		if (it == level_map.end())
+			throw std::runtime_error("no such level " + options->level);
+		param.i_level_idc = it->second;
+	}
+	if (info.colour_space == libcamera::ColorSpace::Rec709)
+		param.vui.i_colorprim = param.vui.i_transfer = param.vui.i_colmatrix = 1;
+	else
+		param.vui.i_colorprim = param.vui.i_transfer = param.vui.i_colmatrix = 6; // SMPTE 170M
+	if (!options->profile.empty() && x264_param_apply_profile(&param, options->profile.c_str()) < 0)
+		throw std::runtime_error("no such profile " + options->profile);
+
+	encoder_ = x264_encoder_open(&param);
+	if (!encoder_)
+		throw std::runtime_error("failed to open x264 encoder");
+
+	if (!options->inline_headers)
+	{
+		x264_nal_t *nals;
+		int num_nals;
+		int size = x264_encoder_headers(encoder_, &nals, &num_nals);
+		if (size < 0)
+		{
+			x264_encoder_close(encoder_);
+			throw std::runtime_error("failed to get x264 headers");
+		}
+		headers_.assign(nals[0].p_payload, nals[0].p_payload + size);
+	}
+
+	x264_encoder_parameters(encoder_, &param);
+	if (options->verbose)
+		std::cerr << "Opened x264 encoder with " << param.i_threads << (sliced ? " slice" : " frame")
+				  << " threads, preset " << options->x264_preset << std::endl;
+
+	buffers_.resize(NUM_OUTPUT_BUFFERS);
+	for (unsigned int i = 0; i < NUM_OUTPUT_BUFFERS; i++)
+		outputs_free_.push(i);
+
+	encode_thread_ = std::thread(&X264H264Device::encodeThread, this);
+}
+
+X264H264Device::~X264H264Device()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_one();
+	encode_thread_.join();
+	x264_encoder_close(encoder_);
+}
+
+void X264H264Device::QueueInput(unsigned int index, int fd, size_t size, void *mem, int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	inputs_.push({ index, mem, timestamp_us, force_keyframe_ });
+	force_keyframe_ = false;
+	cond_var_.notify_one();
+}
+
+bool X264H264Device::DequeueInput(unsigned int &index)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (inputs_done_.empty())
+		return false;
+	index = inputs_done_.front();
+	inputs_done_.pop();
+	if (inputs_done_.empty() && outputs_done_.empty())
+		ready_.Consume();
+	return true;
+}
+
+bool X264H264Device::DequeueOutput(Output &output)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (outputs_done_.empty())
+		return false;
+	output = outputs_done_.front();
+	outputs_done_.pop();
+	if (inputs_done_.empty() && outputs_done_.empty())
+		ready_.Consume();
+	return true;
+}
+
+void X264H264Device::QueueOutput(unsigned int index)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	outputs_free_.push(index);
+	cond_var_.notify_one();
+}
+
+void X264H264Device::ForceKeyframe()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	force_keyframe_ = true;
+}
+
+bool X264H264Device::SetBitrate(uint32_t bitrate)
+{
+	// x264 can only change the bitrate if it started out with one.
+	if (!abr_ || bitrate < 1000)
+		return false;
+	std::lock_guard<std::mutex> lock(mutex_);
+	new_bitrate_ = bitrate;
+	return true;
+}
+
+bool X264H264Device::SetFramerate(float framerate)
+{
+	return true;
+}
+
+bool X264H264Device::Flush()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!flushing_)
+	{
+		flushing_ = true;
+		cond_var_.notify_one();
+	}
+	return flushed_;
+}
+
+void X264H264Device::encodeThread()
+{
+	unsigned int stride2 = info_.stride / 2;
+	while (true)
+	{
+		Input input = {};
+		bool have_input = false;
+		unsigned int index = 0;
+		uint32_t new_bitrate = 0;
+		{
+			// We can't take an encoded frame from x264 unless there's somewhere to put it.
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] {
+				return abort_ || (!outputs_free_.empty() && (!inputs_.empty() || (flushing_ && !flushed_)));
+			});
+			if (abort_)
+				return;
+			if (!inputs_.empty())
+			{
+				input = inputs_.front();
+				inputs_.pop();
+				have_input = true;
+			}
+			else if (x264_encoder_delayed_frames(encoder_) == 0)
+			{
+				flushed_ = true;
+				ready_.Notify(); // wake the poll thread to find out
+				continue;
+			}
+			index = outputs_free_.front();
+			outputs_free_.pop();
+			new_bitrate = new_bitrate_;
+			new_bitrate_ = 0;
+		}
+
+		if (new_bitrate)
+		{
+			x264_param_t param;
+			x264_encoder_parameters(encoder_, &param);
+			param.rc.i_bitrate = param.rc.i_vbv_max_bitrate = param.rc.i_vbv_buffer_size = new_bitrate / 1000;
+			if (x264_encoder_reconfig(encoder_, &param) < 0)
+				std::cerr << "x264: failed to change bitrate to " << new_bitrate << std::endl;
+		}
+
+		x264_nal_t *nals;
+		int num_nals;
+		x264_picture_t picture, picture_out;
+		int size;
+		if (have_input)
+		{
+			// x264 copies the frame as it takes it in, so we need only point it at the camera buffer.
+			x264_picture_init(&picture);
+			picture.img.i_csp = X264_CSP_I420;
+			picture.img.i_plane = 3;
+			picture.img.plane[0] = (uint8_t *)input.mem;
+			picture.img.plane[1] = picture.img.plane[0] + info_.stride * info_.height;
+			picture.img.plane[2] = picture.img.plane[1] + stride2 * (info_.height / 2);
+			picture.img.i_stride[0] = info_.stride;
+			picture.img.i_stride[1] = picture.img.i_stride[2] = stride2;
+			picture.i_pts = input.timestamp_us;
+			picture.i_type = input.keyframe ? X264_TYPE_IDR : X264_TYPE_AUTO;
+			size = x264_encoder_encode(encoder_, &nals, &num_nals, &picture, &picture_out);
+		}
+		else
+			size = x264_encoder_encode(encoder_, &nals, &num_nals, nullptr, &picture_out);
+		if (size < 0)
+		{
+			std::cerr << "x264: failed to encode frame" << std::endl;
+			size = 0;
+		}
+
+		// The NAL payloads follow one another in memory, but belong to x264 only until the
+		// next call.
+		std::vector<uint8_t> &buffer = buffers_[index];
+		buffer.clear();
+		if (size)
+		{
+			buffer.insert(buffer.end(), headers_.begin(), headers_.end());
+			headers_.clear();
+			buffer.insert(buffer.end(), nals[0].p_payload, nals[0].p_payload + size);
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (have_input)
+			inputs_done_.push(input.index);
+		if (size)
+			outputs_done_.push({ buffer.data(), buffer.size(), index, !!picture_out.b_keyframe, picture_out.i_pts });
+		else
+			outputs_free_.push(index);
+		ready_.Notify();
+	}
+}
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * x264_h264_device.hpp - software h264 codec using libx264.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "core/event_loop.hpp"
+
+#include "h264_device.hpp"
+
+typedef struct x264_t x264_t;
+
+// For hosts with no V4L2 codec, --h264-device x264 encodes in software. libx264 uses its
+// own threads, either working on several frames at once (--x264-threading frame, the
+// fastest) or splitting each frame into slices (--x264-threading slice, which adds no
+// latency). It reads the frames straight from the camera buffers, which come back as soon
+// as it has taken them in.
+
+class X264H264Device : public H264Device
+{
+public:
+	X264H264Device(VideoOptions const *options, StreamInfo const &info);
+	~X264H264Device();
+
+	int Fd() const override { return ready_.Fd(); }
+	unsigned int NumInputBuffers() const override { return NUM_INPUT_BUFFERS; }
+	void QueueInput(unsigned int index, int fd, size_t size, void *mem, int64_t timestamp_us) override;
+	bool DequeueInput(unsigned int &index) override;
+	bool DequeueOutput(Output &output) override;
+	void QueueOutput(unsigned int index) override;
+	void ForceKeyframe() override;
+	bool SetBitrate(uint32_t bitrate) override;
+	bool SetFramerate(float framerate) override;
+	bool Flush() override;
+
+private:
+	static constexpr unsigned int NUM_INPUT_BUFFERS = 6;
+	static constexpr unsigned int NUM_OUTPUT_BUFFERS = 12;
+
+	void encodeThread();
+
+	VideoOptions const *options_;
+	StreamInfo info_;
+	x264_t *encoder_;
+	bool abr_;
+	// Unless we want them inline, the SPS and PPS go in front of the first frame only.
+	std::vector<uint8_t> headers_;
+	// Kept readable for as long as there are buffers waiting to be dequeued.
+	EventNotifier ready_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	bool abort_ = false;
+	bool force_keyframe_ = false;
+	uint32_t new_bitrate_ = 0;
+	bool flushing_ = false;
+	bool flushed_ = false;
+	struct Input
+	{
+		unsigned int index;
+		void *mem;
+		int64_t timestamp_us;
+		bool keyframe;
+	};
+	std::queue<Input> inputs_;
+	std::queue<unsigned int> inputs_done_;
+	std::queue<unsigned int> outputs_free_;
+	std::queue<Output> outputs_done_;
+	std::vector<std::vector<uint8_t>> buffers_;
+	std::thread encode_thread_;
+};
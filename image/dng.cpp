@@ -41,7 +41,7 @@ static const std::map<PixelFormat, BayerFormat> bayer_formats =
 	{ formats::SGBRG12_CSI2P, { "GBRG-12", 12, TIFF_GBRG } },
 };
 
-static void unpack_10bit(uint8_t *src, StreamInfo const &info, uint16_t *dest)
+void unpack_10bit(uint8_t *src, StreamInfo const &info, uint16_t *dest)
 {
 	unsigned int w_align = info.width & ~3;
 	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
@@ -60,7 +60,7 @@ static void unpack_10bit(uint8_t *src, StreamInfo const &info, uint16_t *dest)
 	}
 }
 
-static void unpack_12bit(uint8_t *src, StreamInfo const &info, uint16_t *dest)
+void unpack_12bit(uint8_t *src, StreamInfo const &info, uint16_t *dest)
 {
 	unsigned int w_align = info.width & ~1;
 	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
@@ -21,6 +21,9 @@ struct StillOptions;
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_name,
 			   StillOptions const *options);
+// Full resolution YUV420 to JPEG without EXIF. The caller must free() jpeg_buffer.
+void jpeg_encode_yuv420(const uint8_t *input, StreamInfo const &info, int quality, unsigned int restart,
+						uint8_t *&jpeg_buffer, size_t &jpeg_len);
 
 // In yuv.cpp:
 void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
@@ -30,6 +33,8 @@ void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_name,
 			  StillOptions const *options);
+void unpack_10bit(uint8_t *src, StreamInfo const &info, uint16_t *dest);
+void unpack_12bit(uint8_t *src, StreamInfo const &info, uint16_t *dest);
 
 // In png.cpp:
 void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
@@ -355,6 +355,14 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	jpeg_destroy_compress(&cinfo);
 }
 
+void jpeg_encode_yuv420(const uint8_t *input, StreamInfo const &info, int quality, unsigned int restart,
+						uint8_t *&jpeg_buffer, size_t &jpeg_len)
+{
+	jpeg_mem_len_t len;
+	YUV420_to_JPEG_fast(input, info, quality, restart, jpeg_buffer, len);
+	jpeg_len = len;
+}
+
 static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 						   const unsigned int output_width, const unsigned int output_height,
 						   const int quality, const unsigned int restart, uint8_t *&jpeg_buffer,
@@ -6,8 +6,12 @@
  */
 
 #include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 
+#include <chrono>
+
 #include "net_output.hpp"
 
 NetOutput::NetOutput(VideoOptions const *options) : Output(options)
@@ -107,6 +111,8 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, u
 	if (options_->verbose)
 		std::cerr << "NetOutput: output buffer " << mem << " size " << size << "\n";
 	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
+	size_t frame_bytes = size;
+	auto start = std::chrono::steady_clock::now();
 	for (uint8_t *ptr = (uint8_t *)mem; size;)
 	{
 		size_t bytes_to_send = std::min(size, max_size);
@@ -115,4 +121,16 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, u
 		ptr += bytes_to_send;
 		size -= bytes_to_send;
 	}
+
+	if (link_stats_callback_)
+	{
+		// A send that blocks, or data piling up in the socket, both mean the link isn't
+		// keeping up.
+		int64_t send_time_us =
+			std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		int queued = 0;
+		if (ioctl(fd_, SIOCOUTQ, &queued) < 0)
+			queued = 0;
+		link_stats_callback_(send_time_us, frame_bytes, queued);
+	}
 }
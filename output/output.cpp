@@ -8,11 +8,15 @@
 #include <cinttypes>
 #include <stdexcept>
 
+#include "core/clock_sync.hpp"
+#include "core/latency_tracer.hpp"
+
 #include "circular_output.hpp"
 #include "file_output.hpp"
 #include "net_output.hpp"
 #include "image_output.hpp"
 #include "output.hpp"
+#include "rawz_output.hpp"
 
 Output::Output(VideoOptions const *options)
 	: options_(options), state_(WAITING_KEYFRAME), fp_timestamps_(nullptr), time_offset_(0), last_timestamp_(0)
@@ -22,7 +26,12 @@ Output::Output(VideoOptions const *options)
 		fp_timestamps_ = fopen(options->save_pts.c_str(), "w");
 		if (!fp_timestamps_)
 			throw std::runtime_error("Failed to open timestamp file " + options->save_pts);
-		fprintf(fp_timestamps_, "# timecode format v2\n");
+		// With a rig clock, each line also gets the frame's sensor timestamp in rig-global time,
+		// which tools like mkvmerge won't read, so we don't claim to be their format.
+		if (options->sync_serve || !options->sync_with.empty())
+			fprintf(fp_timestamps_, "# pts rig-global (ms)\n");
+		else
+			fprintf(fp_timestamps_, "# timecode format v2\n");
 	}
 
 	enable_ = !options->pause;
@@ -51,7 +60,12 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		enable_ = false;
 	}
 	if (state_ == WAITING_KEYFRAME && keyframe)
-		state_ = RUNNING, flags |= FLAG_RESTART;
+		state_ = RUNNING, flags |= FLAG_RESTART, keyframe_requested_ = false;
+	else if (state_ == WAITING_KEYFRAME && !keyframe_requested_ && keyframe_request_callback_)
+	{
+		keyframe_request_callback_();
+		keyframe_requested_ = true;
+	}
 	if (state_ != RUNNING)
 		return;
 
@@ -61,9 +75,22 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 	last_timestamp_ = timestamp_us - time_offset_;
 
 	outputBuffer(mem, size, last_timestamp_, flags);
+	LatencyTracer::Get().Record(TracePoint::OutputDone, options_->camera, timestamp_us);
 
 	// Save timestamps to a file, if that was requested.
-	if (fp_timestamps_)
+	if (fp_timestamps_ && (options_->sync_serve || !options_->sync_with.empty()))
+	{
+		fprintf(fp_timestamps_, "%" PRId64 ".%03" PRId64 " ", last_timestamp_ / 1000, last_timestamp_ % 1000);
+		// A frame from before the follower heard from the server has no rig time.
+		if (ClockSync::Get().Synced())
+		{
+			int64_t global_us = ClockSync::Get().ToGlobal(timestamp_us);
+			fprintf(fp_timestamps_, "%" PRId64 ".%03" PRId64 "\n", global_us / 1000, global_us % 1000);
+		}
+		else
+			fprintf(fp_timestamps_, "-\n");
+	}
+	else if (fp_timestamps_)
 		fprintf(fp_timestamps_, "%" PRId64 ".%03" PRId64 "\n", last_timestamp_ / 1000, last_timestamp_ % 1000);
 }
 
@@ -78,6 +105,8 @@ Output *Output::Create(VideoOptions const *options)
 		return new NetOutput(options);
 	else if (strncmp(options->output.c_str(), "jpg://", 6) == 0)
 		return new ImageOutput(options);
+	else if (options->codec == "rawz" && !options->output.empty())
+		return new RawzOutput(options);
 	else if (options->circular)
 		return new CircularOutput(options);
 	else if (!options->output.empty())
@@ -10,6 +10,7 @@
 #include <cstdio>
 
 #include <atomic>
+#include <functional>
 
 #include "core/video_options.hpp"
 
@@ -23,6 +24,14 @@ public:
 	virtual void Signal(); // a derived class might redefine what this means
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
 
+	// Called when the output is waiting for a keyframe to (re)start, so that the encoder
+	// can make one rather than leave us waiting for the next in the usual course.
+	void SetKeyframeRequestCallback(std::function<void()> callback) { keyframe_request_callback_ = callback; }
+	// Network outputs call this after every frame with how long it took to send, its size,
+	// and how many bytes the socket still had queued, so that the bitrate can be adapted.
+	typedef std::function<void(int64_t, size_t, size_t)> LinkStatsCallback;
+	void SetLinkStatsCallback(LinkStatsCallback callback) { link_stats_callback_ = callback; }
+
 protected:
 	enum Flag
 	{
@@ -32,6 +41,7 @@ protected:
 	};
 	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
 	VideoOptions const *options_;
+	LinkStatsCallback link_stats_callback_;
 
 private:
 	enum State
@@ -45,4 +55,6 @@ private:
 	FILE *fp_timestamps_;
 	int64_t time_offset_;
 	int64_t last_timestamp_;
+	std::function<void()> keyframe_request_callback_;
+	bool keyframe_requested_ = false;
 };
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * rawz_output.cpp - write compressed raw frames to a seekable file.
+ */
+
+#include <cstring>
+#include <iostream>
+
+#include "rawz_output.hpp"
+
+RawzOutput::RawzOutput(VideoOptions const *options) : Output(options), offset_(0)
+{
+	if (options->split || options->segment)
+		std::cerr << "WARNING: rawz recordings go to a single file, ignoring split/segment" << std::endl;
+	fp_ = options->output == "-" ? stdout : fopen(options->output.c_str(), "w");
+	if (!fp_)
+		throw std::runtime_error("failed to open output file " + options->output);
+	if (options->verbose)
+		std::cerr << "RawzOutput: opened output file " << options->output << std::endl;
+
+	RawzFileHeader header = { { 'r', 'a', 'w', 'z' }, RAWZ_VERSION };
+	write(&header, sizeof(header));
+}
+
+RawzOutput::~RawzOutput()
+{
+	// The index is only any use once every frame has been written, so a failure here can
+	// only be reported.
+	try
+	{
+		RawzIndexHeader header = { { 'r', 'z', 'i', 'x' }, sizeof(RawzIndexEntry), index_.size() };
+		RawzIndexFooter footer = { offset_, { 'r', 'z', 'i', 'e' }, RAWZ_VERSION };
+		write(&header, sizeof(header));
+		write(index_.data(), index_.size() * sizeof(RawzIndexEntry));
+		write(&footer, sizeof(footer));
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: rawz index not written: " << e.what() << std::endl;
+	}
+	if (fp_ != stdout)
+		fclose(fp_);
+}
+
+void RawzOutput::write(void const *mem, size_t size)
+{
+	if (size && fwrite(mem, size, 1, fp_) != 1)
+		throw std::runtime_error("failed to write output bytes");
+	offset_ += size;
+}
+
+void RawzOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// The index gets the frame's own timestamp, rather than one made continuous across
+	// pauses, and its sequence number shows where any frames were missed.
+	RawzFrameHeader header;
+	if (size < sizeof(header) || memcmp(mem, "rzfr", 4))
+		throw std::runtime_error("rawz output needs the rawz codec");
+	memcpy(&header, mem, sizeof(header));
+	index_.push_back({ header.sequence, offset_, header.timestamp_us });
+
+	if (options_->verbose)
+		std::cerr << "RawzOutput: frame " << header.sequence << " size " << size << std::endl;
+	write(mem, size);
+	if (options_->flush)
+		fflush(fp_);
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * rawz_output.hpp - write compressed raw frames to a seekable file.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "core/rawz_format.hpp"
+
+#include "output.hpp"
+
+// Writes the frames from the rawz encoder to a single file, and, when it closes, the index
+// that lets readers seek straight to any of them.
+
+class RawzOutput : public Output
+{
+public:
+	RawzOutput(VideoOptions const *options);
+	~RawzOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	void write(void const *mem, size_t size);
+	FILE *fp_;
+	uint64_t offset_;
+	std::vector<RawzIndexEntry> index_;
+};
@@ -30,81 +30,13 @@
 
 #include "image/image.hpp"
 
+#include "post_processing_stages/hdr_image.hpp"
 #include "post_processing_stages/histogram.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 #include "post_processing_stages/pwl.hpp"
 
 using Stream = libcamera::Stream;
 
-struct LpFilterConfig
-{
-	double strength; // smaller value actually smoothes more
-	Pwl threshold; // defines the level of pixel differences that will be smoothed over
-};
-
-// A TonemapPoint gives a target value within the full dynamic range where we would like
-// the given quantile (actually, inter-quantile mean) in the image's histogram to go.
-// Additionally there are limits to how much the current value can be scaled up or down.
-
-struct TonemapPoint
-{
-	double q; // quantile
-	double width; // width of inter-quantile mean there
-	double target; // where in the dynamic range to target it
-	double max_up; // maximum increase to current value (gain >= 1)
-	double max_down; // maximum decrease to current value (gain <= 1)
-	void Read(boost::property_tree::ptree const &params)
-	{
-		q = params.get<double>("q");
-		width = params.get<double>("width");
-		target = params.get<double>("target");
-		max_up = params.get<double>("max_up");
-		max_down = params.get<double>("max_down");
-	}
-};
-
-struct GlobalTonemapConfig
-{
-	std::vector<TonemapPoint> points;
-	double strength; // 1.0 follows the target tonemap, 0.0 ignores it
-};
-
-struct LocalTonemapConfig
-{
-	Pwl pos_strength; // gain applied to local contrast when brighter than neighbourhood
-	Pwl neg_strength; // gain applied to local contrast when darker than neighbourhood
-	double colour_scale; // allows colour saturation to be increased or reduced slightly
-};
-
-struct HdrConfig
-{
-	unsigned int num_frames; // number of frames to accumulate
-	LpFilterConfig lp_filter; // low pass filter settings
-	GlobalTonemapConfig global_tonemap; // global tonemap settings
-	LocalTonemapConfig local_tonemap; // settings for adding back local contrast
-	std::string jpeg_filename; // set this if you want individual jpegs saved as well
-};
-
-struct HdrImage
-{
-	HdrImage() : width(0), height(0), dynamic_range(0) {}
-	HdrImage(int w, int h, int num_pixels) : width(w), height(h), pixels(num_pixels), dynamic_range(0) {}
-	int width;
-	int height;
-	std::vector<int16_t> pixels;
-	int dynamic_range; // 1 more than the maximum pixel value
-	int16_t &P(unsigned int offset) { return pixels[offset]; }
-	int16_t P(unsigned int offset) const { return pixels[offset]; }
-	void Clear() { std::fill(pixels.begin(), pixels.end(), 0); }
-	void Accumulate(uint8_t const *src, int stride);
-	HdrImage LpFilter(LpFilterConfig const &config) const;
-	Pwl CreateTonemap(GlobalTonemapConfig const &config) const;
-	void Tonemap(HdrImage const &lp, HdrConfig const &config);
-	void Extract(uint8_t *dest, int stride) const;
-	Histogram CalculateHistogram() const;
-	void Scale(double factor);
-};
-
 static void add_Y_pixels(int16_t *dest, uint8_t const *src, int width, int stride, int height)
 {
 	for (int y = 0; y < height; y++, src += stride)
@@ -39,6 +39,8 @@ public:
 
 	void Configure() override;
 
+	void Inherit(PostProcessingStage &previous) override;
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
@@ -125,6 +127,21 @@ void MotionDetectStage::Configure()
 	motion_detected_ = false;
 }
 
+void MotionDetectStage::Inherit(PostProcessingStage &previous)
+{
+	// The reference frame is only any use if we're still looking at the same pixels.
+	MotionDetectStage &other = static_cast<MotionDetectStage &>(previous);
+	std::lock_guard<std::mutex> lock(other.mutex_);
+	if (other.stream_ != stream_ || other.roi_x_ != roi_x_ || other.roi_y_ != roi_y_ ||
+		other.roi_width_ != roi_width_ || other.roi_height_ != roi_height_ || other.config_.hskip != config_.hskip ||
+		other.config_.vskip != config_.vskip)
+		return;
+
+	previous_frame_ = other.previous_frame_;
+	first_time_ = other.first_time_;
+	motion_detected_ = other.motion_detected_;
+}
+
 bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 {
 	if (!stream_)
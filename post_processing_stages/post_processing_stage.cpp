@@ -27,6 +27,10 @@ void PostProcessingStage::Configure()
 {
 }
 
+void PostProcessingStage::Inherit(PostProcessingStage &)
+{
+}
+
 void PostProcessingStage::Start()
 {
 }
@@ -42,6 +42,10 @@ public:
 
 	virtual void Configure();
 
+	// When the post-processing is reloaded, a new stage is given the old stage of the same
+	// name, after Configure() and before Start(), so that it may take over any state.
+	virtual void Inherit(PostProcessingStage &previous);
+
 	virtual void Start();
 
 	// Return true if this request is to be dropped.
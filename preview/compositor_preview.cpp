@@ -0,0 +1,375 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Raspberry Pi (Trading) Ltd.
+ *
+ * compositor_preview.cpp - tile several streams into one YUV420 canvas.
+ */
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/dma-heap.h>
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <libcamera/formats.h>
+
+#include "core/options.hpp"
+
+#include "preview.hpp"
+
+Preview *make_drm_preview(Options const *options);
+
+// The canvas is divided into a grid of tiles, and each stream we are given is scaled into
+// its own tile. Other processes can draw into the same canvas if it's shared through
+// /dev/shm, in which case they should each be given a different first tile. Whichever
+// process has an output then shows (or writes out) the whole canvas at a fixed rate.
+// Nobody locks the shared canvas, so an occasional torn tile is possible.
+
+class CompositorPreview : public Preview
+{
+public:
+	CompositorPreview(Options const *options);
+	~CompositorPreview();
+	// Draw the buffer into our tile and give it straight back.
+	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	// The lores stream, if there is one, goes into the following tile.
+	virtual void ShowSecondary(libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	// Reset the preview window, clearing the current buffers and being ready to
+	// show new ones.
+	void Reset() override {}
+	// Images are scaled to fit their tile, so there is no limit.
+	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override { w = h = 0; }
+
+private:
+	struct CanvasHeader
+	{
+		static constexpr uint32_t MAGIC = 0x706d6f63; // "comp"
+		uint32_t magic;
+		uint32_t width;
+		uint32_t height;
+		uint32_t stride;
+		uint32_t tiles;
+	};
+	struct OutputBuffer
+	{
+		int fd = -1;
+		libcamera::Span<uint8_t> span;
+		bool busy = false;
+	};
+	void openCanvas(Options const *options);
+	void makeOutputBuffers();
+	void drawTile(unsigned int tile, libcamera::Span<uint8_t> span, StreamInfo const &info);
+	void outputThread();
+	void outputDone(int fd);
+
+	StreamInfo canvas_info_;
+	size_t canvas_size_;
+	unsigned int tiles_;
+	unsigned int columns_;
+	unsigned int first_tile_;
+	void *shm_ = nullptr;
+	size_t shm_size_ = 0;
+	std::vector<uint8_t> local_canvas_;
+	uint8_t *canvas_;
+	std::mutex canvas_mutex_;
+	// The output side, when there is one.
+	std::string output_;
+	std::unique_ptr<Preview> drm_preview_;
+	OutputBuffer output_buffers_[2];
+	int file_fd_ = -1;
+	std::chrono::microseconds period_;
+	std::thread output_thread_;
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	bool abort_ = false;
+};
+
+CompositorPreview::CompositorPreview(Options const *options) : Preview(options)
+{
+	output_ = options->composite;
+	first_tile_ = options->composite_tile;
+	tiles_ = options->composite_tiles;
+	if (!tiles_)
+		tiles_ = first_tile_ + ((options->lores_width && options->lores_height) ? 2 : 1);
+	if (first_tile_ >= tiles_)
+		throw std::runtime_error("CompositorPreview: tile " + std::to_string(first_tile_) + " is not on the canvas");
+	columns_ = std::ceil(std::sqrt(tiles_));
+
+	canvas_info_.width = options->preview_width ? options->preview_width : 1280;
+	canvas_info_.height = options->preview_height ? options->preview_height : 720;
+	if (canvas_info_.width % 2 || canvas_info_.height % 2)
+		throw std::runtime_error("CompositorPreview: expect even dimensions");
+	canvas_info_.stride = (canvas_info_.width + 63) & ~63;
+	canvas_info_.pixel_format = libcamera::formats::YUV420;
+	canvas_size_ = canvas_info_.stride * canvas_info_.height * 3 / 2;
+
+	openCanvas(options);
+
+	if (output_ == "drm")
+	{
+#if LIBDRM_PRESENT
+		drm_preview_ = std::unique_ptr<Preview>(make_drm_preview(options));
+		drm_preview_->SetDoneCallback(std::bind(&CompositorPreview::outputDone, this, std::placeholders::_1));
+		makeOutputBuffers();
+#else
+		throw std::runtime_error("CompositorPreview: drm libraries unavailable");
+#endif
+	}
+	else if (output_.compare(0, 5, "file:") == 0)
+	{
+		file_fd_ = open(output_.c_str() + 5, O_CREAT | O_WRONLY, 0644);
+		if (file_fd_ < 0)
+			throw std::runtime_error("CompositorPreview: failed to open " + output_.substr(5));
+	}
+	else if (output_ != "shm")
+		throw std::runtime_error("CompositorPreview: unknown output " + output_);
+
+	if (output_ == "shm" && !shm_)
+		throw std::runtime_error("CompositorPreview: shm output needs --composite-shm");
+
+	if (output_ != "shm")
+	{
+		period_ = std::chrono::microseconds((int64_t)(1000000 / options->composite_fps));
+		output_thread_ = std::thread(&CompositorPreview::outputThread, this);
+	}
+
+	if (options->verbose)
+		std::cerr << "Made compositor preview, " << canvas_info_.width << "x" << canvas_info_.height << " with "
+				  << tiles_ << " tiles, output " << output_ << std::endl;
+}
+
+CompositorPreview::~CompositorPreview()
+{
+	if (output_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(output_mutex_);
+			abort_ = true;
+			output_cond_var_.notify_one();
+		}
+		output_thread_.join();
+	}
+	drm_preview_.reset();
+	for (auto &buffer : output_buffers_)
+	{
+		if (buffer.fd >= 0)
+		{
+			munmap(buffer.span.data(), buffer.span.size());
+			close(buffer.fd);
+		}
+	}
+	if (file_fd_ >= 0)
+		close(file_fd_);
+	if (shm_)
+		munmap(shm_, shm_size_);
+}
+
+void CompositorPreview::openCanvas(Options const *options)
+{
+	auto clear = [this](uint8_t *canvas) {
+		memset(canvas, 16, canvas_info_.stride * canvas_info_.height);
+		memset(canvas + canvas_info_.stride * canvas_info_.height, 128, canvas_info_.stride * canvas_info_.height / 2);
+	};
+
+	if (options->composite_shm.empty())
+	{
+		local_canvas_.resize(canvas_size_);
+		canvas_ = local_canvas_.data();
+		clear(canvas_);
+		return;
+	}
+
+	// Whoever gets there first sets the canvas up. Everyone else must agree with it.
+	std::string name = "/" + options->composite_shm;
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0666);
+	if (fd < 0)
+		throw std::runtime_error("CompositorPreview: failed to open shared memory " + name);
+	shm_size_ = sizeof(CanvasHeader) + canvas_size_;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || ((size_t)st.st_size < shm_size_ && ftruncate(fd, shm_size_) < 0))
+	{
+		close(fd);
+		throw std::runtime_error("CompositorPreview: failed to size shared memory " + name);
+	}
+	shm_ = mmap(nullptr, shm_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm_ == MAP_FAILED)
+	{
+		shm_ = nullptr;
+		throw std::runtime_error("CompositorPreview: failed to map shared memory " + name);
+	}
+
+	CanvasHeader *header = static_cast<CanvasHeader *>(shm_);
+	canvas_ = static_cast<uint8_t *>(shm_) + sizeof(CanvasHeader);
+	if (header->magic != CanvasHeader::MAGIC)
+	{
+		*header = { CanvasHeader::MAGIC, canvas_info_.width, canvas_info_.height, canvas_info_.stride, tiles_ };
+		clear(canvas_);
+	}
+	else if (header->width != canvas_info_.width || header->height != canvas_info_.height ||
+			 header->tiles != tiles_)
+		throw std::runtime_error("CompositorPreview: shared canvas is " + std::to_string(header->width) + "x" +
+								 std::to_string(header->height) + " with " + std::to_string(header->tiles) + " tiles");
+}
+
+void CompositorPreview::makeOutputBuffers()
+{
+	// The display needs dmabufs, which we get from the CMA heap.
+	int heap_fd = open("/dev/dma_heap/linux,cma", O_RDWR | O_CLOEXEC);
+	if (heap_fd < 0)
+		throw std::runtime_error("CompositorPreview: failed to open dma heap");
+
+	for (auto &buffer : output_buffers_)
+	{
+		dma_heap_allocation_data alloc = {};
+		alloc.len = canvas_size_;
+		alloc.fd_flags = O_RDWR | O_CLOEXEC;
+		if (ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc) < 0)
+		{
+			close(heap_fd);
+			throw std::runtime_error("CompositorPreview: failed to allocate output buffer");
+		}
+		buffer.fd = alloc.fd;
+		void *mem = mmap(nullptr, canvas_size_, PROT_READ | PROT_WRITE, MAP_SHARED, buffer.fd, 0);
+		if (mem == MAP_FAILED)
+		{
+			close(heap_fd);
+			throw std::runtime_error("CompositorPreview: failed to map output buffer");
+		}
+		buffer.span = libcamera::Span<uint8_t>(static_cast<uint8_t *>(mem), canvas_size_);
+	}
+	close(heap_fd);
+}
+
+// Nearest neighbour resize of one plane. The source position is stepped in 16.16 fixed
+// point so that the inner loop is just a load and a store.
+static void scale_plane(uint8_t const *src, unsigned int src_stride, unsigned int src_w, unsigned int src_h,
+						uint8_t *dst, unsigned int dst_stride, unsigned int dst_w, unsigned int dst_h)
+{
+	uint32_t x_step = (src_w << 16) / dst_w, y_step = (src_h << 16) / dst_h;
+	uint32_t y_pos = y_step / 2;
+	for (unsigned int y = 0; y < dst_h; y++, y_pos += y_step, dst += dst_stride)
+	{
+		uint8_t const *src_row = src + (y_pos >> 16) * src_stride;
+		uint32_t x_pos = x_step / 2;
+		for (unsigned int x = 0; x < dst_w; x++, x_pos += x_step)
+			dst[x] = src_row[x_pos >> 16];
+	}
+}
+
+void CompositorPreview::drawTile(unsigned int tile, libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	if (tile >= tiles_)
+		return;
+	if (info.pixel_format != libcamera::formats::YUV420)
+		throw std::runtime_error("CompositorPreview: only YUV420 is supported");
+	// Fit the image into its tile, preserving the aspect ratio.
+	unsigned int rows = (tiles_ + columns_ - 1) / columns_;
+	unsigned int tile_w = (canvas_info_.width / columns_) & ~1, tile_h = (canvas_info_.height / rows) & ~1;
+	unsigned int w = tile_w, h = tile_h;
+	if (info.width * tile_h > tile_w * info.height)
+		h = (tile_w * info.height / info.width) & ~1;
+	else
+		w = (tile_h * info.width / info.height) & ~1;
+	unsigned int x0 = (tile % columns_) * tile_w + ((tile_w - w) / 2 & ~1);
+	unsigned int y0 = (tile / columns_) * tile_h + ((tile_h - h) / 2 & ~1);
+
+	unsigned int stride = canvas_info_.stride, stride2 = stride / 2;
+	uint8_t *Y = canvas_ + y0 * stride + x0;
+	uint8_t *U = canvas_ + stride * canvas_info_.height + (y0 / 2) * stride2 + x0 / 2;
+	uint8_t *V = U + stride2 * (canvas_info_.height / 2);
+
+	uint8_t const *src_Y = span.data();
+	uint8_t const *src_U = src_Y + info.stride * info.height;
+	uint8_t const *src_V = src_U + (info.stride / 2) * (info.height / 2);
+
+	std::lock_guard<std::mutex> lock(canvas_mutex_);
+	if (!canvas_info_.colour_space)
+		canvas_info_.colour_space = info.colour_space;
+	scale_plane(src_Y, info.stride, info.width, info.height, Y, stride, w, h);
+	scale_plane(src_U, info.stride / 2, info.width / 2, info.height / 2, U, stride2, w / 2, h / 2);
+	scale_plane(src_V, info.stride / 2, info.width / 2, info.height / 2, V, stride2, w / 2, h / 2);
+}
+
+void CompositorPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	drawTile(first_tile_, span, info);
+	done_callback_(fd);
+}
+
+void CompositorPreview::ShowSecondary(libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	drawTile(first_tile_ + 1, span, info);
+}
+
+void CompositorPreview::outputThread()
+{
+	auto next = std::chrono::steady_clock::now();
+	while (true)
+	{
+		next += period_;
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			if (output_cond_var_.wait_until(lock, next, [this] { return abort_; }))
+				return;
+		}
+
+		if (drm_preview_)
+		{
+			OutputBuffer *buffer = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(output_mutex_);
+				for (auto &b : output_buffers_)
+				{
+					if (!b.busy)
+					{
+						buffer = &b;
+						break;
+					}
+				}
+				if (!buffer)
+					continue; // the display is still holding both of them
+				buffer->busy = true;
+			}
+			StreamInfo info;
+			{
+				std::lock_guard<std::mutex> lock(canvas_mutex_);
+				memcpy(buffer->span.data(), canvas_, canvas_size_);
+				info = canvas_info_;
+			}
+			drm_preview_->Show(buffer->fd, buffer->span, info);
+		}
+		else if (file_fd_ >= 0)
+		{
+			std::lock_guard<std::mutex> lock(canvas_mutex_);
+			if (pwrite(file_fd_, canvas_, canvas_size_, 0) != (ssize_t)canvas_size_)
+				std::cerr << "CompositorPreview: failed to write output file" << std::endl;
+		}
+	}
+}
+
+void CompositorPreview::outputDone(int fd)
+{
+	std::lock_guard<std::mutex> lock(output_mutex_);
+	for (auto &buffer : output_buffers_)
+	{
+		if (buffer.fd == fd)
+			buffer.busy = false;
+	}
+}
+
+Preview *make_compositor_preview(Options const *options)
+{
+	return new CompositorPreview(options);
+}
@@ -30,6 +30,9 @@ public:
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) = 0;
+	// Some previews can show a second stream (the lores one) alongside the first. They
+	// must have finished with the buffer by the time this returns.
+	virtual void ShowSecondary(libcamera::Span<uint8_t> span, StreamInfo const &info) {}
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() = 0;
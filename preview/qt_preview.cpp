@@ -8,6 +8,7 @@
 #include <condition_variable>
 #include <iostream>
 #include <mutex>
+#include <optional>
 #include <thread>
 
 // This header must be before the QT headers, as the latter #defines slot and emit!
@@ -40,16 +41,26 @@ class MyWidget : public QWidget
 public:
 	MyWidget(QWidget *parent, int w, int h) : QWidget(parent), size(w, h)
 	{
-		image = QImage(size, QImage::Format_RGB888);
-		image.fill(0);
+		for (auto &image : images)
+		{
+			image = QImage(size, QImage::Format_RGB888);
+			image.fill(0);
+		}
 	}
 	QSize size;
-	QImage image;
+	// We draw into one image while Qt paints the other. When a new frame is ready, the
+	// images are swapped and it stays "pending" until it has actually been painted.
+	QImage images[2];
+	int front = 0;
+	bool pending = false;
+	std::mutex mutex;
 protected:
 	void paintEvent(QPaintEvent *) override
 	{
 		QPainter painter(this);
-		painter.drawImage(rect(), image, image.rect());
+		std::lock_guard<std::mutex> lock(mutex);
+		painter.drawImage(rect(), images[front], images[front].rect());
+		pending = false;
 	}
 	QSize sizeHint() const override { return size; }
 };
@@ -75,25 +86,90 @@ public:
 	}
 	~QtPreview()
 	{
+		if (options_->verbose && frames_skipped_)
+			std::cerr << "Qt preview skipped " << frames_skipped_ << " frames" << std::endl;
 		application_->exit();
 		thread_.join();
 	}
 	void SetInfoText(const std::string &text) override { main_window_->setWindowTitle(QString::fromStdString(text)); }
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override
 	{
-		// Cache the x sampling locations for speed. This is a quick nearest neighbour resize.
-		if (last_image_width_ != info.width)
+		// If Qt still hasn't painted the last frame there's no point making another one, so
+		// just skip this frame.
+		int back;
 		{
-			last_image_width_ = info.width;
-			x_locations_.resize(window_width_);
-			for (unsigned int i = 0; i < window_width_; i++)
-				x_locations_[i] = (i * (info.width - 1) + (window_width_ - 1) / 2) / (window_width_ - 1);
+			std::lock_guard<std::mutex> lock(pane_->mutex);
+			back = 1 - pane_->front;
+			if (pane_->pending)
+			{
+				frames_skipped_++;
+				done_callback_(fd);
+				return;
+			}
 		}
 
+		if (last_image_width_ != info.width || last_image_height_ != info.height ||
+			last_colour_space_ != info.colour_space)
+			makeTables(info);
+
+		// The downscale is a nearest neighbour resize, reading only the pixels we need, and the
+		// conversion is done in fixed point through the lookup tables.
 		uint8_t *Y_start = span.data();
 		uint8_t *U_start = Y_start + info.stride * info.height;
-		int uv_size = (info.stride / 2) * (info.height / 2);
-		uint8_t *dest = pane_->image.bits();
+		uint8_t *V_start = U_start + (info.stride / 2) * (info.height / 2);
+		QImage &image = pane_->images[back];
+		for (unsigned int y = 0; y < window_height_; y++)
+		{
+			uint8_t const *Y_row = Y_start + y_rows_[y] * info.stride;
+			uint8_t const *U_row = U_start + (y_rows_[y] / 2) * (info.stride / 2);
+			uint8_t const *V_row = V_start + (y_rows_[y] / 2) * (info.stride / 2);
+			uint8_t *dest = image.scanLine(y);
+			for (unsigned int x = 0; x < window_width_; x++)
+			{
+				int Y = y_table_[Y_row[x_locations_[x]]];
+				int U = U_row[x_locations_[x] >> 1], V = V_row[x_locations_[x] >> 1];
+				*(dest++) = clip_[(Y + rv_table_[V]) >> FIXED_SHIFT];
+				*(dest++) = clip_[(Y + gu_table_[U] + gv_table_[V]) >> FIXED_SHIFT];
+				*(dest++) = clip_[(Y + bu_table_[U]) >> FIXED_SHIFT];
+			}
+		}
+
+		// Return the buffer to the camera system as soon as we've finished reading it.
+		done_callback_(fd);
+
+		{
+			std::lock_guard<std::mutex> lock(pane_->mutex);
+			pane_->front = back;
+			pane_->pending = true;
+		}
+		QMetaObject::invokeMethod(pane_, "update", Qt::QueuedConnection);
+	}
+	// Reset the preview window, clearing the current buffers and being ready to
+	// show new ones.
+	void Reset() override {}
+	// Check if preview window has been shut down.
+	bool Quit() override { return main_window_->quit; }
+	// There is no particular limit to image sizes, though large images will be very slow.
+	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override { w = h = 0; }
+
+private:
+	// Fixed point fractional bits in the conversion tables.
+	static constexpr int FIXED_SHIFT = 10;
+	static constexpr int CLIP_OFFSET = 512; // the tables produce values from about -300 to 560
+
+	void makeTables(StreamInfo const &info)
+	{
+		last_image_width_ = info.width;
+		last_image_height_ = info.height;
+		last_colour_space_ = info.colour_space;
+
+		// Cache the sampling locations for the resize.
+		x_locations_.resize(window_width_);
+		for (unsigned int i = 0; i < window_width_; i++)
+			x_locations_[i] = (i * (info.width - 1) + (window_width_ - 1) / 2) / (window_width_ - 1);
+		y_rows_.resize(window_height_);
+		for (unsigned int i = 0; i < window_height_; i++)
+			y_rows_[i] = (i * (info.height - 1) + (window_height_ - 1) / 2) / (window_height_ - 1);
 
 		// Choose the right matrix to convert YUV back to RGB.
 		static const float YUV2RGB[3][9] = {
@@ -102,71 +178,31 @@ public:
 			{ 1.164, 0.0, 1.793, 1.164, -0.213, -0.533, 1.164, 2.112, 0.0 }, // Rec709
 		};
 		const float *M = YUV2RGB[0];
+		int y_offset = 0;
 		if (info.colour_space == libcamera::ColorSpace::Jpeg)
 			M = YUV2RGB[0];
 		else if (info.colour_space == libcamera::ColorSpace::Smpte170m)
-			M = YUV2RGB[1];
+			M = YUV2RGB[1], y_offset = 16;
 		else if (info.colour_space == libcamera::ColorSpace::Rec709)
-			M = YUV2RGB[2];
+			M = YUV2RGB[2], y_offset = 16;
 		else
 			std::cerr << "QtPreview: unexpected colour space " << libcamera::ColorSpace::toString(info.colour_space)
 					  << std::endl;
 
-		// Possibly this should be locked in case a repaint is happening? In practice the risk
-		// is only that there might be some tearing, so I don't think we worry. We could speed
-		// it up by getting the ISP to supply RGB, but I'm not sure I want to handle that extra
-		// possibility in our main application code, so we'll put up with the slow conversion.
-		for (unsigned int y = 0; y < window_height_; y++)
+		// The clip table absorbs the offset, so the lookups above index it directly.
+		int one = 1 << FIXED_SHIFT;
+		for (int i = 0; i < 256; i++)
 		{
-			int row = (y * (info.height - 1) + (window_height_ - 1) / 2) / (window_height_ - 1);
-			uint8_t *Y_row = Y_start + row * info.stride;
-			uint8_t *U_row = U_start + (row / 2) * (info.stride / 2);
-			uint8_t *V_row = U_row + uv_size;
-			for (unsigned int x = 0; x < window_width_;)
-			{
-				int y_off0 = x_locations_[x++];
-				int y_off1 = x_locations_[x++];
-				int uv_off0 = y_off0 >> 1;
-				int uv_off1 = y_off0 >> 1;
-				int Y0 = Y_row[y_off0];
-				int Y1 = Y_row[y_off1];
-				int U0 = U_row[uv_off0];
-				int V0 = V_row[uv_off0];
-				int U1 = U_row[uv_off1];
-				int V1 = V_row[uv_off1];
-				U0 -= 128;
-				V0 -= 128;
-				U1 -= 128;
-				V1 -= 128;
-				int R0 = M[0] * Y0 + M[2] * V0;
-				int G0 = M[3] * Y0 + M[4] * U0 + M[5] * V0;
-				int B0 = M[6] * Y0 + M[7] * U0;
-				int R1 = M[0] * Y1 + M[2] * V1;
-				int G1 = M[3] * Y1 + M[4] * U1 + M[5] * V1;
-				int B1 = M[6] * Y1 + M[7] * U1;
-				*(dest++) = std::clamp(R0, 0, 255);
-				*(dest++) = std::clamp(G0, 0, 255);
-				*(dest++) = std::clamp(B0, 0, 255);
-				*(dest++) = std::clamp(R1, 0, 255);
-				*(dest++) = std::clamp(G1, 0, 255);
-				*(dest++) = std::clamp(B1, 0, 255);
-			}
+			y_table_[i] = M[0] * (i - y_offset) * one + CLIP_OFFSET * one + one / 2;
+			rv_table_[i] = M[2] * (i - 128) * one;
+			gu_table_[i] = M[4] * (i - 128) * one;
+			gv_table_[i] = M[5] * (i - 128) * one;
+			bu_table_[i] = M[7] * (i - 128) * one;
 		}
-
-		pane_->update();
-
-		// Return the buffer to the camera system.
-		done_callback_(fd);
+		for (int i = 0; i < (int)sizeof(clip_); i++)
+			clip_[i] = std::clamp(i - CLIP_OFFSET, 0, 255);
 	}
-	// Reset the preview window, clearing the current buffers and being ready to
-	// show new ones.
-	void Reset() override {}
-	// Check if preview window has been shut down.
-	bool Quit() override { return main_window_->quit; }
-	// There is no particular limit to image sizes, though large images will be very slow.
-	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override { w = h = 0; }
 
-private:
 	void threadFunc(Options const *options)
 	{
 		// This acts as Qt's event loop. Really Qt prefers to own the application's event loop
@@ -192,7 +228,13 @@ private:
 	MyWidget *pane_ = nullptr;
 	std::thread thread_;
 	std::vector<uint16_t> x_locations_;
+	std::vector<uint16_t> y_rows_;
+	int y_table_[256], rv_table_[256], gu_table_[256], gv_table_[256], bu_table_[256];
+	uint8_t clip_[2 * CLIP_OFFSET + 256];
 	unsigned int last_image_width_ = 0;
+	unsigned int last_image_height_ = 0;
+	std::optional<libcamera::ColorSpace> last_colour_space_;
+	unsigned int frames_skipped_ = 0;
 	unsigned int window_width_, window_height_;
 	std::mutex mutex_;
 	std::condition_variable cond_var_;
@@ -0,0 +1,75 @@
+#!/usr/bin/python3
+#
+# libcamera-apps frame export client
+# Copyright (C) 2022, Raspberry Pi Ltd.
+#
+# Connects to an application run with --export, prints the metadata for each
+# frame it is sent and acknowledges it. Use it as a starting point for your own
+# consumers.
+import argparse
+import mmap
+import os
+import socket
+import struct
+import time
+
+HELLO = struct.Struct('<6I12I')
+FRAME = struct.Struct('<IIQqqqfffffI')
+ACK = struct.Struct('<IIQ')
+HELLO_MAGIC = 0x4c43454f
+FRAME_MAGIC = 0x4d524646
+ACK_MAGIC = 0x4b434146
+
+
+def fourcc_to_string(fourcc):
+    return ''.join(chr((fourcc >> (8 * i)) & 0xff) for i in range(4))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='libcamera-apps frame export client')
+    parser.add_argument('socket', help='Socket path given to --export')
+    parser.add_argument('-n', '--frames', type=int, default=0, help='Stop after this many frames (0 for never)')
+    parser.add_argument('-d', '--delay', type=float, default=0, help='Seconds to hold each frame, to test backpressure')
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    sock.connect(args.socket)
+
+    msg, fds, _, _ = socket.recv_fds(sock, HELLO.size, 1)
+    hello = HELLO.unpack(msg)
+    if hello[0] != HELLO_MAGIC:
+        raise RuntimeError('bad hello message')
+    memfd_mode, num_streams, num_slots, slot_size = hello[2:6]
+    streams = [hello[6 + 6 * i: 12 + 6 * i] for i in range(num_streams)]
+    for width, height, stride, fourcc, size, offset in streams:
+        print(f'Stream {width}x{height} stride {stride} {fourcc_to_string(fourcc)} size {size}')
+    ring = mmap.mmap(fds[0], num_slots * slot_size, prot=mmap.PROT_READ) if memfd_mode else None
+
+    count = 0
+    while args.frames == 0 or count < args.frames:
+        msg, fds, _, _ = socket.recv_fds(sock, FRAME.size, len(streams))
+        if not msg:
+            break
+        (magic, slot, sequence, timestamp, exposure, duration,
+         again, dgain, rgain, bgain, lux, num_fds) = FRAME.unpack(msg)
+        if magic != FRAME_MAGIC:
+            raise RuntimeError('bad frame message')
+        # A consumer would map the dmabufs, or read the ring slot, here.
+        if ring:
+            y_mean = sum(ring[slot * slot_size: slot * slot_size + streams[0][2]]) / streams[0][2]
+        else:
+            with mmap.mmap(fds[0], streams[0][4], prot=mmap.PROT_READ) as buf:
+                y_mean = sum(buf[:streams[0][2]]) / streams[0][2]
+        print(f'#{sequence} ts {timestamp} exp {exposure} dur {duration} ag {again:.2f} dg {dgain:.2f} '
+              f'gains {rgain:.2f},{bgain:.2f} lux {lux:.0f} first row mean {y_mean:.1f}')
+        for fd in fds:
+            os.close(fd)
+        time.sleep(args.delay)
+        sock.send(ACK.pack(ACK_MAGIC, 0, sequence))
+        count += 1
+
+    print(f'Received {count} frames')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,143 @@
+#!/usr/bin/python3
+#
+# libcamera-apps stitching LUT generator
+# Copyright (C) 2022, Raspberry Pi Ltd.
+#
+# Makes the remap LUT that libcamera-vid --stitch uses to project the frames from
+# the cameras of a rig into one equirectangular panorama. The rig is described by
+# a calibration JSON file like this one, for two fisheye cameras back to back:
+#
+# {
+#     "panorama": { "width": 1024, "height": 512 },
+#     "feather": 10,
+#     "cameras": [
+#         { "width": 640, "height": 480, "model": "fisheye", "fov": 200, "yaw": 0 },
+#         { "width": 640, "height": 480, "model": "fisheye", "fov": 200, "yaw": 180 }
+#     ]
+# }
+#
+# Cameras are listed in the order given to --cameras. The model is "fisheye"
+# (equidistant) or "rectilinear", and the fov is across the width of the image
+# unless a "focal" length in pixels is given. "yaw", "pitch" and "roll" (in
+# degrees) say where each camera points, and "cx" and "cy" where its optical
+# centre is in the image (the middle, by default). Where cameras overlap, each
+# one's weight falls to nothing over the last "feather" degrees of its field of
+# view.
+import argparse
+import json
+import math
+import struct
+import sys
+
+try:
+    import numpy as np
+except ImportError:
+    print('Error: numpy is not installed, please install with "pip3 install numpy"')
+    sys.exit(1)
+
+LUT_MAGIC = 0x746c7165
+LUT_VERSION = 1
+NO_CAMERA = 0xff
+WEIGHT_ONE = 128
+ENTRY = np.dtype([('x', '<u2'), ('y', '<u2'), ('camera', 'u1'), ('weight', 'u1')])
+
+
+def rotation(yaw, pitch, roll):
+    yaw, pitch, roll = (math.radians(a) for a in (yaw, pitch, roll))
+    ry = np.array([[math.cos(yaw), 0, math.sin(yaw)], [0, 1, 0], [-math.sin(yaw), 0, math.cos(yaw)]])
+    rx = np.array([[1, 0, 0], [0, math.cos(pitch), -math.sin(pitch)], [0, math.sin(pitch), math.cos(pitch)]])
+    rz = np.array([[math.cos(roll), -math.sin(roll), 0], [math.sin(roll), math.cos(roll), 0], [0, 0, 1]])
+    return ry @ rx @ rz
+
+
+def project(camera, directions, feather):
+    # Returns where each direction lands in the camera's image, and its weight there (zero
+    # for directions the camera can't see).
+    width, height = camera['width'], camera['height']
+    model = camera.get('model', 'fisheye')
+    half_fov = math.radians(camera.get('fov', 180)) / 2
+    cx, cy = camera.get('cx', width / 2), camera.get('cy', height / 2)
+    d = directions @ rotation(camera.get('yaw', 0), camera.get('pitch', 0), camera.get('roll', 0))
+    theta = np.arccos(np.clip(d[..., 2], -1, 1))
+    if model == 'fisheye':
+        focal = camera.get('focal', (width / 2) / half_fov)
+        phi = np.arctan2(d[..., 1], d[..., 0])
+        x, y = cx + focal * theta * np.cos(phi), cy + focal * theta * np.sin(phi)
+    elif model == 'rectilinear':
+        focal = camera.get('focal', (width / 2) / math.tan(min(half_fov, math.radians(89))))
+        z = np.maximum(d[..., 2], 1e-6)
+        x, y = cx + focal * d[..., 0] / z, cy + focal * d[..., 1] / z
+    else:
+        raise RuntimeError(f'unknown camera model {model}')
+    # Pixel centres are at integer coordinates for the bilinear sampling.
+    x, y = x - 0.5, y - 0.5
+    inside = (theta < half_fov) & (x >= 0) & (y >= 0) & (x <= width - 1) & (y <= height - 1)
+    if model == 'rectilinear':
+        inside &= d[..., 2] > 0
+    weight = np.clip((half_fov - theta) / max(math.radians(feather), 1e-6), 0, 1) * inside
+    return x, y, weight
+
+
+def make_lut(calibration):
+    width, height = calibration['panorama']['width'], calibration['panorama']['height']
+    if width % 2 or height % 2:
+        raise RuntimeError('panorama width and height must be even')
+    cameras = calibration['cameras']
+    feather = calibration.get('feather', 10)
+
+    # Camera coordinates are x right, y down and z forward.
+    lon = (np.arange(width) + 0.5) / width * 2 * math.pi - math.pi
+    lat = math.pi / 2 - (np.arange(height) + 0.5) / height * math.pi
+    lon, lat = np.meshgrid(lon, lat)
+    directions = np.stack([np.cos(lat) * np.sin(lon), -np.sin(lat), np.cos(lat) * np.cos(lon)], axis=-1)
+
+    projections = [project(camera, directions, feather) for camera in cameras]
+    weights = np.stack([w for _, _, w in projections])
+    xs = np.stack([x for x, _, _ in projections])
+    ys = np.stack([y for _, y, _ in projections])
+
+    # Keep the two cameras with the most weight at each pixel.
+    best = np.argsort(-weights, axis=0)[:2]
+    lut = np.zeros((height, width, 2), dtype=ENTRY)
+    best_weights = np.take_along_axis(weights, best, axis=0)
+    total = np.maximum(best_weights.sum(axis=0), 1e-9)
+    first_weight = np.rint(WEIGHT_ONE * best_weights[0] / total).astype(np.int32)
+    for k in range(2):
+        camera_width = np.array([c['width'] for c in cameras])[best[k]]
+        camera_height = np.array([c['height'] for c in cameras])[best[k]]
+        x = np.clip(np.take_along_axis(xs, best[k:k + 1], axis=0)[0], 0, camera_width - 1 - 1 / 16)
+        y = np.clip(np.take_along_axis(ys, best[k:k + 1], axis=0)[0], 0, camera_height - 1 - 1 / 16)
+        weight = first_weight if k == 0 else WEIGHT_ONE - first_weight
+        used = (best_weights[k] > 0) & (weight > 0)
+        lut[..., k]['x'] = np.where(used, np.rint(x * 16), 0)
+        lut[..., k]['y'] = np.where(used, np.rint(y * 16), 0)
+        lut[..., k]['camera'] = np.where(used, best[k], NO_CAMERA)
+        lut[..., k]['weight'] = np.where(used, weight, 0)
+    # A pixel that only the second camera reaches after rounding is given entirely to it.
+    only_second = (lut[..., 0]['camera'] == NO_CAMERA) & (lut[..., 1]['camera'] != NO_CAMERA)
+    lut[only_second, 0] = lut[only_second, 1]
+    lut[..., 0]['weight'][only_second] = WEIGHT_ONE
+    lut[only_second, 1] = (0, 0, NO_CAMERA, 0)
+    # And where only the first camera is left, it gets all the weight.
+    only_first = (lut[..., 0]['camera'] != NO_CAMERA) & (lut[..., 1]['camera'] == NO_CAMERA)
+    lut[..., 0]['weight'][only_first] = WEIGHT_ONE
+    return width, height, lut
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='libcamera-apps stitching LUT generator')
+    parser.add_argument('calibration', help='Calibration JSON file describing the rig', type=str)
+    parser.add_argument('output', help='LUT file to write, for libcamera-vid --stitch', type=str)
+    args = parser.parse_args()
+
+    with open(args.calibration) as f:
+        calibration = json.load(f)
+    width, height, lut = make_lut(calibration)
+    with open(args.output, 'wb') as f:
+        f.write(struct.pack('<5I', LUT_MAGIC, LUT_VERSION, width, height, len(calibration['cameras'])))
+        for camera in calibration['cameras']:
+            f.write(struct.pack('<2I', camera['width'], camera['height']))
+        f.write(lut.tobytes())
+    coverage = (lut[..., 0]['camera'] != NO_CAMERA).mean()
+    overlap = (lut[..., 1]['camera'] != NO_CAMERA).mean()
+    print(f'{width}x{height} panorama, {coverage * 100:.1f}% covered, {overlap * 100:.1f}% blended')
@@ -0,0 +1,69 @@
+#!/usr/bin/python3
+#
+# libcamera-apps frame metadata reader
+# Copyright (C) 2022, Raspberry Pi Ltd.
+#
+# Reads the --metadata-out files written by libcamera-vid and friends, in either
+# the binary or the JSON lines format, and prints them as CSV or JSON lines.
+import argparse
+import json
+import math
+import struct
+import sys
+
+HEADER = struct.Struct('<4I' + '32s' * 8)
+RECORD = struct.Struct('<QqiI6f8d')
+MAGIC = 0x6372646d
+FIELDS = ['sequence', 'timestamp_ns', 'exposure_time', 'colour_temperature', 'analogue_gain',
+          'digital_gain', 'red_gain', 'blue_gain', 'lux', 'focus']
+
+
+def read_binary(f, file):
+    magic, version, record_size, num_values, *names = HEADER.unpack(f.read(HEADER.size))
+    if magic != MAGIC:
+        raise RuntimeError(f'{file} is not a metadata file')
+    if version != 1 or record_size < RECORD.size:
+        raise RuntimeError(f'{file} has unsupported version {version}')
+    names = [name.split(b'\0')[0].decode() for name in names[:num_values]]
+    while True:
+        data = f.read(record_size)
+        if len(data) < record_size:
+            break
+        fields = RECORD.unpack(data[:RECORD.size])
+        record = dict(zip(FIELDS, fields))
+        for name, value in zip(names, fields[len(FIELDS):]):
+            record[name] = None if math.isnan(value) else value
+        yield record
+
+
+def read_json(f):
+    for line in f:
+        record = json.loads(line)
+        record['red_gain'], record['blue_gain'] = record.pop('colour_gains')
+        yield record
+
+
+def read_metadata(file):
+    with open(file, 'rb') as f:
+        if f.peek(4)[:4] == struct.pack('<I', MAGIC):
+            yield from read_binary(f, file)
+        else:
+            yield from read_json(f)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='libcamera-apps frame metadata reader')
+    parser.add_argument('filename', help='File written with --metadata-out', type=str)
+    parser.add_argument('--json', '-j', help='Print JSON lines rather than CSV', action='store_true')
+    args = parser.parse_args()
+
+    count = 0
+    for record in read_metadata(args.filename):
+        if args.json:
+            print(json.dumps(record))
+        else:
+            if not count:
+                print(','.join(record.keys()))
+            print(','.join('' if value is None else str(value) for value in record.values()))
+        count += 1
+    sys.exit(0 if count else 1)
@@ -0,0 +1,163 @@
+#!/usr/bin/python3
+#
+# libcamera-apps rawz decoder
+# Copyright (C) 2022, Raspberry Pi Ltd.
+#
+# Reads the compressed raw files written by libcamera-raw --codec rawz, and writes the
+# frames back out just as the camera gave them, less the padding at the end of each row,
+# or unpacked to 16 bits a sample. The layout is described in core/rawz_format.hpp.
+import argparse
+import struct
+import sys
+
+import numpy as np
+
+FILE_HEADER = struct.Struct('<4sI')
+FRAME_HEADER = struct.Struct('<4sIQQqIII4B')
+SLICE = struct.Struct('<II')
+INDEX_HEADER = struct.Struct('<4sIQ')
+INDEX_ENTRY = struct.Struct('<QQq')
+INDEX_FOOTER = struct.Struct('<Q4sI')
+PACKING_8BIT, PACKING_CSI2, PACKING_16BIT = range(3)
+BAYER_ORDERS = ['RGGB', 'GRBG', 'BGGR', 'GBRG']
+
+
+def decode_slice(data, width, rows, block_size):
+    num_values = width * rows
+    num_blocks = -(-num_values // block_size)
+    widths = np.frombuffer(data, np.uint8, num_blocks).astype(np.int64)
+    # No value has more than 18 bits, so each is found within the 4 bytes from the one it
+    # starts in.
+    bits = np.frombuffer(data[num_blocks:] + bytes(4), np.uint8).astype(np.uint32)
+    value_widths = np.repeat(widths, block_size)
+    starts = np.cumsum(value_widths) - value_widths
+    byte = starts >> 3
+    words = bits[byte] | bits[byte + 1] << 8 | bits[byte + 2] << 16 | bits[byte + 3] << 24
+    values = (words.astype(np.int64) >> (starts & 7)) & ((1 << value_widths) - 1)
+    residuals = (values[:num_values] >> 1) ^ -(values[:num_values] & 1)
+
+    # Undo the prediction from the same colour to the left and above, a row at a time.
+    residuals = residuals.reshape(rows, width)
+    diffs = np.empty_like(residuals)
+    diffs[:, 0::2] = np.cumsum(residuals[:, 0::2], axis=1)
+    diffs[:, 1::2] = np.cumsum(residuals[:, 1::2], axis=1)
+    image = np.empty_like(diffs)
+    image[0::2] = np.cumsum(diffs[0::2], axis=0)
+    image[1::2] = np.cumsum(diffs[1::2], axis=0)
+    return image.astype(np.uint16)
+
+
+def pack(image, bits, packing):
+    if packing == PACKING_8BIT:
+        return image.astype(np.uint8).tobytes()
+    elif packing == PACKING_16BIT:
+        return image.astype('<u2').tobytes()
+    # MIPI CSI-2 packing puts the top 8 bits of each sample in a byte of its own, and then
+    # the remaining bits for the group in one more byte.
+    group = 4 if bits == 10 else 2
+    low_bits = bits - 8
+    height, width = image.shape
+    padded = np.zeros((height, -(-width // group) * group), np.uint16)
+    padded[:, :width] = image
+    groups = padded.reshape(height, -1, group)
+    low = ((groups & ((1 << low_bits) - 1)) << (np.arange(group) * low_bits)).sum(axis=2)
+    return np.concatenate([(groups >> low_bits).astype(np.uint8), low[..., None].astype(np.uint8)], axis=2).tobytes()
+
+
+class RawzFile:
+    def __init__(self, filename):
+        self.f = open(filename, 'rb')
+        magic, version = FILE_HEADER.unpack(self.f.read(FILE_HEADER.size))
+        if magic != b'rawz':
+            raise RuntimeError(f'{filename} is not a rawz file')
+        if version != 1:
+            raise RuntimeError(f'{filename} has unsupported version {version}')
+        self.f.seek(0, 2)
+        self.size = self.f.tell()
+        self.index = self.read_index()
+        if self.index is None:
+            print(f'{filename} has no index, finding the frames instead', file=sys.stderr)
+            self.index = self.find_frames()
+
+    def read_index(self):
+        if self.size < FILE_HEADER.size + INDEX_HEADER.size + INDEX_FOOTER.size:
+            return None
+        self.f.seek(self.size - INDEX_FOOTER.size)
+        offset, magic, _ = INDEX_FOOTER.unpack(self.f.read(INDEX_FOOTER.size))
+        if magic != b'rzie' or offset > self.size - INDEX_HEADER.size - INDEX_FOOTER.size:
+            return None
+        self.f.seek(offset)
+        magic, entry_size, count = INDEX_HEADER.unpack(self.f.read(INDEX_HEADER.size))
+        if magic != b'rzix' or offset + INDEX_HEADER.size + count * entry_size + INDEX_FOOTER.size != self.size:
+            return None
+        data = self.f.read(count * entry_size)
+        return [INDEX_ENTRY.unpack_from(data, i * entry_size) for i in range(count)]
+
+    def find_frames(self):
+        # Follow the frames from the start. The last one may have been cut short.
+        index = []
+        offset = FILE_HEADER.size
+        while offset + FRAME_HEADER.size <= self.size:
+            self.f.seek(offset)
+            magic, _, frame_size, sequence, timestamp_us, *_ = FRAME_HEADER.unpack(self.f.read(FRAME_HEADER.size))
+            if magic != b'rzfr' or offset + frame_size > self.size:
+                break
+            index.append((sequence, offset, timestamp_us))
+            offset += frame_size
+        return index
+
+    def __len__(self):
+        return len(self.index)
+
+    def header(self, n):
+        self.f.seek(self.index[n][1])
+        header = FRAME_HEADER.unpack(self.f.read(FRAME_HEADER.size))
+        if header[0] != b'rzfr':
+            raise RuntimeError(f'frame {n} is not where the index says')
+        return header
+
+    def read(self, n):
+        """Return the header fields and the image, as a height x width array of samples."""
+        _, num_slices, frame_size, sequence, timestamp_us, width, height, fourcc, bits, packing, order, \
+            block_size = self.header(n)
+        data = self.f.read(frame_size - FRAME_HEADER.size)
+        pos = num_slices * SLICE.size
+        images = []
+        for i in range(num_slices):
+            rows, size = SLICE.unpack_from(data, i * SLICE.size)
+            images.append(decode_slice(data[pos:pos + size], width, rows, block_size))
+            pos += size
+        info = dict(sequence=sequence, timestamp_us=timestamp_us, width=width, height=height, bits=bits,
+                    packing=packing, bayer_order=BAYER_ORDERS[order], frame_size=frame_size)
+        return info, np.concatenate(images)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='libcamera-apps rawz decoder')
+    parser.add_argument('filename', help='File written with libcamera-raw --codec rawz', type=str)
+    parser.add_argument('--output', '-o', help='Write the frames here, one after another, or one per file if the '
+                        'name has a %%d in it. Without this, just list them.', type=str)
+    parser.add_argument('--frame', '-f', help='Only this frame (counting from 0)', type=int)
+    parser.add_argument('--unpack', '-u', help='Write 16 bits per sample, rather than packed as the camera had them',
+                        action='store_true')
+    args = parser.parse_args()
+
+    rawz = RawzFile(args.filename)
+    frames = range(len(rawz)) if args.frame is None else [args.frame]
+    if not args.output:
+        for n in frames:
+            _, _, frame_size, sequence, timestamp_us, width, height, _, bits, _, order, _ = rawz.header(n)
+            print(f'frame {n} sequence {sequence} timestamp {timestamp_us}us {width}x{height} '
+                  f'{BAYER_ORDERS[order]}-{bits} size {frame_size}')
+        sys.exit(0 if len(frames) else 1)
+
+    out = None if '%' in args.output else open(args.output, 'wb')
+    for n in frames:
+        info, image = rawz.read(n)
+        data = pack(image, info['bits'], PACKING_16BIT if args.unpack else info['packing'])
+        if out:
+            out.write(data)
+        else:
+            with open(args.output % n, 'wb') as f:
+                f.write(data)
+    sys.exit(0 if len(frames) else 1)
@@ -0,0 +1,74 @@
+#!/usr/bin/python3
+#
+# libcamera-apps rig frame matcher
+# Copyright (C) 2022, Raspberry Pi Ltd.
+#
+# Reads the --save-pts files written by the nodes of a rig run with --sync-serve
+# and --sync-with, and groups the frames whose rig-global timestamps lie within
+# a tolerance of each other, so that each group holds the same moment seen from
+# every node.
+import argparse
+import sys
+
+
+def read_global_times(file):
+    # Each line is "pts rig-global" in milliseconds, and the rig time is "-" for
+    # frames from before the node first heard from the clock server.
+    with open(file) as f:
+        header = f.readline()
+        if not header.startswith('# pts rig-global'):
+            raise RuntimeError(f'{file} has no rig-global timestamps, was it recorded with --sync-with?')
+        times = []
+        for index, line in enumerate(f):
+            fields = line.split()
+            if len(fields) == 2 and fields[1] != '-':
+                times.append((index, float(fields[1])))
+        return times
+
+
+def match(nodes, tolerance):
+    # Like the FrameGrouper in libcamera-vid: the oldest frames are grouped if they are
+    # all close enough to the newest of them, otherwise those too old to ever be part of
+    # a group are discarded.
+    heads = [0] * len(nodes)
+    groups = []
+    unmatched = [0] * len(nodes)
+    while all(head < len(times) for head, times in zip(heads, nodes)):
+        fronts = [times[head] for head, times in zip(heads, nodes)]
+        newest = max(time for _, time in fronts)
+        complete = True
+        for i, (_, time) in enumerate(fronts):
+            if time < newest - tolerance:
+                heads[i] += 1
+                unmatched[i] += 1
+                complete = False
+        if complete:
+            groups.append(fronts)
+            heads = [head + 1 for head in heads]
+    for i, times in enumerate(nodes):
+        unmatched[i] += len(times) - heads[i]
+    return groups, unmatched
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='libcamera-apps rig frame matcher')
+    parser.add_argument('filenames', nargs='+', help='PTS files, one from each node', type=str)
+    parser.add_argument('--tolerance', '-t', help='Most rig-global time between frames in a group (ms)',
+                        type=float, default=5.0)
+    parser.add_argument('--list', '-l', help='List the frame index from each file for every group',
+                        action='store_true')
+    args = parser.parse_args()
+
+    nodes = [read_global_times(file) for file in args.filenames]
+    groups, unmatched = match(nodes, args.tolerance)
+
+    spreads = [max(t for _, t in group) - min(t for _, t in group) for group in groups]
+    if args.list:
+        for group, spread in zip(groups, spreads):
+            print(f'{group[0][1]:.3f}', *[index for index, _ in group], f'spread {spread:.3f}')
+    print(f'Groups: {len(groups)}')
+    for file, count in zip(args.filenames, unmatched):
+        print(f'Unmatched in {file}: {count}')
+    if spreads:
+        print(f'Spread: average {sum(spreads) / len(spreads):.3f} ms, maximum {max(spreads):.3f} ms')
+    sys.exit(0 if groups else 1)
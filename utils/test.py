@@ -15,8 +15,11 @@ import argparse
 import json
 import os
 import os.path
+import re
+import signal
 import subprocess
 import sys
+import time
 from timeit import default_timer as timer
 
 
@@ -31,7 +34,7 @@ def check_exists(file, preamble):
         raise TestFailure(preamble + ": " + file + " not found")
 
 
-def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', 'log.txt')):
+def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', '.rawz', 'log.txt')):
     for file in os.listdir(dir):
         if file.endswith(exts):
             os.remove(os.path.join(dir, file))
@@ -107,6 +110,55 @@ def test_hello(exe_dir, output_dir):
     check_retcode(retcode, "test_hello: flips test")
     check_time(time_taken, 1.8, 6, "test_hello: flips test")
 
+    # "preview fps test". Limit the preview frame rate and see if it blows up.
+    print("    preview fps test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '2000', '--preview-fps', '10'], logfile)
+    check_retcode(retcode, "test_hello: preview fps test")
+    check_time(time_taken, 1.8, 6, "test_hello: preview fps test")
+
+    # "composite test". Tile the viewfinder and lores streams into a canvas written to a file.
+    print("    composite test")
+    output_yuv = os.path.join(output_dir, 'composite.yuv')
+    retcode, time_taken = run_executable(
+        [executable, '-t', '2000', '--lores-width', '320', '--lores-height', '240', '--preview', '0,0,640,480',
+         '--composite', 'file:' + output_yuv], logfile)
+    check_retcode(retcode, "test_hello: composite test")
+    check_time(time_taken, 1.8, 6, "test_hello: composite test")
+    check_size(output_yuv, 640 * 480 * 3 // 2, "test_hello: composite test")
+
+    # "export test". Export frames through a socket and check a client can receive them.
+    for mode in ('dmabuf', 'memfd'):
+        print("    export test", mode)
+        socket_path = os.path.join(output_dir, 'export.sock')
+        with open(os.path.join(output_dir, 'export_log.txt'), 'w') as export_log:
+            p = subprocess.Popen([executable, '-t', '4000', '--export', socket_path, '--export-mode', mode],
+                                 stdout=export_log, stderr=subprocess.STDOUT)
+            time.sleep(2)
+            client = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'export_client.py')
+            retcode, time_taken = run_executable([sys.executable, client, socket_path, '-n', '10'], logfile)
+            p.communicate()
+        check_retcode(retcode, "test_hello: export test " + mode)
+        check_retcode(p.returncode, "test_hello: export test " + mode)
+        check_time(time_taken, 0, 2, "test_hello: export test " + mode)
+
+    # "exposure share test". One camera publishes its exposure and another follows it.
+    print("    exposure share test")
+    socket_path = os.path.join(output_dir, 'exposure.sock')
+    with open(os.path.join(output_dir, 'exposure_log.txt'), 'w') as master_log:
+        p = subprocess.Popen([executable, '-t', '4000', '--frame-source', 'synthetic', '--shutter', '20000',
+                              '--gain', '4', '--exposure-publish', socket_path],
+                             stdout=master_log, stderr=subprocess.STDOUT)
+        time.sleep(1)
+        retcode, time_taken = run_executable([executable, '-t', '2000', '--frame-source', 'synthetic',
+                                              '--exposure-follow', socket_path], logfile)
+        p.communicate()
+    check_retcode(retcode, "test_hello: exposure share test")
+    check_retcode(p.returncode, "test_hello: exposure share test")
+    with open(logfile) as log:
+        if "Followed the master's exposure" not in log.read():
+            raise TestFailure("test_hello: exposure share test failed, follower never heard from the master")
+
     print("libcamera-hello tests passed")
 
 
@@ -321,6 +373,219 @@ def test_vid(exe_dir, output_dir):
     check_size(output_h264, 1024, "test_vid: timestamp test")
     check_timestamps(output_timestamps, "test_vid: timestamp test")
 
+    # "synthetic test". Encode frames from the synthetic frame source as fast as we can.
+    print("    synthetic test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '--frame-source',
+                                          'synthetic', '--framerate', '0', '-o', 'jpg://' + output_mjpeg], logfile)
+    check_retcode(retcode, "test_vid: synthetic test")
+    check_time(time_taken, 2, 6, "test_vid: synthetic test")
+    check_size(output_mjpeg, 1024, "test_vid: synthetic test")
+
+    # "latency trace test". Check that tracing the frame latencies doesn't upset anything.
+    print("    latency trace test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '--trace-latency',
+                                          '--trace-interval', '1', '-o', 'jpg://' + output_mjpeg], logfile)
+    check_retcode(retcode, "test_vid: latency trace test")
+    check_time(time_taken, 2, 6, "test_vid: latency trace test")
+    check_size(output_mjpeg, 1024, "test_vid: latency trace test")
+    with open(logfile) as log:
+        log_text = log.read()
+    if "Latency (last 1s" not in log_text:
+        raise TestFailure("test_vid: latency trace test failed, no live summary")
+    if not re.search(r'^Latency report \(ms\)', log_text, re.M) or \
+       not re.search(r'^ +total +mean .*\n +<\d+:\d+', log_text, re.M):
+        raise TestFailure("test_vid: latency trace test failed, no per-stage histogram")
+
+    # "buffer count test". Run with fewer buffers than usual, reporting any shortage.
+    print("    buffer count test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--buffer-count', '4', '--buffer-report',
+                                          '--codec', 'mjpeg', '-o', 'jpg://' + output_mjpeg], logfile)
+    check_retcode(retcode, "test_vid: buffer count test")
+    check_time(time_taken, 2, 6, "test_vid: buffer count test")
+    check_size(output_mjpeg, 1024, "test_vid: buffer count test")
+    with open(logfile) as log:
+        if not re.search(r'At most \d+ of \d+ buffers were held', log.read()):
+            raise TestFailure("test_vid: buffer count test failed, no buffer report")
+
+    # "drop policy test". A slow MJPEG encoder should shed frames rather than fall behind.
+    print("    drop policy test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '--frame-source',
+                                          'synthetic', '--framerate', '0', '--encode-policy', 'drop-oldest:2',
+                                          '-o', 'jpg://' + output_mjpeg], logfile)
+    check_retcode(retcode, "test_vid: drop policy test")
+    check_time(time_taken, 2, 6, "test_vid: drop policy test")
+    check_size(output_mjpeg, 1024, "test_vid: drop policy test")
+    with open(logfile) as log:
+        if "MjpegEncoder dropped" not in log.read():
+            raise TestFailure("test_vid: drop policy test failed, no frames dropped")
+
+    # "mjpeg slice test". The encode threads share each frame, which comes out as one JPEG.
+    print("    mjpeg slice test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '--mjpeg-threading',
+                                          'slice', '-o', 'jpg://' + output_mjpeg], logfile)
+    check_retcode(retcode, "test_vid: mjpeg slice test")
+    check_time(time_taken, 2, 6, "test_vid: mjpeg slice test")
+    check_size(output_mjpeg, 1024, "test_vid: mjpeg slice test")
+    # The file holds the last frame, which should be a single JPEG with a restart interval,
+    # and a restart marker between each pair of stripes.
+    with open(output_mjpeg, 'rb') as f:
+        jpeg = f.read()
+    if not jpeg.startswith(b'\xff\xd8') or not jpeg.endswith(b'\xff\xd9') or jpeg.count(b'\xff\xd8') != 1:
+        raise TestFailure("test_vid: mjpeg slice test failed, output is not a single JPEG")
+    if b'\xff\xdd' not in jpeg or not re.search(b'\xff[\xd0-\xd7]', jpeg):
+        raise TestFailure("test_vid: mjpeg slice test failed, no restart markers joining the stripes")
+
+    # "h264 stall test". A codec far too slow for the frame rate must make the encoder drop
+    # frames, and report it, rather than fail.
+    print("    h264 stall test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--frame-source', 'synthetic',
+                                          '--h264-device', 'mock:100', '--h264-stall', 'keyframe'], logfile)
+    check_retcode(retcode, "test_vid: h264 stall test")
+    check_time(time_taken, 2, 6, "test_vid: h264 stall test")
+    with open(logfile) as log:
+        if "H264Encoder stalled" not in log.read():
+            raise TestFailure("test_vid: h264 stall test failed, no stalls reported")
+
+    # "software h264 test". With --h264-device x264 libx264 does the encoding, if we were built
+    # with it, and the stream must start with the SPS. The circular buffer is big enough never to
+    # wrap, and it writes the whole stream to the file named.
+    print("    software h264 test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--h264-device', 'x264',
+                                          '--x264-threading', 'slice', '--circular', '32', '-o', output_h264],
+                                         logfile)
+    with open(logfile) as log:
+        not_built = "not built with libx264" in log.read()
+    if not_built:
+        print("    - skipped, no libx264")
+    else:
+        check_retcode(retcode, "test_vid: software h264 test")
+        check_time(time_taken, 2, 6, "test_vid: software h264 test")
+        check_size(output_h264, 1024, "test_vid: software h264 test")
+        with open(output_h264, 'rb') as f:
+            if f.read(5) != b'\x00\x00\x00\x01\x67':
+                raise TestFailure("test_vid: software h264 test failed, stream doesn't start with an SPS")
+
+    # "encoder control test". Pausing and resuming the output must ask the encoder for a
+    # keyframe, rather than wait for the next one, and the bitrate may adapt as it streams.
+    print("    encoder control test")
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '3000', '--frame-source', 'synthetic', '--h264-device', 'mock',
+                              '--intra', '1000', '--signal', '-b', '4000000', '--adaptive-bitrate', '1000000',
+                              '-v', '-o', 'udp://127.0.0.1:45300'], stdout=log, stderr=subprocess.STDOUT)
+        for _ in range(2):
+            time.sleep(1)
+            p.send_signal(signal.SIGUSR1)
+        p.communicate()
+    check_retcode(p.returncode, "test_vid: encoder control test")
+    with open(logfile) as log:
+        if "keyframe requested" not in log.read():
+            raise TestFailure("test_vid: encoder control test failed, no keyframe requested on resuming")
+
+    # "signal test". SIGUSR2 must stop the recording straight away, rather than at the timeout.
+    print("    signal test")
+    start_time = timer()
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '10000', '--signal', '--codec', 'mjpeg',
+                              '-o', 'jpg://' + output_mjpeg], stdout=log, stderr=subprocess.STDOUT)
+        time.sleep(2)
+        p.send_signal(signal.SIGUSR2)
+        p.communicate()
+    check_retcode(p.returncode, "test_vid: signal test")
+    check_time(timer() - start_time, 2, 5, "test_vid: signal test")
+    check_size(output_mjpeg, 1024, "test_vid: signal test")
+
+    # "multi camera test". Record two synthetic cameras at once through a shared encode pool,
+    # grouping their frames by timestamp. Each should produce its own output file.
+    print("    multi camera test")
+    output_multi = os.path.join(output_dir, 'multi#.mjpeg')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--frame-source', 'synthetic',
+                                          '--cameras', '0,1', '--codec', 'mjpeg', '--encode-pool', '4',
+                                          '--group-tolerance', '40000', '-o', 'jpg://' + output_multi], logfile)
+    check_retcode(retcode, "test_vid: multi camera test")
+    check_time(time_taken, 2, 8, "test_vid: multi camera test")
+    check_size(output_multi.replace('#', '0'), 1024, "test_vid: multi camera test")
+    check_size(output_multi.replace('#', '1'), 1024, "test_vid: multi camera test")
+
+    # "stitch test". Stitch two synthetic cameras, back to back, into a panorama.
+    print("    stitch test")
+    calibration = os.path.join(output_dir, 'calibration.json')
+    lut = os.path.join(output_dir, 'stitch.lut')
+    output_pano = os.path.join(output_dir, 'pano.yuv')
+    with open(calibration, 'w') as f:
+        json.dump({'panorama': {'width': 512, 'height': 256}, 'feather': 10,
+                   'cameras': [{'width': 640, 'height': 480, 'model': 'fisheye', 'fov': 200, 'yaw': yaw}
+                               for yaw in (0, 180)]}, f)
+    make_lut = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'make_stitch_lut.py')
+    retcode, time_taken = run_executable([sys.executable, make_lut, calibration, lut], logfile)
+    check_retcode(retcode, "test_vid: stitch test (making the LUT)")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--frame-source', 'synthetic',
+                                          '--cameras', '0,1', '--group-tolerance', '40000', '--stitch', lut,
+                                          '--stitch-output', 'jpg://' + output_pano], logfile)
+    check_retcode(retcode, "test_vid: stitch test")
+    check_time(time_taken, 2, 8, "test_vid: stitch test")
+    check_size(output_pano, 512 * 256 * 3 // 2, "test_vid: stitch test")
+
+    # "sync test". Two processes on this host act as the nodes of a rig, one serving the clock
+    # over loopback and the other following it, and their frames must match up afterwards.
+    print("    sync test")
+    pts_files = [os.path.join(output_dir, f'sync{i}.pts') for i in range(2)]
+    sync_options = [['--sync-serve', '45123'], ['--sync-with', '127.0.0.1:45123', '--sync-interval', '200']]
+    with open(logfile, 'w') as log:
+        nodes = [subprocess.Popen([executable, '-t', '3000', '--frame-source', 'synthetic', '--save-pts', pts] + opts,
+                                  stdout=log, stderr=subprocess.STDOUT)
+                 for pts, opts in zip(pts_files, sync_options)]
+        for node in nodes:
+            node.communicate()
+            check_retcode(node.returncode, "test_vid: sync test")
+    matcher = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'sync_match.py')
+    retcode, time_taken = run_executable([sys.executable, matcher, '-t', '40'] + pts_files, logfile)
+    check_retcode(retcode, "test_vid: sync test")
+
+    # "scheduled start test". As above, but the server schedules the start and both nodes must
+    # report the phase of their first frame, and then keep in phase.
+    print("    scheduled start test")
+    sync_options = [['--sync-serve', '45124', '--start-delay', '1500'],
+                    ['--sync-with', '127.0.0.1:45124', '--sync-interval', '200', '--wait-start']]
+    node_logs = [os.path.join(output_dir, f'start_log{i}.txt') for i in range(2)]
+    nodes = []
+    for node_log, opts in zip(node_logs, sync_options):
+        with open(node_log, 'w') as log:
+            nodes.append(subprocess.Popen([executable, '-t', '2000', '--frame-source', 'synthetic',
+                                           '--phase-lock', '30'] + opts, stdout=log, stderr=subprocess.STDOUT))
+    for node, node_log in zip(nodes, node_logs):
+        node.communicate()
+        check_retcode(node.returncode, "test_vid: scheduled start test")
+        with open(node_log) as log:
+            if "First frame" not in log.read():
+                raise TestFailure("test_vid: scheduled start test failed, no first frame phase in " + node_log)
+
+    # "start timeout test". With no clock server to give it a start time, a node must give up
+    # rather than wait for ever.
+    print("    start timeout test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--frame-source', 'synthetic', '--sync-with',
+                                          '127.0.0.1:45125', '--wait-start', '--wait-start-timeout', '1000'],
+                                         logfile)
+    if not retcode:
+        raise TestFailure("test_vid: start timeout test failed, no error without a start time")
+    check_time(time_taken, 1, 5, "test_vid: start timeout test")
+    with open(logfile) as log:
+        if "no start time from the clock server" not in log.read():
+            raise TestFailure("test_vid: start timeout test failed, no start timeout reported")
+
+    # "metadata test". Write the frame metadata in both formats, and check that each reads back.
+    print("    metadata test")
+    read_metadata = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'metadata_read.py')
+    for format in ('binary', 'json'):
+        output_metadata = os.path.join(output_dir, 'metadata.' + format)
+        retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
+                                              '-o', 'jpg://' + output_mjpeg, '--metadata-out', output_metadata,
+                                              '--metadata-format', format], logfile)
+        check_retcode(retcode, "test_vid: metadata test")
+        check_time(time_taken, 2, 6, "test_vid: metadata test")
+        check_size(output_metadata, 1024, "test_vid: metadata test")
+        retcode, time_taken = run_executable([sys.executable, read_metadata, output_metadata], logfile)
+        check_retcode(retcode, "test_vid: metadata test (reading " + format + ")")
+
     print("libcamera-vid tests passed")
 
 
@@ -340,9 +605,86 @@ def test_raw(exe_dir, output_dir):
     check_time(time_taken, 2, 8, "test_vid: raw test")
     check_size(output_raw, 1024, "test_vid: raw test")
 
+    # "rawz test". Compress the frames without loss, and check that they decode to the
+    # size the camera gave them (less the stride padding), finding them with the index.
+    print("    rawz test")
+    output_rawz = os.path.join(output_dir, 'test.rawz')
+    output_decoded = os.path.join(output_dir, 'decoded.raw')
+    decode = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'rawz_decode.py')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'rawz', '-o', output_rawz],
+                                         logfile)
+    check_retcode(retcode, "test_vid: rawz test")
+    check_time(time_taken, 2, 8, "test_vid: rawz test")
+    check_size(output_rawz, 1024, "test_vid: rawz test")
+    retcode, time_taken = run_executable([sys.executable, decode, output_rawz, '--frame', '0', '-o', output_decoded],
+                                         logfile)
+    check_retcode(retcode, "test_vid: rawz test (decoding)")
+    with open(logfile) as log:
+        if "no index" in log.read():
+            raise TestFailure("test_vid: rawz test failed, no index written")
+    check_size(output_decoded, 1024, "test_vid: rawz test")
+
     print("libcamera-raw tests passed")
 
 
+def test_still_stream(exe_dir, output_dir):
+    executable = os.path.join(exe_dir, 'libcamera-still-stream')
+    output_mjpeg = os.path.join(output_dir, 'trigger.mjpeg')
+    logfile = os.path.join(output_dir, 'log.txt')
+    print("Testing", executable)
+    check_exists(executable, 'test_still_stream')
+    clean_dir(output_dir)
+
+    # "retro trigger test". Simulated triggers must each select a frame that was being exposed at the time.
+    print("    retro trigger test")
+    retcode, time_taken = run_executable([executable, '-t', '3000', '--codec', 'mjpeg', '--buffer-count', '10',
+                                          '--trigger-history', '4', '--trigger-simulate', '200',
+                                          '-o', 'jpg://' + output_mjpeg], logfile)
+    check_retcode(retcode, "test_still_stream: retro trigger test")
+    check_time(time_taken, 2, 8, "test_still_stream: retro trigger test")
+    check_size(output_mjpeg, 1024, "test_still_stream: retro trigger test")
+    if open(logfile, 'r').read().find('selected frame') < 0:
+        raise TestFailure("test_still_stream: retro trigger test - no frames were selected")
+
+    # "trigger history limit test". A history that would hold every buffer must be refused.
+    print("    trigger history limit test")
+    retcode, time_taken = run_executable([executable, '-t', '3000', '--codec', 'mjpeg', '--buffer-count', '4',
+                                          '--trigger-history', '4', '-o', 'jpg://' + output_mjpeg], logfile)
+    if not retcode or open(logfile, 'r').read().find('raise --buffer-count') < 0:
+        raise TestFailure("test_still_stream: trigger history limit test - too long a history was not refused")
+
+    # "monitor test". Full resolution stills on each trigger, while the lores stream is encoded
+    # all the time. Both must come out.
+    print("    monitor test")
+    output_still = os.path.join(output_dir, 'still.jpg')
+    output_monitor = os.path.join(output_dir, 'monitor.mjpeg')
+    retcode, time_taken = run_executable([executable, '-t', '3000', '--codec', 'jpeg', '--width', '2028',
+                                          '--height', '1520', '--buffer-count', '10', '--trigger-history', '4',
+                                          '--trigger-simulate', '500', '--monitor', 'jpg://' + output_monitor,
+                                          '--lores-width', '640', '--lores-height', '480',
+                                          '-o', 'jpg://' + output_still], logfile)
+    check_retcode(retcode, "test_still_stream: monitor test")
+    check_time(time_taken, 2, 8, "test_still_stream: monitor test")
+    check_size(output_still, 1024, "test_still_stream: monitor test")
+    check_size(output_monitor, 1024, "test_still_stream: monitor test")
+
+    # "trigger log test". Log the simulated triggers, and check the log reads back with
+    # every trigger's frame written.
+    print("    trigger log test")
+    output_log = os.path.join(output_dir, 'trigger.log')
+    retcode, time_taken = run_executable([executable, '-t', '3000', '--codec', 'jpeg', '--buffer-count', '10',
+                                          '--trigger-history', '4', '--trigger-simulate', '200',
+                                          '--trigger-log', output_log, '-o', 'jpg://' + output_still], logfile)
+    check_retcode(retcode, "test_still_stream: trigger log test")
+    check_time(time_taken, 2, 8, "test_still_stream: trigger log test")
+    check_size(output_log, 48 + 56 * 5, "test_still_stream: trigger log test")
+    merge = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'trigger_merge.py')
+    retcode, time_taken = run_executable([sys.executable, merge, output_log], logfile)
+    check_retcode(retcode, "test_still_stream: trigger log test")
+
+    print("libcamera-still-stream tests passed")
+
+
 def test_post_processing(exe_dir, output_dir, json_dir):
     logfile = os.path.join(output_dir, 'log.txt')
     print("Testing post-processing")
@@ -360,6 +702,20 @@ def test_post_processing(exe_dir, output_dir, json_dir):
     check_retcode(retcode, "test_post_processing: negate test")
     check_time(time_taken, 2, 8, "test_post_processing: negate test")
 
+    # "reload test". Send SIGHUP to libcamera-vid so that it reloads the stages while running.
+    print("    reload test")
+    executable = os.path.join(exe_dir, 'libcamera-vid')
+    check_exists(executable, 'post-processing')
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '3000', '--post-process-file', json_file],
+                             stdout=log, stderr=subprocess.STDOUT)
+        time.sleep(1.5)
+        p.send_signal(signal.SIGHUP)
+        p.communicate()
+    check_retcode(p.returncode, "test_post_processing: reload test")
+    if open(logfile, 'r').read().find('Reloaded post-processing') < 0:
+        raise TestFailure("test_post_processing: reload test - stages were not reloaded")
+
     # "hdr test". Take an HDR capture.
     print("    hdr test")
     executable = os.path.join(exe_dir, 'libcamera-still')
@@ -434,6 +790,8 @@ def test_all(apps, exe_dir, output_dir, json_dir):
             test_vid(exe_dir, output_dir)
         if 'raw' in apps:
             test_raw(exe_dir, output_dir)
+        if 'still-stream' in apps:
+            test_still_stream(exe_dir, output_dir)
         if 'post-processing' in apps:
             test_post_processing(exe_dir, output_dir, json_dir)
 
@@ -15,7 +15,8 @@ except ImportError:
 def read_times(file):
     with open(file) as f:
         f.readline()  # there's one header line we must skip
-        return [float(line) for line in f.readlines()]
+        # Files from a synchronised rig have the rig-global time in a second column.
+        return [float(line.split()[0]) for line in f.readlines()]
 
 
 def get_differences(items):
@@ -0,0 +1,99 @@
+#!/usr/bin/python3
+#
+# libcamera-apps trigger log reader
+# Copyright (C) 2022, Raspberry Pi Ltd.
+#
+# Reads the --trigger-log files written by libcamera-still-stream, and reports how
+# long each camera took from the trigger edge to the frame being exposed, encoded
+# and written. Given the logs from several cameras of a rig, it also matches up
+# the triggers they saw and reports how far apart their chosen frames were.
+import argparse
+import struct
+import sys
+
+HEADER = struct.Struct('<4I32s')
+RECORD = struct.Struct('<Q5qiI')
+MAGIC = 0x6c677274
+
+
+def read_log(file):
+    with open(file, 'rb') as f:
+        magic, version, record_size, camera, node = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC:
+            raise RuntimeError(f'{file} is not a trigger log')
+        if version != 1 or record_size < RECORD.size:
+            raise RuntimeError(f'{file} has unsupported version {version}')
+        records = []
+        while True:
+            data = f.read(record_size)
+            if len(data) < record_size:
+                break
+            trigger, edge, sensor, encoded, written, offset, exposure, synced = RECORD.unpack(data[:RECORD.size])
+            records.append({'trigger': trigger, 'edge': edge, 'sensor': sensor, 'encoded': encoded,
+                            'written': written, 'offset': offset if synced else None, 'exposure': exposure})
+        records.sort(key=lambda r: r['trigger'])
+        name = node.split(b'\0')[0].decode() + f':{camera}'
+        return name, records
+
+
+def summary(values):
+    # Milliseconds, from nanoseconds.
+    if not values:
+        return 'none'
+    values = sorted(v / 1e6 for v in values)
+    p95 = values[min(len(values) - 1, int(len(values) * 0.95))]
+    return f'min {values[0]:.3f} median {values[len(values) // 2]:.3f} ' \
+           f'p95 {p95:.3f} max {values[-1]:.3f} ms ({len(values)})'
+
+
+def latencies(name, records):
+    # Frames that never came out have zero for the times they didn't reach.
+    print(f'{name}: {len(records)} triggers')
+    print('    exposure:', summary([r['sensor'] - r['edge'] for r in records if r['sensor']]))
+    print('    encoded: ', summary([r['encoded'] - r['edge'] for r in records if r['encoded']]))
+    print('    written: ', summary([r['written'] - r['edge'] for r in records if r['written']]))
+    lost = sum(1 for r in records if not r['written'])
+    if lost:
+        print(f'    {lost} triggers never written')
+
+
+def match(logs, tolerance):
+    # The same trigger reaches every node at about the same rig-global time, so group
+    # the edges from each log that are within the tolerance of each other, oldest first.
+    nodes = [[r for r in records if r['offset'] is not None] for _, records in logs]
+    heads = [0] * len(nodes)
+    groups = []
+    while all(head < len(records) for head, records in zip(heads, nodes)):
+        fronts = [records[head] for head, records in zip(heads, nodes)]
+        edges = [r['edge'] + r['offset'] for r in fronts]
+        newest = max(edges)
+        complete = True
+        for i, edge in enumerate(edges):
+            if edge < newest - tolerance:
+                heads[i] += 1
+                complete = False
+        if complete:
+            groups.append(fronts)
+            heads = [head + 1 for head in heads]
+    return groups
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='libcamera-apps trigger log reader')
+    parser.add_argument('filenames', nargs='+', help='Trigger logs, one from each camera', type=str)
+    parser.add_argument('--tolerance', '-t', help='Most rig-global time between matching edges (ms)',
+                        type=float, default=5.0)
+    args = parser.parse_args()
+
+    logs = [read_log(file) for file in args.filenames]
+    for name, records in logs:
+        latencies(name, records)
+
+    if len(logs) > 1:
+        groups = match(logs, args.tolerance * 1e6)
+        print(f'Triggers seen by every camera: {len(groups)}')
+        skews = [max(r['sensor'] + r['offset'] for r in group) - min(r['sensor'] + r['offset'] for r in group)
+                 for group in groups if all(r['sensor'] for r in group)]
+        print('Frame skew:', summary(skews))
+        sys.exit(0 if groups else 1)
+    sys.exit(0 if any(records for _, records in logs) else 1)